@@ -0,0 +1,217 @@
+/* arena.c - per-connection arena package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Per-connection memory comes from here: each connection gets one block
+** at startup, the request's strings get carved out of it, and the whole
+** thing is reset when the connection slot is reused.  That keeps memory
+** per connection predictable and the allocator out of the request path,
+** and it means the request code needs no static buffers.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "arena.h"
+
+
+/* Defines. */
+#define ALIGNMENT sizeof(void*)
+#define ROUNDUP(n) ( ( (n) + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 ) )
+#ifndef MIN_CHUNK_SIZE
+#define MIN_CHUNK_SIZE 1024
+#endif
+#ifndef MIN_STR_SIZE
+#define MIN_STR_SIZE 60
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/* The overflow chunk header.  The memory follows it. */
+struct ArenaChunkStruct {
+    struct ArenaChunkStruct* next;
+    };
+#define CHUNK_HEADER ROUNDUP( sizeof(ArenaChunk) )
+
+
+/* Globals. */
+static int arena_count = 0;
+static size_t arena_bytes = 0;
+static long stats_chunks = 0;
+static long stats_chunk_bytes = 0;
+static long stats_copies = 0;
+
+
+static void
+oom( size_t size )
+    {
+    syslog(
+	LOG_CRIT, "out of memory allocating %ld bytes of arena", (long) size );
+    exit( 1 );
+    }
+
+
+void
+arena_init( Arena* ar, size_t size )
+    {
+    ar->size = ROUNDUP( size );
+    if ( ar->size > 0 )
+	{
+	ar->base = (char*) malloc( ar->size );
+	if ( ar->base == (char*) 0 )
+	    oom( ar->size );
+	}
+    else
+	ar->base = (char*) 0;
+    ar->next = ar->base;
+    ar->end = ar->base + ar->size;
+    ar->last = (char*) 0;
+    ar->chunks = (ArenaChunk*) 0;
+    ++arena_count;
+    arena_bytes += ar->size;
+    }
+
+
+static char*
+get( Arena* ar, size_t size )
+    {
+    ArenaChunk* ch;
+    size_t csize;
+    char* p;
+
+    size = ROUNDUP( size );
+    if ( size > (size_t) ( ar->end - ar->next ) )
+	{
+	/* Start a new chunk.  Whatever was left in the old one is wasted
+	** until the reset, which is why chunks aren't tiny.
+	*/
+	csize = MAX( size, MAX( ar->size, MIN_CHUNK_SIZE ) );
+	ch = (ArenaChunk*) malloc( CHUNK_HEADER + csize );
+	if ( ch == (ArenaChunk*) 0 )
+	    oom( csize );
+	ch->next = ar->chunks;
+	ar->chunks = ch;
+	ar->next = (char*) ch + CHUNK_HEADER;
+	ar->end = ar->next + csize;
+	++stats_chunks;
+	stats_chunk_bytes += csize;
+	}
+    p = ar->next;
+    ar->next += size;
+    ar->last = p;
+    return p;
+    }
+
+
+void*
+arena_alloc( Arena* ar, size_t size )
+    {
+    return (void*) get( ar, size );
+    }
+
+
+void
+arena_str( Arena* ar, char** strP, size_t* maxsizeP, size_t size )
+    {
+    size_t newmax;
+    char* old;
+
+    if ( *maxsizeP == 0 )
+	{
+	*maxsizeP = MAX( MIN_STR_SIZE, size + size / 4 );
+	*strP = get( ar, *maxsizeP + 1 );
+	return;
+	}
+    if ( size <= *maxsizeP )
+	return;
+    newmax = MAX( *maxsizeP * 2, size * 5 / 4 );
+
+    /* If nothing got allocated after it, it can just grow. */
+    if ( *strP == ar->last &&
+	 ROUNDUP( newmax + 1 ) <= (size_t) ( ar->end - *strP ) )
+	{
+	ar->next = *strP + ROUNDUP( newmax + 1 );
+	*maxsizeP = newmax;
+	return;
+	}
+
+    old = *strP;
+    *strP = get( ar, newmax + 1 );
+    (void) memcpy( *strP, old, *maxsizeP + 1 );
+    *maxsizeP = newmax;
+    ++stats_copies;
+    }
+
+
+void
+arena_reset( Arena* ar )
+    {
+    ArenaChunk* ch;
+    ArenaChunk* next;
+
+    for ( ch = ar->chunks; ch != (ArenaChunk*) 0; ch = next )
+	{
+	next = ch->next;
+	free( (void*) ch );
+	}
+    ar->chunks = (ArenaChunk*) 0;
+    ar->next = ar->base;
+    ar->end = ar->base + ar->size;
+    ar->last = (char*) 0;
+    }
+
+
+void
+arena_free( Arena* ar )
+    {
+    arena_reset( ar );
+    if ( ar->base != (char*) 0 )
+	free( (void*) ar->base );
+    --arena_count;
+    arena_bytes -= ar->size;
+    ar->base = ar->next = ar->end = (char*) 0;
+    ar->size = 0;
+    }
+
+
+/* Generate debugging statistics syslog message. */
+void
+arena_logstats( long secs )
+    {
+    if ( arena_count == 0 )
+	return;
+    syslog( LOG_NOTICE,
+	"  arena - %d arenas (%lu bytes), %ld overflow chunks (%ld bytes), %ld strings copied",
+	arena_count, (unsigned long) arena_bytes, stats_chunks,
+	stats_chunk_bytes, stats_copies );
+    stats_chunks = stats_chunk_bytes = stats_copies = 0;
+    }
@@ -0,0 +1,72 @@
+/* arena.h - header file for per-connection arena package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <sys/types.h>
+
+/* An arena hands out scratch memory by bumping a pointer through a block
+** that belongs to its owner, usually a connection.  Nothing gets freed
+** piece by piece; arena_reset() takes everything back at once and keeps
+** the block for next time.  Allocations that don't fit go into overflow
+** chunks, which the reset does free.
+*/
+typedef struct ArenaChunkStruct ArenaChunk;
+typedef struct {
+    char* base;		/* the block that survives resets */
+    size_t size;
+    char* next;		/* where the next allocation starts */
+    char* end;		/* end of the block or chunk in use */
+    char* last;		/* most recent allocation, can grow in place */
+    ArenaChunk* chunks;	/* overflow, freed by arena_reset() */
+    } Arena;
+
+/* Set up an arena with a block of the given size, which may be 0. */
+void arena_init( Arena* ar, size_t size );
+
+/* Returns size bytes, aligned for pointers.  Never fails; running out
+** of memory is fatal.
+*/
+void* arena_alloc( Arena* ar, size_t size );
+
+/* Like httpd_realloc_str(), but the string lives in the arena.  Set
+** *maxsizeP to 0 to start a new string.  A string that has to grow gets
+** copied, unless it was the last thing allocated and there's room.
+*/
+void arena_str( Arena* ar, char** strP, size_t* maxsizeP, size_t size );
+
+/* Take back everything allocated since the last reset. */
+void arena_reset( Arena* ar );
+
+/* Free all storage. */
+void arena_free( Arena* ar );
+
+/* Generate debugging statistics syslog message. */
+void arena_logstats( long secs );
+
+#endif /* _ARENA_H_ */
@@ -0,0 +1,433 @@
+/* authcache.c - password file cache package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Password files get parsed once into a hash table of users, and parsed
+** again only when their mtime, size or inode changes.  Since crypt() is
+** slow on purpose, a password that checked out is also remembered for a
+** while, as a keyed digest rather than the password itself, so pages
+** with lots of images don't pay for crypt() on every one.  The digest is
+** SipHash-2-4 with a random key, so nobody can come up with a different
+** password that matches without knowing the key.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+
+#ifdef HAVE_CRYPT_H
+#include <crypt.h>
+#endif
+
+#include "authcache.h"
+#include "libhttpd.h"
+
+
+/* Defines. */
+#ifndef AUTH_CACHE_TIME
+#define AUTH_CACHE_TIME 0
+#endif
+#ifndef FILE_EXPIRE_AGE
+#define FILE_EXPIRE_AGE 600
+#endif
+#ifndef FILE_HASH_SIZE
+#define FILE_HASH_SIZE 64
+#endif
+
+
+/* The User struct. */
+typedef struct UserStruct {
+    char* user;
+    char* cryp;
+    unsigned long long digest;
+    time_t verified_until;
+    struct UserStruct* next;
+    } User;
+
+/* The PwFile struct. */
+typedef struct PwFileStruct {
+    char* filename;
+    time_t mtime;
+    off_t size;
+    ino_t ino;
+    time_t used_at;
+    User** users;
+    unsigned int hash_mask;
+    int num_users;
+    struct PwFileStruct* next;
+    } PwFile;
+
+
+/* Globals. */
+static PwFile* files[FILE_HASH_SIZE];
+static int file_count = 0;
+static unsigned long long key[2];
+static int have_key = 0;
+static long stats_checks = 0, stats_crypts = 0, stats_loads = 0;
+
+
+/* Forwards. */
+static PwFile* load_file( char* filename, struct stat* sbP );
+static void free_file( PwFile* pf );
+static unsigned int hash( char* str );
+static unsigned long long siphash( char* str );
+
+
+void
+authcache_init( void )
+    {
+    int fd;
+    ssize_t r;
+
+    fd = open( "/dev/urandom", O_RDONLY );
+    if ( fd < 0 )
+	{
+	syslog( LOG_WARNING, "/dev/urandom - %m - passwords won't be cached" );
+	return;
+	}
+    r = read( fd, (void*) key, sizeof(key) );
+    (void) close( fd );
+    if ( r == sizeof(key) )
+	have_key = 1;
+    }
+
+
+int
+authcache_check(
+    char* filename, struct stat* sbP, char* user, char* password,
+    struct timeval* nowP )
+    {
+    time_t now;
+    unsigned int h;
+    PwFile** pfp;
+    PwFile* pf;
+    User* u;
+    unsigned long long digest;
+
+    /* Get the current time, if necessary. */
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+    ++stats_checks;
+
+    /* Find the file, and check that it hasn't changed. */
+    h = hash( filename ) & ( FILE_HASH_SIZE - 1 );
+    for ( pfp = &files[h]; *pfp != (PwFile*) 0; pfp = &(*pfp)->next )
+	if ( strcmp( (*pfp)->filename, filename ) == 0 )
+	    break;
+    pf = *pfp;
+    if ( pf != (PwFile*) 0 &&
+	 ( pf->mtime != sbP->st_mtime || pf->size != sbP->st_size ||
+	   pf->ino != sbP->st_ino ) )
+	{
+	*pfp = pf->next;
+	free_file( pf );
+	--file_count;
+	pf = (PwFile*) 0;
+	}
+    if ( pf == (PwFile*) 0 )
+	{
+	pf = load_file( filename, sbP );
+	if ( pf == (PwFile*) 0 )
+	    return AC_ERROR;
+	pf->next = files[h];
+	files[h] = pf;
+	++file_count;
+	}
+    pf->used_at = now;
+
+    /* Find the user. */
+    for ( u = pf->users[hash( user ) & pf->hash_mask]; u != (User*) 0;
+	  u = u->next )
+	if ( strcmp( u->user, user ) == 0 )
+	    break;
+    if ( u == (User*) 0 )
+	return AC_DENIED;
+
+    /* Is this the password that checked out recently? */
+    digest = 0;
+    if ( have_key && AUTH_CACHE_TIME > 0 )
+	{
+	digest = siphash( password );
+	if ( now < u->verified_until && digest == u->digest )
+	    return AC_OK;
+	}
+
+    /* Do it the slow way. */
+    ++stats_crypts;
+    if ( strcmp( crypt( password, u->cryp ), u->cryp ) != 0 )
+	return AC_DENIED;
+    if ( have_key && AUTH_CACHE_TIME > 0 )
+	{
+	u->digest = digest;
+	u->verified_until = now + AUTH_CACHE_TIME;
+	}
+    return AC_OK;
+    }
+
+
+void
+authcache_cleanup( struct timeval* nowP )
+    {
+    time_t now;
+    int h;
+    PwFile** pfp;
+    PwFile* pf;
+
+    /* Get the current time, if necessary. */
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+
+    for ( h = 0; h < FILE_HASH_SIZE; ++h )
+	for ( pfp = &files[h]; *pfp != (PwFile*) 0; )
+	    {
+	    pf = *pfp;
+	    if ( now - pf->used_at >= FILE_EXPIRE_AGE )
+		{
+		*pfp = pf->next;
+		free_file( pf );
+		--file_count;
+		}
+	    else
+		pfp = &pf->next;
+	    }
+    }
+
+
+void
+authcache_term( void )
+    {
+    int h;
+    PwFile* pf;
+
+    for ( h = 0; h < FILE_HASH_SIZE; ++h )
+	while ( files[h] != (PwFile*) 0 )
+	    {
+	    pf = files[h];
+	    files[h] = pf->next;
+	    free_file( pf );
+	    }
+    file_count = 0;
+    }
+
+
+/* Read a password file into a new PwFile.  Returns 0 on errors. */
+static PwFile*
+load_file( char* filename, struct stat* sbP )
+    {
+    FILE* fp;
+    char line[500];
+    char* cryp;
+    size_t l;
+    int n, hash_size;
+    unsigned int h;
+    PwFile* pf;
+    User* u;
+
+    fp = fopen( filename, "r" );
+    if ( fp == (FILE*) 0 )
+	return (PwFile*) 0;
+    ++stats_loads;
+
+    /* Size the hash table by counting lines. */
+    n = 0;
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
+	++n;
+    for ( hash_size = 16; hash_size < n * 2; hash_size *= 2 )
+	;
+    rewind( fp );
+
+    pf = NEW( PwFile, 1 );
+    if ( pf != (PwFile*) 0 )
+	{
+	pf->filename = strdup( filename );
+	pf->users = NEW( User*, hash_size );
+	}
+    if ( pf == (PwFile*) 0 || pf->filename == (char*) 0 ||
+	 pf->users == (User**) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a password file" );
+	exit( 1 );
+	}
+    (void) memset( (void*) pf->users, 0, hash_size * sizeof(User*) );
+    pf->hash_mask = hash_size - 1;
+    pf->num_users = 0;
+    pf->mtime = sbP->st_mtime;
+    pf->size = sbP->st_size;
+    pf->ino = sbP->st_ino;
+
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
+	{
+	/* Nuke newline. */
+	l = strlen( line );
+	if ( l > 0 && line[l - 1] == '\n' )
+	    line[l - 1] = '\0';
+	/* Split into user and encrypted password. */
+	cryp = strchr( line, ':' );
+	if ( cryp == (char*) 0 )
+	    continue;
+	*cryp++ = '\0';
+	/* The first entry for a user wins. */
+	h = hash( line ) & pf->hash_mask;
+	for ( u = pf->users[h]; u != (User*) 0; u = u->next )
+	    if ( strcmp( u->user, line ) == 0 )
+		break;
+	if ( u != (User*) 0 )
+	    continue;
+	u = NEW( User, 1 );
+	if ( u != (User*) 0 )
+	    {
+	    u->user = strdup( line );
+	    u->cryp = strdup( cryp );
+	    }
+	if ( u == (User*) 0 || u->user == (char*) 0 || u->cryp == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory allocating a password file user" );
+	    exit( 1 );
+	    }
+	u->digest = 0;
+	u->verified_until = 0;
+	u->next = pf->users[h];
+	pf->users[h] = u;
+	++pf->num_users;
+	}
+    (void) fclose( fp );
+    return pf;
+    }
+
+
+static void
+free_file( PwFile* pf )
+    {
+    unsigned int h;
+    User* u;
+
+    for ( h = 0; h <= pf->hash_mask; ++h )
+	while ( pf->users[h] != (User*) 0 )
+	    {
+	    u = pf->users[h];
+	    pf->users[h] = u->next;
+	    /* Don't leave crypt strings lying around in freed memory. */
+	    (void) memset( (void*) u->cryp, 0, strlen( u->cryp ) );
+	    free( (void*) u->user );
+	    free( (void*) u->cryp );
+	    free( (void*) u );
+	    }
+    free( (void*) pf->users );
+    free( (void*) pf->filename );
+    free( (void*) pf );
+    }
+
+
+static unsigned int
+hash( char* str )
+    {
+    unsigned int h = 177573;
+
+    for ( ; *str != '\0'; ++str )
+	{
+	h ^= (unsigned char) *str;
+	h += h << 5;
+	}
+    return h;
+    }
+
+
+/* SipHash-2-4 of a string, with our random key. */
+#define ROTL(x,b) ( ( (x) << (b) ) | ( (x) >> ( 64 - (b) ) ) )
+#define SIPROUND \
+    do { \
+	v0 += v1; v1 = ROTL( v1, 13 ); v1 ^= v0; v0 = ROTL( v0, 32 ); \
+	v2 += v3; v3 = ROTL( v3, 16 ); v3 ^= v2; \
+	v0 += v3; v3 = ROTL( v3, 21 ); v3 ^= v0; \
+	v2 += v1; v1 = ROTL( v1, 17 ); v1 ^= v2; v2 = ROTL( v2, 32 ); \
+    } while ( 0 )
+
+static unsigned long long
+siphash( char* str )
+    {
+    unsigned long long v0, v1, v2, v3, m;
+    unsigned char* cp = (unsigned char*) str;
+    size_t len, i;
+
+    v0 = key[0] ^ 0x736f6d6570736575ULL;
+    v1 = key[1] ^ 0x646f72616e646f6dULL;
+    v2 = key[0] ^ 0x6c7967656e657261ULL;
+    v3 = key[1] ^ 0x7465646279746573ULL;
+    len = strlen( str );
+
+    for ( ; len - ( cp - (unsigned char*) str ) >= 8; cp += 8 )
+	{
+	m = 0;
+	for ( i = 0; i < 8; ++i )
+	    m |= (unsigned long long) cp[i] << ( 8 * i );
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+	}
+    m = (unsigned long long) ( len & 0xff ) << 56;
+    for ( i = 0; cp[i] != '\0'; ++i )
+	m |= (unsigned long long) cp[i] << ( 8 * i );
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+
+/* Generate debugging statistics syslog message. */
+void
+authcache_logstats( long secs )
+    {
+    if ( stats_checks == 0 && file_count == 0 )
+	return;
+    syslog( LOG_NOTICE,
+	"  auth cache - %d files, %ld checks (%g/sec), %ld crypts, %ld file loads",
+	file_count, stats_checks, (float) stats_checks / secs, stats_crypts,
+	stats_loads );
+    stats_checks = stats_crypts = stats_loads = 0;
+    }
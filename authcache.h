@@ -0,0 +1,67 @@
+/* authcache.h - header file for password file cache package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _AUTHCACHE_H_
+#define _AUTHCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Sets up the key for remembering verified passwords.  Call this before
+** any chroot(), since it wants /dev/urandom.  Without it, every check
+** runs crypt().
+*/
+void authcache_init( void );
+
+/* Checks a user and password against an htpasswd-style file, given a
+** stat buffer for it.  The file gets read into a hash table the first
+** time and again whenever it changes.  If you have the current time,
+** pass it in, otherwise pass 0.  Returns AC_OK, AC_DENIED if there's no
+** such user or the password is wrong, or AC_ERROR if the file can't be
+** read, with errno set.
+*/
+int authcache_check(
+    char* filename, struct stat* sbP, char* user, char* password,
+    struct timeval* nowP );
+#define AC_OK 0
+#define AC_DENIED 1
+#define AC_ERROR 2
+
+/* Frees files that haven't been used in a while.  This should be called
+** periodically.  If you have the current time, pass it in, otherwise
+** pass 0.
+*/
+void authcache_cleanup( struct timeval* nowP );
+
+/* Free all storage, usually in preparation for exitting. */
+void authcache_term( void );
+
+/* Generate debugging statistics syslog message. */
+void authcache_logstats( long secs );
+
+#endif /* _AUTHCACHE_H_ */
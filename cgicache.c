@@ -0,0 +1,555 @@
+/* cgicache.c - CGI response cache package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Responses from CGI programs that say they're cacheable are kept here
+** in memory, keyed on the script and query, for as long as their
+** Cache-Control max-age allows.  While one request is producing an
+** entry, others for the same key are told to wait rather than start
+** another copy of the program.  Deciding what's cacheable, and actually
+** serving the hits, is up to libhttpd.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "cgicache.h"
+#include "libhttpd.h"
+
+
+/* Defines. */
+#ifndef CGI_CACHE_SIZE
+#define CGI_CACHE_SIZE 10000000
+#endif
+#ifndef CGI_CACHE_MAX_RESPONSE
+#define CGI_CACHE_MAX_RESPONSE 1000000
+#endif
+#ifndef CGI_CACHE_MAX_ENTRIES
+#define CGI_CACHE_MAX_ENTRIES 10000
+#endif
+#ifndef PASS_TIME
+#define PASS_TIME 60
+#endif
+#ifndef HASH_SIZE
+#define HASH_SIZE (1 << 10)
+#endif
+
+
+/* The Entry struct. */
+typedef struct EntryStruct {
+    char* key;
+    unsigned int hash;
+    int state;
+    int refcount;
+    int linked;
+    time_t expires;
+    int max_age;
+    int status;
+    char* headers;
+    size_t maxheaders, headers_len;
+    char* body;
+    size_t maxbody, body_len;
+    size_t overhead;
+    struct EntryStruct* next;
+    struct EntryStruct* lru_prev;
+    struct EntryStruct* lru_next;
+    } Entry;
+
+/* States. */
+#define ES_FILLING 0
+#define ES_READY 1
+#define ES_PASS 2
+
+
+/* Globals. */
+static Entry* hash_table[HASH_SIZE];
+static Entry* lru_head = (Entry*) 0;	/* most recently used */
+static Entry* lru_tail = (Entry*) 0;	/* least recently used */
+static int entry_count = 0;
+static size_t cached_bytes = 0;
+static int generation = 0;
+static long stats_hits = 0, stats_misses = 0, stats_waits = 0;
+static long stats_evictions = 0;
+
+
+/* Forwards. */
+static int grow( char** bufP, size_t* maxP, size_t size );
+static void trim( char** bufP, size_t* maxP, size_t size );
+static int make_room( size_t size, int entries );
+static void lru_add( Entry* e );
+static void lru_remove( Entry* e );
+static void unlink_entry( Entry* e );
+static void free_entry( Entry* e );
+static unsigned int hash( char* key );
+
+
+int
+cgicache_lookup( char* key, struct timeval* nowP, void** entryP )
+    {
+    time_t now;
+    unsigned int h;
+    Entry* e;
+
+    /* Get the current time, if necessary. */
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+
+    h = hash( key );
+    for ( e = hash_table[h]; e != (Entry*) 0; e = e->next )
+	if ( strcmp( e->key, key ) == 0 )
+	    break;
+    if ( e != (Entry*) 0 )
+	{
+	if ( e->state == ES_FILLING )
+	    {
+	    ++stats_waits;
+	    return CGC_BUSY;
+	    }
+	if ( now < e->expires )
+	    {
+	    lru_remove( e );
+	    lru_add( e );
+	    if ( e->state == ES_PASS )
+		return CGC_PASS;
+	    ++e->refcount;
+	    ++stats_hits;
+	    *entryP = (void*) e;
+	    return CGC_HIT;
+	    }
+	/* Stale.  Get rid of it, or at least take it out of the table if
+	** someone's still sending it.
+	*/
+	unlink_entry( e );
+	if ( e->refcount == 0 )
+	    free_entry( e );
+	}
+
+    /* Make a new entry for the caller to fill, if there's room for one.
+    ** The key and the struct count against the cache size too, or lots
+    ** of different query strings could eat unlimited memory.
+    */
+    if ( make_room( sizeof(Entry) + strlen( key ) + 1, 1 ) < 0 )
+	return CGC_PASS;
+    e = NEW( Entry, 1 );
+    if ( e == (Entry*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a CGI cache entry" );
+	exit( 1 );
+	}
+    e->key = strdup( key );
+    if ( e->key == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory copying a CGI cache key" );
+	exit( 1 );
+	}
+    e->hash = h;
+    e->state = ES_FILLING;
+    e->refcount = 0;
+    e->expires = 0;
+    e->max_age = 0;
+    e->status = 0;
+    e->headers = e->body = (char*) 0;
+    e->maxheaders = e->headers_len = 0;
+    e->maxbody = e->body_len = 0;
+    e->overhead = sizeof(Entry) + strlen( key ) + 1;
+    cached_bytes += e->overhead;
+    e->next = hash_table[h];
+    hash_table[h] = e;
+    e->linked = 1;
+    lru_add( e );
+    ++entry_count;
+    ++stats_misses;
+    *entryP = (void*) e;
+    return CGC_MISS;
+    }
+
+
+void
+cgicache_get(
+    void* entry, int* statusP, char** headersP, size_t* headers_lenP,
+    char** bodyP, size_t* body_lenP )
+    {
+    Entry* e = (Entry*) entry;
+
+    *statusP = e->status;
+    *headersP = e->headers;
+    *headers_lenP = e->headers_len;
+    *bodyP = e->body;
+    *body_lenP = e->body_len;
+    }
+
+
+void
+cgicache_release( void* entry )
+    {
+    Entry* e = (Entry*) entry;
+
+    --e->refcount;
+    if ( e->refcount < 0 )
+	{
+	syslog( LOG_ERR, "cgicache_release refcount went negative!" );
+	e->refcount = 0;
+	}
+    if ( e->refcount == 0 && ! e->linked )
+	free_entry( e );
+    }
+
+
+int
+cgicache_set_headers(
+    void* entry, int status, char* headers, size_t len, int max_age )
+    {
+    Entry* e = (Entry*) entry;
+
+    if ( len > CGI_CACHE_MAX_RESPONSE ||
+	 grow( &e->headers, &e->maxheaders, len ) < 0 )
+	{
+	cgicache_uncacheable( entry, (struct timeval*) 0 );
+	return -1;
+	}
+    e->status = status;
+    e->max_age = max_age;
+    (void) memmove( e->headers, headers, len );
+    e->headers_len = len;
+    return 0;
+    }
+
+
+int
+cgicache_add_body( void* entry, char* data, size_t len )
+    {
+    Entry* e = (Entry*) entry;
+
+    if ( e->headers_len + e->body_len + len > CGI_CACHE_MAX_RESPONSE ||
+	 grow( &e->body, &e->maxbody, e->body_len + len ) < 0 )
+	{
+	cgicache_uncacheable( entry, (struct timeval*) 0 );
+	return -1;
+	}
+    (void) memmove( &(e->body[e->body_len]), data, len );
+    e->body_len += len;
+    return 0;
+    }
+
+
+void
+cgicache_finish( void* entry, struct timeval* nowP )
+    {
+    Entry* e = (Entry*) entry;
+    time_t now;
+
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+    trim( &e->body, &e->maxbody, e->body_len );
+    e->state = ES_READY;
+    e->expires = now + e->max_age;
+    ++generation;
+    }
+
+
+void
+cgicache_uncacheable( void* entry, struct timeval* nowP )
+    {
+    Entry* e = (Entry*) entry;
+    time_t now;
+
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+
+    /* Keep the key as a placeholder, but not the data. */
+    cached_bytes -= e->maxheaders + e->maxbody;
+    free( (void*) e->headers );
+    free( (void*) e->body );
+    e->headers = e->body = (char*) 0;
+    e->maxheaders = e->headers_len = 0;
+    e->maxbody = e->body_len = 0;
+    e->state = ES_PASS;
+    e->expires = now + PASS_TIME;
+    ++generation;
+    }
+
+
+void
+cgicache_abandon( void* entry )
+    {
+    Entry* e = (Entry*) entry;
+
+    unlink_entry( e );
+    free_entry( e );
+    ++generation;
+    }
+
+
+int
+cgicache_generation( void )
+    {
+    return generation;
+    }
+
+
+void
+cgicache_cleanup( struct timeval* nowP )
+    {
+    time_t now;
+    int h;
+    Entry** ep;
+    Entry* e;
+
+    /* Get the current time, if necessary. */
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+
+    /* Free everything that has expired, except what's still being
+    ** filled or sent.
+    */
+    for ( h = 0; h < HASH_SIZE; ++h )
+	for ( ep = &hash_table[h]; *ep != (Entry*) 0; )
+	    {
+	    e = *ep;
+	    if ( e->state != ES_FILLING && e->refcount == 0 &&
+		 now >= e->expires )
+		{
+		*ep = e->next;
+		e->linked = 0;
+		lru_remove( e );
+		--entry_count;
+		free_entry( e );
+		}
+	    else
+		ep = &e->next;
+	    }
+    }
+
+
+void
+cgicache_term( void )
+    {
+    int h;
+    Entry* e;
+
+    for ( h = 0; h < HASH_SIZE; ++h )
+	while ( hash_table[h] != (Entry*) 0 )
+	    {
+	    e = hash_table[h];
+	    hash_table[h] = e->next;
+	    free_entry( e );
+	    }
+    lru_head = lru_tail = (Entry*) 0;
+    entry_count = 0;
+    }
+
+
+/* Make sure a buffer can hold at least size bytes.  Unlike
+** httpd_realloc_str() these get freed again, and what they allocate
+** counts against the cache size.  Returns -1 if there's no room.
+*/
+static int
+grow( char** bufP, size_t* maxP, size_t size )
+    {
+    size_t newmax;
+
+    if ( *bufP != (char*) 0 && size <= *maxP )
+	return 0;
+    newmax = MAX( MAX( *maxP * 2, size ), 1000 );
+    if ( make_room( newmax - *maxP, 0 ) < 0 )
+	return -1;
+    if ( *bufP == (char*) 0 )
+	*bufP = NEW( char, newmax );
+    else
+	*bufP = RENEW( *bufP, char, newmax );
+    if ( *bufP == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory growing a CGI cache entry" );
+	exit( 1 );
+	}
+    cached_bytes += newmax - *maxP;
+    *maxP = newmax;
+    return 0;
+    }
+
+
+/* Give back a finished buffer's slack.  Even an empty body needs an
+** address.
+*/
+static void
+trim( char** bufP, size_t* maxP, size_t size )
+    {
+    char* buf;
+
+    size = MAX( size, 1 );
+    if ( *bufP != (char*) 0 && size >= *maxP )
+	return;
+    if ( *bufP == (char*) 0 )
+	buf = NEW( char, size );
+    else
+	buf = RENEW( *bufP, char, size );
+    if ( buf == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory trimming a CGI cache entry" );
+	exit( 1 );
+	}
+    *bufP = buf;
+    cached_bytes += size - *maxP;
+    *maxP = size;
+    }
+
+
+/* Evicts least recently used entries until there's room for size more
+** bytes and the given number of new entries.  Entries being filled or
+** sent can't go.  Returns -1 if that's still not enough.
+*/
+static int
+make_room( size_t size, int entries )
+    {
+    Entry* e;
+    Entry* prev;
+
+    for ( e = lru_tail;
+	  e != (Entry*) 0 &&
+	    ( cached_bytes + size > CGI_CACHE_SIZE ||
+	      entry_count + entries > CGI_CACHE_MAX_ENTRIES );
+	  e = prev )
+	{
+	prev = e->lru_prev;
+	if ( e->state != ES_FILLING && e->refcount == 0 )
+	    {
+	    unlink_entry( e );
+	    free_entry( e );
+	    ++stats_evictions;
+	    }
+	}
+    if ( cached_bytes + size > CGI_CACHE_SIZE ||
+	 entry_count + entries > CGI_CACHE_MAX_ENTRIES )
+	return -1;
+    return 0;
+    }
+
+
+/* Puts an entry at the most recently used end of the LRU list. */
+static void
+lru_add( Entry* e )
+    {
+    e->lru_prev = (Entry*) 0;
+    e->lru_next = lru_head;
+    if ( lru_head != (Entry*) 0 )
+	lru_head->lru_prev = e;
+    else
+	lru_tail = e;
+    lru_head = e;
+    }
+
+
+static void
+lru_remove( Entry* e )
+    {
+    if ( e->lru_prev != (Entry*) 0 )
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	lru_head = e->lru_next;
+    if ( e->lru_next != (Entry*) 0 )
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = (Entry*) 0;
+    }
+
+
+/* Take an entry out of the hash table and the LRU list.  It's freed
+** separately.
+*/
+static void
+unlink_entry( Entry* e )
+    {
+    Entry** ep;
+
+    if ( ! e->linked )
+	return;
+    for ( ep = &hash_table[e->hash]; *ep != (Entry*) 0; ep = &(*ep)->next )
+	if ( *ep == e )
+	    {
+	    *ep = e->next;
+	    break;
+	    }
+    e->linked = 0;
+    lru_remove( e );
+    --entry_count;
+    }
+
+
+static void
+free_entry( Entry* e )
+    {
+    cached_bytes -= e->overhead + e->maxheaders + e->maxbody;
+    free( (void*) e->key );
+    free( (void*) e->headers );
+    free( (void*) e->body );
+    free( (void*) e );
+    }
+
+
+static unsigned int
+hash( char* key )
+    {
+    unsigned int h = 177573;
+
+    for ( ; *key != '\0'; ++key )
+	{
+	h ^= (unsigned char) *key;
+	h += h << 5;
+	}
+    return h & ( HASH_SIZE - 1 );
+    }
+
+
+/* Generate debugging statistics syslog message. */
+void
+cgicache_logstats( long secs )
+    {
+    if ( entry_count == 0 && stats_hits == 0 && stats_misses == 0 )
+	return;
+    syslog( LOG_NOTICE,
+	"  CGI cache - %d entries (%lld bytes), %ld hits (%g/sec), %ld misses, %ld waits, %ld evictions",
+	entry_count, (long long) cached_bytes, stats_hits,
+	(float) stats_hits / secs, stats_misses, stats_waits,
+	stats_evictions );
+    stats_hits = stats_misses = stats_waits = stats_evictions = 0;
+    }
@@ -0,0 +1,104 @@
+/* cgicache.h - header file for CGI response cache package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _CGICACHE_H_
+#define _CGICACHE_H_
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/* Looks up a cached CGI response by key.  If you have the current time,
+** pass it in, otherwise pass 0.  Returns:
+**   CGC_HIT - *entryP is a complete response; get at it with
+**     cgicache_get() and give it back with cgicache_release().
+**   CGC_MISS - *entryP is a new, empty entry and the caller is expected
+**     to run the CGI and fill it in, ending with cgicache_finish(),
+**     cgicache_uncacheable() or cgicache_abandon().
+**   CGC_BUSY - another request is filling the entry; try again when
+**     cgicache_generation() changes.
+**   CGC_PASS - the response recently turned out not to be cacheable,
+**     or the cache is too full of busy entries to take a new one; just
+**     run the CGI.
+*/
+int cgicache_lookup( char* key, struct timeval* nowP, void** entryP );
+#define CGC_MISS 0
+#define CGC_HIT 1
+#define CGC_BUSY 2
+#define CGC_PASS 3
+
+/* Gets the parts of a complete response. */
+void cgicache_get(
+    void* entry, int* statusP, char** headersP, size_t* headers_lenP,
+    char** bodyP, size_t* body_lenP );
+
+/* Done with an entry returned as a hit. */
+void cgicache_release( void* entry );
+
+/* Sets the status and header block of an entry being filled, and how
+** many seconds it stays fresh once finished.  If there's no room for
+** the headers, the entry gets marked uncacheable and -1 is returned;
+** the caller should then forget about it.
+*/
+int cgicache_set_headers(
+    void* entry, int status, char* headers, size_t len, int max_age );
+
+/* Appends body bytes to an entry being filled.  If the response gets too
+** big to cache, the entry gets marked uncacheable and -1 is returned;
+** the caller should then forget about it.
+*/
+int cgicache_add_body( void* entry, char* data, size_t len );
+
+/* The entry is complete and can start serving hits. */
+void cgicache_finish( void* entry, struct timeval* nowP );
+
+/* The response can't be cached.  Lookups for a while after this say
+** CGC_PASS, so requests for it don't wait on each other.
+*/
+void cgicache_uncacheable( void* entry, struct timeval* nowP );
+
+/* The entry couldn't be filled after all, maybe the client went away.
+** It's discarded and the next request gets to try.
+*/
+void cgicache_abandon( void* entry );
+
+/* Changes whenever an entry stops being filled, so that requests which
+** got CGC_BUSY know when to look again.
+*/
+int cgicache_generation( void );
+
+/* Frees expired entries.  This should be called periodically.  If you
+** have the current time, pass it in, otherwise pass 0.
+*/
+void cgicache_cleanup( struct timeval* nowP );
+
+/* Free all storage, usually in preparation for exitting. */
+void cgicache_term( void );
+
+/* Generate debugging statistics syslog message. */
+void cgicache_logstats( long secs );
+
+#endif /* _CGICACHE_H_ */
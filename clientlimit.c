@@ -0,0 +1,321 @@
+/* clientlimit.c - per-client limit package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Each client address that has connections open, or has been making them
+** recently, gets an entry in a hash table.  The entry counts its open
+** connections and holds a token bucket for its connection rate.  IPv6
+** clients are keyed by their /64, since anyone with one address usually
+** has the whole block.  The hash is keyed with random bits, so a client
+** can't pick addresses that all land in the same chain.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+
+#include "clientlimit.h"
+#include "libhttpd.h"
+
+
+/* Defines. */
+#ifndef CLIENT_HASH_SIZE
+#define CLIENT_HASH_SIZE 1024
+#endif
+
+
+/* The Client struct. */
+typedef struct ClientStruct {
+    unsigned char addr[8];	/* IPv4 address, or IPv6 /64 */
+    int family;
+    int conns;
+    long tokens;		/* in thousandths of a connection */
+    struct timeval filled_at;
+    struct ClientStruct* next;
+    } Client;
+
+
+/* Globals. */
+static Client* clients[CLIENT_HASH_SIZE];
+static int client_count = 0;
+static int max_conns = 0, conn_rate = 0, conn_burst = 0;
+static unsigned int hash_key;
+static long stats_admitted = 0, stats_refused = 0;
+
+
+/* Forwards. */
+static int client_key( httpd_sockaddr* saP, unsigned char* addr );
+static unsigned int hash( int family, unsigned char* addr );
+static Client* find_client( httpd_sockaddr* saP, struct timeval* nowP );
+static void fill( Client* cl, struct timeval* nowP );
+
+
+void
+clientlimit_init( int maxconns, int rate, int burst )
+    {
+    int fd;
+
+    max_conns = maxconns;
+    conn_rate = rate;
+    conn_burst = burst;
+    if ( conn_rate > 0 && conn_burst <= 0 )
+	conn_burst = conn_rate;
+
+    fd = open( "/dev/urandom", O_RDONLY );
+    if ( fd < 0 ||
+	 read( fd, (void*) &hash_key, sizeof(hash_key) ) != sizeof(hash_key) )
+	hash_key = (unsigned int) time( (time_t*) 0 ) ^ (unsigned int) getpid();
+    if ( fd >= 0 )
+	(void) close( fd );
+    }
+
+
+int
+clientlimit_admit( httpd_sockaddr* saP, struct timeval* nowP )
+    {
+    struct timeval tv;
+    Client* cl;
+
+    if ( max_conns <= 0 && conn_rate <= 0 )
+	return 1;
+
+    /* Get the current time, if necessary. */
+    if ( nowP == (struct timeval*) 0 )
+	{
+	(void) gettimeofday( &tv, (struct timezone*) 0 );
+	nowP = &tv;
+	}
+
+    cl = find_client( saP, nowP );
+    if ( max_conns > 0 && cl->conns >= max_conns )
+	{
+	++stats_refused;
+	return 0;
+	}
+    if ( conn_rate > 0 )
+	{
+	fill( cl, nowP );
+	if ( cl->tokens < 1000L )
+	    {
+	    ++stats_refused;
+	    return 0;
+	    }
+	cl->tokens -= 1000L;
+	}
+    ++cl->conns;
+    ++stats_admitted;
+    return 1;
+    }
+
+
+void
+clientlimit_release( httpd_sockaddr* saP )
+    {
+    unsigned char addr[8];
+    int family;
+    Client* cl;
+
+    if ( max_conns <= 0 && conn_rate <= 0 )
+	return;
+    family = client_key( saP, addr );
+    for ( cl = clients[hash( family, addr ) & ( CLIENT_HASH_SIZE - 1 )];
+	  cl != (Client*) 0; cl = cl->next )
+	if ( cl->family == family && memcmp( cl->addr, addr, 8 ) == 0 )
+	    {
+	    if ( cl->conns > 0 )
+		--cl->conns;
+	    return;
+	    }
+    }
+
+
+void
+clientlimit_cleanup( struct timeval* nowP )
+    {
+    struct timeval tv;
+    int h;
+    Client** clp;
+    Client* cl;
+
+    /* Get the current time, if necessary. */
+    if ( nowP == (struct timeval*) 0 )
+	{
+	(void) gettimeofday( &tv, (struct timezone*) 0 );
+	nowP = &tv;
+	}
+
+    for ( h = 0; h < CLIENT_HASH_SIZE; ++h )
+	for ( clp = &clients[h]; *clp != (Client*) 0; )
+	    {
+	    cl = *clp;
+	    if ( cl->conns == 0 && conn_rate > 0 )
+		fill( cl, nowP );
+	    if ( cl->conns == 0 &&
+		 ( conn_rate <= 0 || cl->tokens >= conn_burst * 1000L ) )
+		{
+		*clp = cl->next;
+		free( (void*) cl );
+		--client_count;
+		}
+	    else
+		clp = &cl->next;
+	    }
+    }
+
+
+void
+clientlimit_term( void )
+    {
+    int h;
+    Client* cl;
+
+    for ( h = 0; h < CLIENT_HASH_SIZE; ++h )
+	while ( clients[h] != (Client*) 0 )
+	    {
+	    cl = clients[h];
+	    clients[h] = cl->next;
+	    free( (void*) cl );
+	    }
+    client_count = 0;
+    }
+
+
+/* Boil an address down to what we count clients by.  Returns the family. */
+static int
+client_key( httpd_sockaddr* saP, unsigned char* addr )
+    {
+    (void) memset( (void*) addr, 0, 8 );
+    switch ( saP->sa.sa_family )
+	{
+	case AF_INET:
+	(void) memcpy( (void*) addr, (void*) &saP->sa_in.sin_addr, 4 );
+	return AF_INET;
+#ifdef USE_IPV6
+	case AF_INET6:
+	/* A v4-mapped address is really a v4 client. */
+	if ( IN6_IS_ADDR_V4MAPPED( &saP->sa_in6.sin6_addr ) )
+	    {
+	    (void) memcpy(
+		(void*) addr, (void*) &saP->sa_in6.sin6_addr.s6_addr[12], 4 );
+	    return AF_INET;
+	    }
+	(void) memcpy( (void*) addr, (void*) &saP->sa_in6.sin6_addr, 8 );
+	return AF_INET6;
+#endif /* USE_IPV6 */
+	}
+    return saP->sa.sa_family;
+    }
+
+
+/* FNV-1a, starting from the random key. */
+static unsigned int
+hash( int family, unsigned char* addr )
+    {
+    unsigned int h = hash_key ^ (unsigned int) family;
+    int i;
+
+    for ( i = 0; i < 8; ++i )
+	{
+	h ^= addr[i];
+	h *= 16777619U;
+	}
+    return h;
+    }
+
+
+/* Find a client's entry, making a new one if it doesn't have one yet. */
+static Client*
+find_client( httpd_sockaddr* saP, struct timeval* nowP )
+    {
+    unsigned char addr[8];
+    int family;
+    unsigned int h;
+    Client* cl;
+
+    family = client_key( saP, addr );
+    h = hash( family, addr ) & ( CLIENT_HASH_SIZE - 1 );
+    for ( cl = clients[h]; cl != (Client*) 0; cl = cl->next )
+	if ( cl->family == family && memcmp( cl->addr, addr, 8 ) == 0 )
+	    return cl;
+
+    cl = NEW( Client, 1 );
+    if ( cl == (Client*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a client limit entry" );
+	exit( 1 );
+	}
+    (void) memcpy( (void*) cl->addr, (void*) addr, 8 );
+    cl->family = family;
+    cl->conns = 0;
+    cl->tokens = conn_burst * 1000L;
+    cl->filled_at = *nowP;
+    cl->next = clients[h];
+    clients[h] = cl;
+    ++client_count;
+    return cl;
+    }
+
+
+/* Add the tokens that have built up since the entry was last filled.  A
+** token is a thousandth of a connection, and conn_rate of them come in
+** every millisecond.
+*/
+static void
+fill( Client* cl, struct timeval* nowP )
+    {
+    long msecs;
+
+    msecs = ( nowP->tv_sec - cl->filled_at.tv_sec ) * 1000L +
+	( nowP->tv_usec - cl->filled_at.tv_usec ) / 1000L;
+    if ( msecs <= 0 )
+	return;
+    if ( msecs >= conn_burst * 1000L )
+	cl->tokens = conn_burst * 1000L;
+    else
+	cl->tokens = MIN( cl->tokens + conn_rate * msecs, conn_burst * 1000L );
+    cl->filled_at = *nowP;
+    }
+
+
+void
+clientlimit_logstats( long secs )
+    {
+    if ( stats_admitted == 0 && stats_refused == 0 && client_count == 0 )
+	return;
+    syslog( LOG_NOTICE,
+	"  client limits - %d clients, %ld admitted, %ld refused (%g/sec)",
+	client_count, stats_admitted, stats_refused,
+	(float) stats_refused / secs );
+    stats_admitted = stats_refused = 0;
+    }
@@ -0,0 +1,66 @@
+/* clientlimit.h - header file for per-client limit package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _CLIENTLIMIT_H_
+#define _CLIENTLIMIT_H_
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "libhttpd.h"
+
+/* Sets the limits.  maxconns is how many connections one client may have
+** open at once, rate how many new connections per second it may make on
+** average and burst how many it may make in one go; zero means no limit.
+** IPv6 clients are counted by /64.  Call this before any chroot(), since
+** it wants /dev/urandom for the hash key.
+*/
+void clientlimit_init( int maxconns, int rate, int burst );
+
+/* Checks whether a new connection from the given address is allowed, and
+** counts it if so.  If you have the current time, pass it in, otherwise
+** pass 0.  Returns 1 if the connection may go ahead, 0 if not.
+*/
+int clientlimit_admit( httpd_sockaddr* saP, struct timeval* nowP );
+
+/* Done with a connection that clientlimit_admit() let through. */
+void clientlimit_release( httpd_sockaddr* saP );
+
+/* Forgets clients that have no connections open and have been quiet long
+** enough for their rate limit to recover.  This should be called
+** periodically.  If you have the current time, pass it in, otherwise
+** pass 0.
+*/
+void clientlimit_cleanup( struct timeval* nowP );
+
+/* Free all storage, usually in preparation for exitting. */
+void clientlimit_term( void );
+
+/* Generate debugging statistics syslog message. */
+void clientlimit_logstats( long secs );
+
+#endif /* _CLIENTLIMIT_H_ */
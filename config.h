@@ -87,12 +87,70 @@
 #define CGI_LIMIT 50
 #endif
 
+/* CONFIGURE: When the CGI limit is reached, up to this many more CGI
+** requests wait in a queue instead of getting a 503 right away.  They
+** get started in arrival order as running CGIs exit, which turns short
+** bursts into a bit of latency.  Set it to 0 or comment it out to turn
+** queueing off.
+*/
+#define CGI_QUEUE_SIZE 50
+
+/* CONFIGURE: How many seconds a queued CGI request may wait before it
+** gets the 503 after all.  It's enforced by the per-connection deadline
+** timer, to the second.  If this is not defined, the send timeout is used.
+*/
+#define CGI_QUEUE_TIMELIMIT 10
+
+/* CONFIGURE: Responses to CGI GET requests can be cached in memory, if
+** the program allows it with a Cache-Control max-age or s-maxage header.
+** Hits are served like files, without running the program, and while one
+** request is running it, others for the same URL wait for its response
+** instead of starting more copies.  This is the most memory the cache
+** will use, counting its keys and bookkeeping as well as the responses;
+** when it's full the least recently used responses get dropped.  Comment
+** it out to disable the cache.
+*/
+#define CGI_CACHE_SIZE 10000000
+
+/* CONFIGURE: The largest CGI response that gets cached, headers and all.
+*/
+#define CGI_CACHE_MAX_RESPONSE 1000000
+
+/* CONFIGURE: The most URLs the CGI cache keeps track of at once,
+** including the ones it's remembering not to cache.
+*/
+#define CGI_CACHE_MAX_ENTRIES 10000
+
+/* CONFIGURE: Programs matching the FastCGI pattern (the -fc flag or
+** "fcgipat" in the config file) are started once and kept running as a
+** pool of persistent workers, instead of being forked for every request.
+** They must also match the CGI pattern.  Each program gets up to
+** FCGI_MAX_WORKERS, and workers count against the CGI limit along with
+** ordinary CGIs, so all the programs together can't run more than that
+** many.  Every FCGI_IDLE_TIME seconds, workers that weren't needed get
+** stopped, down to one per program; comment it out to keep them all.
+** The workers' listen sockets go in a private, mode 0700 directory made
+** under FCGI_SOCKET_DIR, which must exist inside the chroot tree if you
+** use one.
+*/
+#define FCGI_MAX_WORKERS 4
+#define FCGI_IDLE_TIME 60
+#define FCGI_SOCKET_DIR "/tmp"
+
+/* CONFIGURE: How many bytes of scratch space each connection keeps for
+** its per-request strings.  A request that needs more gets extra space,
+** which is freed again when the connection slot is reused.
+*/
+#define CONN_ARENA_SIZE 4096
+
 /* CONFIGURE: How many seconds to allow for reading the initial request
-** on a new connection.
+** on a new connection.  Can be changed with the "readtimeout" config-file
+** option.
 */
 #define IDLE_READ_TIMELIMIT 60
 
 /* CONFIGURE: How many seconds before an idle connection gets closed.
+** Can be changed with the "sendtimeout" config-file option.
 */
 #define IDLE_SEND_TIMELIMIT 300
 
@@ -128,6 +186,17 @@
 #define TILDE_MAP_2 "public_html"
 #endif
 
+/* CONFIGURE: With TILDE_MAP_2, how many seconds a user's directory (or
+** the fact that there is no such user) is remembered, and the most users
+** to remember.  Users get looked up as they're requested, and entries
+** that are in use get refreshed by the occasional cleanup, up to
+** TILDE_CACHE_REFRESH of them each time, so requests rarely wait on
+** getpwnam().
+*/
+#define TILDE_CACHE_TIME 300
+#define TILDE_CACHE_SIZE 1000
+#define TILDE_CACHE_REFRESH 20
+
 /* CONFIGURE: The file to use for authentication.  If this is defined then
 ** thttpd checks for this file in the local directory before every fetch.
 ** If the file exists then authentication is done, otherwise the fetch
@@ -138,6 +207,15 @@
 */
 #define AUTH_FILE ".htpasswd"
 
+/* CONFIGURE: How many seconds a user's password stays trusted after it
+** has been checked with crypt().  Until then, requests with the same
+** password skip crypt(), which is slow on purpose.  Only a keyed digest
+** of the password is kept, never the password itself.  Changing the
+** auth file forgets everything.  Comment this out to run crypt() on
+** every request.
+*/
+#define AUTH_CACHE_TIME 300
+
 /* CONFIGURE: The default character set name to use with text MIME types.
 ** This gets substituted into the MIME types where they have a "%s".
 **
@@ -312,14 +390,6 @@
 
 /* You almost certainly don't want to change anything below here. */
 
-/* CONFIGURE: When throttling CGI programs, we don't know how many bytes
-** they send back to the client because it would be inefficient to
-** interpose a counter.  CGI programs are much more expensive than
-** regular files to serve, so we set an arbitrary and high byte count
-** that gets applied to all CGI programs for throttling purposes.
-*/
-#define CGI_BYTECOUNT 25000
-
 /* CONFIGURE: The default port to listen on.  80 is the standard HTTP port.
 */
 #define DEFAULT_PORT 80
@@ -353,6 +423,57 @@
 /* CONFIGURE: Time between updates of the throttle table's rolling averages. */
 #define THROTTLE_TIME 2
 
+/* CONFIGURE: Per-client limits.  If defined, one client address (or IPv6
+** /64) may have at most CLIENT_CONN_LIMIT connections open at once, and
+** may open new ones at CLIENT_RATE_LIMIT per second on average.  Clients
+** over the limits have their connections closed as soon as they're
+** accepted.  Can be changed with the "clientconns", "clientrate" and
+** "clientburst" config-file options; the burst defaults to a second's
+** worth.
+*/
+#ifdef notdef
+#define CLIENT_CONN_LIMIT 32
+#define CLIENT_RATE_LIMIT 20
+#endif
+
+/* CONFIGURE: Seconds between sweeps for quiet clients in the per-client
+** limit table.
+*/
+#define CLIENT_EXPIRE_TIME 10
+
+/* CONFIGURE: Overload control.  The main loop keeps a running average of
+** its own lag - how long each round of servicing connections takes, plus
+** how late the timers were.  Once that passes OVERLOAD_SHED_LAG msecs,
+** new connections get a canned 503 instead of being served, and idle and
+** linger times are cut to a quarter.  Past OVERLOAD_STOP_LAG it stops
+** accepting altogether, and lets the listen queue hold them.  These can
+** be changed with the "shedlag" and "stoplag" config-file options, and
+** setting them to 0 turns them off.
+*/
+#define OVERLOAD_SHED_LAG 250
+#define OVERLOAD_STOP_LAG 1000
+
+/* CONFIGURE: Minimum data rates.  A client sending its request has to
+** get at least MIN_READ_BYTES of it to us in every RATE_WINDOW seconds,
+** and one receiving a response has to take at least MIN_SEND_BYTES, or
+** it gets dropped.  This keeps clients that trickle a byte at a time
+** from holding connection slots for the whole idle time.  Throttled
+** responses are only held to half their throttle rate.  These can be
+** changed with the "minreadbytes", "minsendbytes" and "ratewindow"
+** config-file options, and setting them to 0 turns them off.
+*/
+#define RATE_WINDOW 10
+#define MIN_READ_BYTES 100
+#define MIN_SEND_BYTES 1000
+
+/* CONFIGURE: The Retry-After, in seconds, sent with overload 503s. */
+#define OVERLOAD_RETRY_AFTER 5
+
+/* CONFIGURE: How many connections to accept from one listen socket before
+** going back to service the ones we already have.
+*/
+#define ACCEPT_BATCH 64
+
 /* CONFIGURE: The listen() backlog queue length.  The 1024 doesn't actually
 ** get used, the kernel uses its maximum allowed value.  This is a config
 ** parameter only in case there's some OS where asking for too high a queue
@@ -361,6 +482,14 @@
 */
 #define LISTEN_BACKLOG 1024
 
+/* CONFIGURE: On systems with TCP_DEFER_ACCEPT (Linux), the kernel can hold
+** on to new TCP connections until the first data arrives, so by the time
+** we accept() one the request is usually there to be read.  This is how
+** many seconds it waits for that data before handing over the connection
+** anyway.  Comment it out to get connections as soon as they're made.
+*/
+#define DEFER_ACCEPT_TIME 10
+
 /* CONFIGURE: Maximum number of throttle patterns that any single URL can
 ** be included in.  This has nothing to do with the number of throttle
 ** patterns that you can define, which is unlimited.
@@ -376,7 +505,7 @@
 #define SPARE_FDS 10
 
 /* CONFIGURE: How many milliseconds to leave a connection open while doing a
-** lingering close.
+** lingering close.  Can be changed with the "lingertime" config-file option.
 */
 #define LINGER_TIME 500
 
@@ -385,8 +514,14 @@
 */
 #define MAX_LINKS 32
 
-/* CONFIGURE: You don't even want to know.
+/* CONFIGURE: Some old kernels, e.g. SunOS 4.1.x, say that a non-blocking
+** socket is writable when it isn't.  Define this to have a connection that
+** gets EWOULDBLOCK back off for an adaptively-tuned number of milliseconds,
+** starting here, instead of waiting for the socket to become writable.
+** On anything modern it just adds stalls.
 */
+#ifdef notdef
 #define MIN_WOULDBLOCK_DELAY 100L
+#endif
 
 #endif /* _CONFIG_H_ */
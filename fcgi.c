@@ -0,0 +1,733 @@
+/* fcgi.c - persistent FastCGI worker package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+/* Programs run through this package are started once and then kept
+** around, each one accepting FastCGI connections on a Unix-domain
+** listen socket passed to it as fd 0, per the FastCGI spec.  All the
+** workers for one program share that listen socket, so the kernel's
+** listen queue does the load balancing for us.  The sockets live in a
+** directory only we can get into, since anyone who could connect to a
+** worker could hand it whatever REMOTE_USER they liked.  The record-level
+** encoding and decoding is here too; the relaying itself happens in
+** libhttpd's event-driven CGI code.
+*/
+
+#include "config.h"
+#include "version.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "fcgi.h"
+#include "libhttpd.h"
+
+#ifndef FCGI_MAX_WORKERS
+#define FCGI_MAX_WORKERS 4
+#endif
+#ifndef FCGI_SOCKET_DIR
+#define FCGI_SOCKET_DIR "/tmp"
+#endif
+
+
+
+/* The App struct - one per distinct program. */
+typedef struct AppStruct {
+    char* filename;
+    int index;
+    int listen_fd;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int max_workers;
+    volatile pid_t* pids;
+    volatile int num_workers;
+    int num_busy;
+    int peak_busy;	/* most num_busy got since the last fcgi_cleanup() */
+    struct AppStruct* next;
+    } App;
+
+
+/* Globals. */
+static App* apps = (App*) 0;
+static int num_apps = 0;
+static long stats_requests = 0;
+static long stats_spawns = 0;
+static long stats_retired = 0;
+static char sock_dir[100] = "";
+
+/* The signals we catch, which a worker gets back to the defaults. */
+static int worker_signals[] = {
+    SIGTERM, SIGINT, SIGCHLD, SIGPIPE, SIGHUP, SIGUSR1, SIGUSR2, SIGALRM };
+
+
+/* Forwards. */
+static App* find_app( char* filename, int max_workers );
+static int make_sock_dir( void );
+static int spawn_worker( App* app, int* countP );
+static void add_bytes( char** bufP, size_t* maxbufP, size_t* buflenP, char* data, size_t len );
+static void add_length( char** bufP, size_t* maxbufP, size_t* buflenP, size_t len );
+static size_t length_len( size_t len );
+static void set_header( char* hp, int type, size_t len );
+static void end_request( fcgi_parser* fp, char* data, size_t len );
+
+
+int
+fcgi_connect( char* filename, int* countP, int limit, int* appP )
+    {
+    App* app;
+    int fd;
+
+    app = find_app( filename, FCGI_MAX_WORKERS );
+    if ( app == (App*) 0 )
+	return -1;
+
+    /* If everyone is busy and there's room for another worker, both for
+    ** this program and under the server-wide CGI limit, start one.
+    ** Otherwise the new connection just waits in the listen queue until
+    ** a worker gets around to it - unless there are no workers at all,
+    ** in which case the request has to wait for a CGI to finish.
+    */
+    if ( app->num_workers == 0 ||
+	 ( app->num_busy >= app->num_workers &&
+	   app->num_workers < app->max_workers ) )
+	{
+	if ( limit <= 0 || *countP < limit )
+	    (void) spawn_worker( app, countP );
+	else if ( app->num_workers == 0 )
+	    return -2;
+	}
+    if ( app->num_workers == 0 )
+	return -1;
+
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 )
+	{
+	syslog( LOG_ERR, "FastCGI socket - %m" );
+	return -1;
+	}
+    (void) fcntl( fd, F_SETFD, 1 );
+    httpd_set_ndelay( fd );
+    if ( connect( fd, (struct sockaddr*) &app->addr, app->addr_len ) < 0 )
+	{
+	/* Unix-domain connects either succeed immediately or fail; a full
+	** listen queue shows up as EAGAIN, which we treat as overload.
+	*/
+	if ( errno != EAGAIN )
+	    syslog( LOG_ERR, "FastCGI connect %.80s - %m", app->filename );
+	(void) close( fd );
+	return -1;
+	}
+
+    ++app->num_busy;
+    if ( app->num_busy > app->peak_busy )
+	app->peak_busy = app->num_busy;
+    ++stats_requests;
+    *appP = app->index;
+    return fd;
+    }
+
+
+void
+fcgi_release( int app, int fd )
+    {
+    App* a;
+
+    (void) close( fd );
+    for ( a = apps; a != (App*) 0; a = a->next )
+	if ( a->index == app )
+	    {
+	    if ( a->num_busy > 0 )
+		--a->num_busy;
+	    break;
+	    }
+    }
+
+
+int
+fcgi_reaped( pid_t pid )
+    {
+    App* app;
+    int i;
+
+    /* This runs in a signal handler, so it only looks at the pid
+    ** arrays, which never move once they're allocated.
+    */
+    for ( app = apps; app != (App*) 0; app = app->next )
+	for ( i = 0; i < app->max_workers; ++i )
+	    if ( app->pids[i] == pid )
+		{
+		app->pids[i] = 0;
+		--app->num_workers;
+		return 1;
+		}
+    return 0;
+    }
+
+
+static App*
+find_app( char* filename, int max_workers )
+    {
+    App* app;
+    App** appP;
+    int i;
+
+    for ( appP = &apps; *appP != (App*) 0; appP = &(*appP)->next )
+	if ( strcmp( (*appP)->filename, filename ) == 0 )
+	    return *appP;
+    if ( make_sock_dir() < 0 )
+	return (App*) 0;
+
+    /* Not found, make a new one and its listen socket. */
+    app = NEW( App, 1 );
+    if ( app == (App*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a FastCGI app" );
+	exit( 1 );
+	}
+    app->filename = strdup( filename );
+    app->pids = NEW( pid_t, max_workers );
+    if ( app->filename == (char*) 0 || app->pids == (pid_t*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a FastCGI app" );
+	exit( 1 );
+	}
+    for ( i = 0; i < max_workers; ++i )
+	app->pids[i] = 0;
+    app->index = num_apps;
+    app->max_workers = max_workers;
+    app->num_workers = 0;
+    app->num_busy = 0;
+    app->peak_busy = 0;
+    app->next = (App*) 0;
+
+    (void) memset( &app->addr, 0, sizeof(app->addr) );
+    app->addr.sun_family = AF_UNIX;
+    (void) snprintf(
+	app->addr.sun_path, sizeof(app->addr.sun_path),
+	"%s/%d", sock_dir, num_apps );
+    app->addr_len = sizeof(app->addr);
+
+    app->listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( app->listen_fd < 0 )
+	{
+	syslog( LOG_ERR, "FastCGI socket - %m" );
+	goto fail;
+	}
+    (void) fcntl( app->listen_fd, F_SETFD, 1 );
+    if ( bind( app->listen_fd, (struct sockaddr*) &app->addr, app->addr_len ) < 0 )
+	{
+	syslog( LOG_ERR, "FastCGI bind %.80s - %m", filename );
+	(void) close( app->listen_fd );
+	goto fail;
+	}
+    if ( listen( app->listen_fd, LISTEN_BACKLOG ) < 0 )
+	{
+	syslog( LOG_ERR, "FastCGI listen %.80s - %m", filename );
+	(void) close( app->listen_fd );
+	goto fail;
+	}
+
+    /* Only link it in once it's complete, since fcgi_reaped() may be
+    ** walking the list at any time.
+    */
+    *appP = app;
+    ++num_apps;
+    return app;
+
+    fail:
+    free( (void*) app->filename );
+    free( (void*) app->pids );
+    free( (void*) app );
+    return (App*) 0;
+    }
+
+
+/* Makes the directory the listen sockets go in, the first time it's
+** needed.  mkdtemp() creates it mode 0700 with a name nobody could have
+** guessed ahead of time, so only the server's own user can reach the
+** sockets inside.
+*/
+static int
+make_sock_dir( void )
+    {
+    if ( sock_dir[0] != '\0' )
+	return 0;
+    (void) snprintf(
+	sock_dir, sizeof(sock_dir), "%s/thttpd-fcgi.XXXXXX", FCGI_SOCKET_DIR );
+    if ( mkdtemp( sock_dir ) == (char*) 0 )
+	{
+	syslog( LOG_ERR, "FastCGI mkdtemp %.80s - %m", sock_dir );
+	sock_dir[0] = '\0';
+	return -1;
+	}
+    return 0;
+    }
+
+
+/* Starts a worker and bumps *countP, before SIGCHLD can get in and
+** take it back down.  Like a regular CGI it's started with vfork(), so
+** everything the child needs gets set up here first.
+*/
+static int
+spawn_worker( App* app, int* countP )
+    {
+    int slot, null_fd, i, err;
+    pid_t r;
+    char* directory;
+    char* binary;
+    char* argp[2];
+    char* envp[4];
+    int envn;
+    sigset_t set, oset;
+
+    if ( app->num_workers >= app->max_workers )
+	return -1;
+
+    /* Split the program into directory and binary, same as for a
+    ** regular CGI.
+    */
+    directory = strdup( app->filename );
+    if ( directory == (char*) 0 )
+	{
+	syslog( LOG_ERR, "out of memory spawning a FastCGI worker" );
+	return -1;
+	}
+    binary = strrchr( directory, '/' );
+    if ( binary == (char*) 0 )
+	binary = app->filename;
+    else
+	*binary++ = '\0';
+
+    /* The per-request environment arrives in PARAMS records, so the
+    ** process environment is just the basics.
+    */
+    envn = 0;
+    envp[envn++] = "PATH=" CGI_PATH;
+#ifdef CGI_LD_LIBRARY_PATH
+    envp[envn++] = "LD_LIBRARY_PATH=" CGI_LD_LIBRARY_PATH;
+#endif /* CGI_LD_LIBRARY_PATH */
+    envp[envn++] = "SERVER_SOFTWARE=" SERVER_SOFTWARE;
+    envp[envn] = (char*) 0;
+    argp[0] = binary;
+    argp[1] = (char*) 0;
+
+    /* A FastCGI app talks only over its connections, so stdout and
+    ** stderr go nowhere.
+    */
+    null_fd = open( "/dev/null", O_WRONLY );
+    if ( null_fd < 0 )
+	{
+	syslog( LOG_ERR, "open /dev/null - %m" );
+	free( (void*) directory );
+	return -1;
+	}
+    (void) fcntl( null_fd, F_SETFD, 1 );
+
+    /* None of our signal handlers may run in the child while it's
+    ** sharing our memory, and SIGCHLD has to wait until the pid is
+    ** recorded, so a worker that dies right away still gets counted as
+    ** ours.
+    */
+    (void) sigfillset( &set );
+    (void) sigprocmask( SIG_BLOCK, &set, &oset );
+    r = vfork( );
+    if ( r == 0 )
+	{
+	/* Worker process.  Until the exec this is borrowing the parent's
+	** memory, so it sticks to system calls.  The listen socket
+	** becomes stdin.
+	*/
+	for ( i = 0; i < sizeof(worker_signals) / sizeof(*worker_signals); ++i )
+	    (void) signal( worker_signals[i], SIG_DFL );
+	(void) sigprocmask( SIG_SETMASK, &oset, (sigset_t*) 0 );
+	if ( app->listen_fd != STDIN_FILENO )
+	    (void) dup2( app->listen_fd, STDIN_FILENO );
+	else
+	    (void) fcntl( STDIN_FILENO, F_SETFD, 0 );
+	(void) dup2( null_fd, STDOUT_FILENO );
+	(void) dup2( null_fd, STDERR_FILENO );
+	if ( binary != app->filename )
+	    (void) chdir( directory );  /* ignore errors */
+#ifdef CGI_NICE
+	/* Set priority. */
+	(void) nice( CGI_NICE );
+#endif /* CGI_NICE */
+	(void) execve( binary, argp, envp );
+	_exit( 1 );
+	}
+    err = errno;
+    (void) close( null_fd );
+    free( (void*) directory );
+    if ( r < 0 )
+	{
+	(void) sigprocmask( SIG_SETMASK, &oset, (sigset_t*) 0 );
+	errno = err;
+	syslog( LOG_ERR, "vfork - %m" );
+	return -1;
+	}
+
+    /* Parent process.  SIGCHLD is still blocked, so the free slot that
+    ** num_workers promised is still there.
+    */
+    for ( slot = 0; slot < app->max_workers; ++slot )
+	if ( app->pids[slot] == 0 )
+	    {
+	    app->pids[slot] = r;
+	    break;
+	    }
+    ++app->num_workers;
+    ++*countP;
+    (void) sigprocmask( SIG_SETMASK, &oset, (sigset_t*) 0 );
+    ++stats_spawns;
+    syslog( LOG_INFO, "spawned FastCGI worker %d for '%.200s'", (int) r, app->filename );
+    return 0;
+    }
+
+
+static void
+add_bytes( char** bufP, size_t* maxbufP, size_t* buflenP, char* data, size_t len )
+    {
+    httpd_realloc_str( bufP, maxbufP, *buflenP + len );
+    (void) memmove( &((*bufP)[*buflenP]), data, len );
+    *buflenP += len;
+    }
+
+
+void
+fcgi_add_record(
+    char** bufP, size_t* maxbufP, size_t* buflenP, int type, char* data,
+    size_t len )
+    {
+    char header[FCGI_HEADER_LEN];
+
+    set_header( header, type, len );
+    add_bytes( bufP, maxbufP, buflenP, header, sizeof(header) );
+    if ( len > 0 )
+	add_bytes( bufP, maxbufP, buflenP, data, len );
+    }
+
+
+void
+fcgi_add_begin_request( char** bufP, size_t* maxbufP, size_t* buflenP )
+    {
+    char body[8];
+
+    (void) memset( body, 0, sizeof(body) );
+    body[1] = 1;		/* FCGI_RESPONDER */
+    /* Flags are zero - no FCGI_KEEP_CONN, the worker closes the
+    ** connection when it's done.
+    */
+    fcgi_add_record( bufP, maxbufP, buflenP, FCGI_BEGIN_REQUEST, body, sizeof(body) );
+    }
+
+
+static void
+add_length( char** bufP, size_t* maxbufP, size_t* buflenP, size_t len )
+    {
+    unsigned char b[4];
+
+    if ( len < 128 )
+	{
+	b[0] = (unsigned char) len;
+	add_bytes( bufP, maxbufP, buflenP, (char*) b, 1 );
+	}
+    else
+	{
+	b[0] = (unsigned char) ( ( len >> 24 ) | 0x80 );
+	b[1] = (unsigned char) ( len >> 16 );
+	b[2] = (unsigned char) ( len >> 8 );
+	b[3] = (unsigned char) len;
+	add_bytes( bufP, maxbufP, buflenP, (char*) b, 4 );
+	}
+    }
+
+
+static size_t
+length_len( size_t len )
+    {
+    return len < 128 ? 1 : 4;
+    }
+
+
+static void
+set_header( char* hp, int type, size_t len )
+    {
+    unsigned char* header = (unsigned char*) hp;
+
+    header[0] = 1;		/* version */
+    header[1] = (unsigned char) type;
+    header[2] = 0;		/* request id, always 1 */
+    header[3] = 1;
+    header[4] = (unsigned char) ( len >> 8 );
+    header[5] = (unsigned char) len;
+    header[6] = 0;		/* no padding */
+    header[7] = 0;
+    }
+
+
+void
+fcgi_add_params( char** bufP, size_t* maxbufP, size_t* buflenP, char** envp )
+    {
+    size_t paramslen, nrecs, start, pos, off, n;
+    char* eq;
+    int i;
+
+    /* The name-value pairs make one stream, chopped into records.  First
+    ** see how long it is...
+    */
+    paramslen = 0;
+    for ( i = 0; envp[i] != (char*) 0; ++i )
+	{
+	eq = strchr( envp[i], '=' );
+	if ( eq == (char*) 0 )
+	    continue;
+	paramslen +=
+	    length_len( eq - envp[i] ) + length_len( strlen( eq + 1 ) ) +
+	    strlen( envp[i] ) - 1;
+	}
+    nrecs = ( paramslen + FCGI_MAX_CONTENT - 1 ) / FCGI_MAX_CONTENT;
+
+    /* ... then encode it right into the buffer, leaving room in front
+    ** for the record headers...
+    */
+    start = *buflenP;
+    pos = start + nrecs * FCGI_HEADER_LEN;
+    httpd_realloc_str( bufP, maxbufP, pos + paramslen );
+    for ( i = 0; envp[i] != (char*) 0; ++i )
+	{
+	eq = strchr( envp[i], '=' );
+	if ( eq == (char*) 0 )
+	    continue;
+	add_length( bufP, maxbufP, &pos, eq - envp[i] );
+	add_length( bufP, maxbufP, &pos, strlen( eq + 1 ) );
+	add_bytes( bufP, maxbufP, &pos, envp[i], eq - envp[i] );
+	add_bytes( bufP, maxbufP, &pos, eq + 1, strlen( eq + 1 ) );
+	}
+
+    /* ... and slide each record's worth down behind its header.  Every
+    ** chunk moves toward the front, so none overwrites one still to go.
+    */
+    for ( off = 0; off < paramslen; off += n )
+	{
+	n = MIN( paramslen - off, FCGI_MAX_CONTENT );
+	pos = start + ( off / FCGI_MAX_CONTENT ) * FCGI_HEADER_LEN + off;
+	(void) memmove(
+	    &((*bufP)[pos + FCGI_HEADER_LEN]),
+	    &((*bufP)[start + nrecs * FCGI_HEADER_LEN + off]), n );
+	set_header( &((*bufP)[pos]), FCGI_PARAMS, n );
+	}
+    *buflenP = start + nrecs * FCGI_HEADER_LEN + paramslen;
+    fcgi_add_record( bufP, maxbufP, buflenP, FCGI_PARAMS, (char*) 0, 0 );
+    }
+
+
+void
+fcgi_parser_init( fcgi_parser* fp )
+    {
+    fp->header_len = 0;
+    fp->type = 0;
+    fp->content_left = 0;
+    fp->padding_left = 0;
+    fp->end_len = 0;
+    fp->app_status = -1;
+    }
+
+
+/* Collects the body of an END_REQUEST record: a four-byte application
+** status and a one-byte protocol status.
+*/
+static void
+end_request( fcgi_parser* fp, char* data, size_t len )
+    {
+    unsigned char* b = fp->end_body;
+
+    len = MIN( len, sizeof(fp->end_body) - fp->end_len );
+    (void) memmove( &fp->end_body[fp->end_len], data, len );
+    fp->end_len += len;
+    if ( fp->end_len < 5 )
+	return;
+    if ( b[4] != FCGI_REQUEST_COMPLETE )
+	fp->app_status = -1;
+    else
+	fp->app_status = (int) (
+	    ( (unsigned int) b[0] << 24 ) | ( b[1] << 16 ) | ( b[2] << 8 ) |
+	    b[3] );
+    }
+
+
+int
+fcgi_parse(
+    fcgi_parser* fp, char** bufP, size_t* lenP, char** dataP,
+    size_t* data_lenP )
+    {
+    size_t n;
+
+    while ( *lenP > 0 )
+	{
+	/* In the middle of a record's content? */
+	if ( fp->content_left > 0 )
+	    {
+	    n = MIN( *lenP, fp->content_left );
+	    *dataP = *bufP;
+	    *data_lenP = n;
+	    *bufP += n;
+	    *lenP -= n;
+	    fp->content_left -= n;
+	    switch ( fp->type )
+		{
+		case FCGI_STDOUT: return FP_STDOUT;
+		case FCGI_STDERR: return FP_STDERR;
+		case FCGI_END_REQUEST:
+		end_request( fp, *dataP, n );
+		if ( fp->content_left == 0 && fp->padding_left == 0 )
+		    return FP_END;
+		break;
+		}
+	    /* Anything else we just skip. */
+	    continue;
+	    }
+
+	/* Skipping padding? */
+	if ( fp->padding_left > 0 )
+	    {
+	    n = MIN( *lenP, fp->padding_left );
+	    *bufP += n;
+	    *lenP -= n;
+	    fp->padding_left -= n;
+	    if ( fp->padding_left == 0 && fp->type == FCGI_END_REQUEST )
+		return FP_END;
+	    continue;
+	    }
+
+	/* Accumulating a header. */
+	n = MIN( *lenP, FCGI_HEADER_LEN - fp->header_len );
+	(void) memmove( &fp->header[fp->header_len], *bufP, n );
+	fp->header_len += n;
+	*bufP += n;
+	*lenP -= n;
+	if ( fp->header_len < FCGI_HEADER_LEN )
+	    break;
+	fp->header_len = 0;
+	fp->type = fp->header[1];
+	fp->content_left = ( fp->header[4] << 8 ) | fp->header[5];
+	fp->padding_left = fp->header[6];
+	if ( fp->type == FCGI_END_REQUEST && fp->content_left == 0 &&
+	     fp->padding_left == 0 )
+	    return FP_END;
+	}
+    return FP_NEED_MORE;
+    }
+
+
+void
+fcgi_cleanup( void )
+    {
+    App* app;
+    int extra, i;
+
+    /* A program with nothing in flight doesn't need more workers than
+    ** were ever busy at once since last time, and the extras are all
+    ** idle, so any of them can go.  The last one stays, so the program
+    ** doesn't have to start up again for the next request.
+    */
+    for ( app = apps; app != (App*) 0; app = app->next )
+	{
+	if ( app->num_busy == 0 )
+	    {
+	    extra = app->num_workers - MAX( app->peak_busy, 1 );
+	    for ( i = app->max_workers - 1; i >= 0 && extra > 0; --i )
+		if ( app->pids[i] != 0 )
+		    {
+		    (void) kill( app->pids[i], SIGTERM );
+		    --extra;
+		    ++stats_retired;
+		    }
+	    }
+	app->peak_busy = app->num_busy;
+	}
+    }
+
+
+void
+fcgi_term( void )
+    {
+    App* app;
+    int i;
+
+    while ( apps != (App*) 0 )
+	{
+	app = apps;
+	apps = app->next;
+	for ( i = 0; i < app->max_workers; ++i )
+	    if ( app->pids[i] != 0 )
+		(void) kill( app->pids[i], SIGTERM );
+	(void) close( app->listen_fd );
+	(void) unlink( app->addr.sun_path );
+	free( (void*) app->filename );
+	free( (void*) app->pids );
+	free( (void*) app );
+	}
+    num_apps = 0;
+    if ( sock_dir[0] != '\0' )
+	{
+	(void) rmdir( sock_dir );
+	sock_dir[0] = '\0';
+	}
+    }
+
+
+/* Generate debugging statistics syslog message. */
+void
+fcgi_logstats( long secs )
+    {
+    App* app;
+    int workers, busy;
+
+    if ( num_apps == 0 )
+	return;
+    workers = busy = 0;
+    for ( app = apps; app != (App*) 0; app = app->next )
+	{
+	workers += app->num_workers;
+	busy += app->num_busy;
+	}
+    syslog( LOG_NOTICE,
+	"  fcgi - %d programs, %d workers (%d busy), %ld requests (%g/sec), %ld spawns, %ld retired",
+	num_apps, workers, busy, stats_requests, (float) stats_requests / secs,
+	stats_spawns, stats_retired );
+    stats_requests = 0;
+    stats_spawns = 0;
+    stats_retired = 0;
+    }
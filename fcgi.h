@@ -0,0 +1,126 @@
+/* fcgi.h - header file for persistent FastCGI worker package
+**
+** Copyright  2026 by the thttpd contributors.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+** OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+** HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+** SUCH DAMAGE.
+*/
+
+#ifndef _FCGI_H_
+#define _FCGI_H_
+
+#include <sys/types.h>
+
+/* FastCGI record types, from the FastCGI 1.0 spec. */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_REQUEST_COMPLETE 0
+
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+
+/* Returns a non-blocking socket connected to a worker for the given
+** program, starting a new worker if all the current ones are busy, up
+** to FCGI_MAX_WORKERS.  Workers count as running CGIs: a new one only
+** gets started while *countP is under limit, and bumps *countP; the
+** caller takes it back down when the worker is reaped.  The program
+** gets run in its own directory, like a regular CGI.  *appP is set to a
+** handle that must be passed back to fcgi_release().  Returns -2 if the
+** program has no workers and the limit keeps one from starting, so the
+** request can wait for a CGI to finish, or -1 on other errors.
+*/
+int fcgi_connect( char* filename, int* countP, int limit, int* appP );
+
+/* Done with a connection that was returned by fcgi_connect(). */
+void fcgi_release( int app, int fd );
+
+/* Called from the SIGCHLD handler for each reaped child.  Returns 1 if
+** it was one of our workers, 0 otherwise.
+*/
+int fcgi_reaped( pid_t pid );
+
+
+/* Append a FastCGI record to a buffer grown with httpd_realloc_str(). */
+void fcgi_add_record(
+    char** bufP, size_t* maxbufP, size_t* buflenP, int type, char* data,
+    size_t len );
+
+/* Append a BEGIN_REQUEST record for the responder role. */
+void fcgi_add_begin_request( char** bufP, size_t* maxbufP, size_t* buflenP );
+
+/* Append PARAMS records encoding a NAME=value environment vector,
+** followed by the empty PARAMS record that terminates the stream.
+*/
+void fcgi_add_params(
+    char** bufP, size_t* maxbufP, size_t* buflenP, char** envp );
+
+
+/* Incremental parser for the records coming back from a worker. */
+typedef struct {
+    unsigned char header[FCGI_HEADER_LEN];
+    int header_len;
+    int type;
+    size_t content_left;
+    size_t padding_left;
+    unsigned char end_body[8];
+    int end_len;
+    int app_status;	/* from END_REQUEST, -1 until a complete one arrives */
+    } fcgi_parser;
+
+void fcgi_parser_init( fcgi_parser* fp );
+
+/* Parses the bytes in *bufP / *lenP, advancing past what it consumes.
+** Returns FP_STDOUT or FP_STDERR with *dataP / *data_lenP set to the
+** next chunk of that stream, FP_END when the request is over, or
+** FP_NEED_MORE when the buffer has been used up.  After FP_END,
+** fp->app_status is the program's exit status, or -1 if it didn't
+** complete the request normally.
+*/
+int fcgi_parse(
+    fcgi_parser* fp, char** bufP, size_t* lenP, char** dataP,
+    size_t* data_lenP );
+#define FP_NEED_MORE 0
+#define FP_STDOUT 1
+#define FP_STDERR 2
+#define FP_END 3
+
+
+/* Stops workers that weren't needed since the last call, keeping at
+** least one per program.  Call it every FCGI_IDLE_TIME seconds.
+*/
+void fcgi_cleanup( void );
+
+/* Kill the workers and free all storage, usually in preparation for
+** exitting.
+*/
+void fcgi_term( void );
+
+/* Generate debugging statistics syslog message. */
+void fcgi_logstats( long secs );
+
+#endif /* _FCGI_H_ */
@@ -39,9 +39,14 @@
 #define _WITH_DPRINTF
 #endif
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* for splice() */
+#endif
+
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -61,10 +66,17 @@
 #ifdef __FreeBSD__
 #include <sys/sysctl.h>
 #endif
-
-#ifdef HAVE_CRYPT_H
-#include <crypt.h>
-#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <strings.h>
+#endif /* __SSE2__ */
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#define HAVE_OPENAT2
+#endif /* SYS_openat2 */
+#endif /* __linux__ */
 
 #ifdef HAVE_OSRELDATE_H
 #include <osreldate.h>
@@ -87,8 +99,12 @@
 # endif
 #endif
 
+#include "arena.h"
 #include "libhttpd.h"
 #include "mmc.h"
+#include "cgicache.h"
+#include "authcache.h"
+#include "clientlimit.h"
 #include "timers.h"
 #include "match.h"
 #include "tdate_parse.h"
@@ -107,6 +123,10 @@
 #define SHUT_WR 1
 #endif
 
+#if defined(SPLICE_F_NONBLOCK) && defined(FIONREAD)
+#define CGI_SPLICE
+#endif
+
 #ifndef HAVE_INT64T
 typedef long long int64_t;
 #endif
@@ -164,29 +184,36 @@ static int tilde_map_1( httpd_conn* hc );
 #ifdef TILDE_MAP_2
 static int tilde_map_2( httpd_conn* hc );
 #endif /* TILDE_MAP_2 */
+static void vhost_free_all( void );
 static int vhost_map( httpd_conn* hc );
-static char* expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped );
+static void vhost_account( httpd_conn* hc );
+static char* expand_symlinks( Arena* ar, char* path, char** restP, int no_symlink_check, int tildemapped );
+static int open_beneath( httpd_conn* hc, char* path );
+static void close_file( httpd_conn* hc );
 static char* bufgets( httpd_conn* hc );
+static void merge_header( Arena* ar, char** valP, char** bufP, size_t* maxbufP, char* cp );
+static int header_id( char* name, size_t len );
 static void de_dotdot( char* file );
-static void init_mime( void );
+static void init_mime( char* charset );
 static void figure_mime( httpd_conn* hc );
 #ifdef CGI_TIMELIMIT
 static void cgi_kill2( ClientData client_data, struct timeval* nowP );
 static void cgi_kill( ClientData client_data, struct timeval* nowP );
 #endif /* CGI_TIMELIMIT */
 #ifdef GENERATE_INDEXES
+static void ls_generate( httpd_conn* hc, DIR* dirp );
 static int ls( httpd_conn* hc );
 #endif /* GENERATE_INDEXES */
-static char* build_env( char* fmt, char* arg );
+static char* build_env( httpd_conn* hc, char* fmt, char* arg );
 #ifdef SERVER_NAME_LIST
 static char* hostname_map( char* hostname );
 #endif /* SERVER_NAME_LIST */
 static char** make_envp( httpd_conn* hc );
 static char** make_argp( httpd_conn* hc );
-static void cgi_interpose_input( httpd_conn* hc, int wfd );
 static void post_post_garbage_hack( httpd_conn* hc );
-static void cgi_interpose_output( httpd_conn* hc, int rfd );
-static void cgi_child( httpd_conn* hc );
+static int cgi_fd_setup( int fd );
+static void cgi_start_relay( httpd_conn* hc );
+static pid_t cgi_spawn( httpd_conn* hc, int in_fd, int out_fd );
 static int cgi( httpd_conn* hc );
 static int really_start_request( httpd_conn* hc, struct timeval* nowP );
 static void make_log_entry( httpd_conn* hc, struct timeval* nowP );
@@ -200,17 +227,6 @@ static long long atoll( const char* str );
 #endif /* HAVE_ATOLL */
 
 
-/* This global keeps track of whether we are in the main process or a
-** sub-process.  The reason is that httpd_write_response() can get called
-** in either context; when it is called from the main process it must use
-** non-blocking I/O to avoid stalling the server, but when it is called
-** from a sub-process it wants to use blocking I/O so that the whole
-** response definitely gets written.  So, it checks this variable.  A bit
-** of a hack but it seems to do the right thing.
-*/
-static int sub_process = 0;
-
-
 static void
 check_options( void )
     {
@@ -230,6 +246,8 @@ free_httpd_server( httpd_server* hs )
 	free( (void*) hs->cwd );
     if ( hs->cgi_pattern != (char*) 0 )
 	free( (void*) hs->cgi_pattern );
+    if ( hs->fcgi_pattern != (char*) 0 )
+	free( (void*) hs->fcgi_pattern );
     if ( hs->charset != (char*) 0 )
 	free( (void*) hs->charset );
     if ( hs->p3p != (char*) 0 )
@@ -245,7 +263,8 @@ free_httpd_server( httpd_server* hs )
 httpd_server*
 httpd_initialize(
     char* hostname, httpd_sockaddr* sa4P, httpd_sockaddr* sa6P,
-    unsigned short port, char* cgi_pattern, int cgi_limit, char* charset,
+    unsigned short port, char* cgi_pattern, int cgi_limit,
+    char* fcgi_pattern, char* charset,
     char* p3p, int max_age, char* cwd, int no_log, FILE* logfp,
 #ifdef TCP_FASTOPEN
     int fastopen,
@@ -320,6 +339,22 @@ httpd_initialize(
 	}
     hs->cgi_limit = cgi_limit;
     hs->cgi_count = 0;
+    if ( fcgi_pattern == (char*) 0 )
+	hs->fcgi_pattern = (char*) 0;
+    else
+	{
+	/* Same slash-nuking as for the cgi pattern. */
+	if ( fcgi_pattern[0] == '/' )
+	    ++fcgi_pattern;
+	hs->fcgi_pattern = strdup( fcgi_pattern );
+	if ( hs->fcgi_pattern == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory copying fcgi_pattern" );
+	    return (httpd_server*) 0;
+	    }
+	while ( ( cp = strstr( hs->fcgi_pattern, "|/" ) ) != (char*) 0 )
+	    (void) ol_strcpy( cp + 1, cp + 2 );
+	}
     hs->charset = strdup( charset );
     hs->p3p = strdup( p3p );
     hs->max_age = max_age;
@@ -397,7 +432,8 @@ httpd_initialize(
 	return (httpd_server*) 0;
 	}
 
-    init_mime();
+    init_mime( hs->charset );
+    httpd_vhost_reload( hs );
 
     /* Done initializing. */
     if ( hs->binding_hostname == (char*) 0 )
@@ -515,6 +551,17 @@ initialize_listen_socket( httpd_sockaddr* saP )
     }
 #endif /* SO_ACCEPTFILTER */
 
+    /* Or have the kernel hold connections until the request starts
+    ** arriving.
+    */
+#if defined(TCP_DEFER_ACCEPT) && defined(DEFER_ACCEPT_TIME)
+    optval = DEFER_ACCEPT_TIME;
+    if ( setsockopt(
+	     listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char*) &optval,
+	     sizeof(int) ) < 0 )
+	syslog( LOG_WARNING, "setsockopt TCP_DEFER_ACCEPT - %m" );
+#endif /* TCP_DEFER_ACCEPT && DEFER_ACCEPT_TIME */
+
     return listen_fd;
     }
 
@@ -737,6 +784,7 @@ httpd_terminate( httpd_server* hs )
     httpd_unlisten( hs );
     if ( hs->logfp != (FILE*) 0 )
 	(void) fclose( hs->logfp );
+    vhost_free_all();
     free_httpd_server( hs );
     }
 
@@ -825,25 +873,27 @@ char* httpd_err503form =
     "The requested URL '%.80s' is temporarily overloaded.  Please try again later.\n";
 
 
+/* Append bytes to the buffer waiting to be sent as response. */
+static void
+add_response_len( httpd_conn* hc, char* data, size_t len )
+    {
+    arena_str(
+	&hc->arena, &hc->response, &hc->maxresponse, hc->responselen + len );
+    (void) memmove( &(hc->response[hc->responselen]), data, len );
+    hc->responselen += len;
+    }
+
 /* Append a string to the buffer waiting to be sent as response. */
 static void
 add_response( httpd_conn* hc, char* str )
     {
-    size_t len;
-
-    len = strlen( str );
-    httpd_realloc_str( &hc->response, &hc->maxresponse, hc->responselen + len );
-    (void) memmove( &(hc->response[hc->responselen]), str, len );
-    hc->responselen += len;
+    add_response_len( hc, str, strlen( str ) );
     }
 
 /* Send the buffered response. */
 void
 httpd_write_response( httpd_conn* hc )
     {
-    /* If we are in a sub-process, turn off no-delay mode. */
-    if ( sub_process )
-	httpd_clear_ndelay( hc->conn_fd );
     /* Send the response, if necessary. */
     if ( hc->responselen > 0 )
 	{
@@ -901,7 +951,8 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
     char nowbuf[100];
     char modbuf[100];
     char expbuf[100];
-    char fixed_type[500];
+    char fixed_type_buf[500];
+    char* fixed_type;
     char buf[1000];
     int partial_content;
     int s100;
@@ -932,8 +983,14 @@ send_mime( httpd_conn* hc, int status, char* title, char* encodings, char* extra
 	    mod = now;
 	(void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
 	(void) strftime( modbuf, sizeof(modbuf), rfc1123fmt, gmtime( &mod ) );
-	(void) my_snprintf(
-	    fixed_type, sizeof(fixed_type), type, hc->hs->charset );
+	if ( strchr( type, '%' ) == (char*) 0 )
+	    fixed_type = type;
+	else
+	    {
+	    (void) my_snprintf(
+		fixed_type_buf, sizeof(fixed_type_buf), type, hc->hs->charset );
+	    fixed_type = fixed_type_buf;
+	    }
 	(void) my_snprintf( buf, sizeof(buf),
 	    "%.20s %d %s\015\012Server: %s\015\012Content-Type: %s\015\012Date: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012Connection: close\015\012",
 	    hc->protocol, status, title, EXPOSED_SERVER_SOFTWARE, fixed_type,
@@ -1189,12 +1246,13 @@ send_err_file( httpd_conn* hc, int status, char* title, char* extraheads, char*
 static void
 send_authenticate( httpd_conn* hc, char* realm )
     {
-    static char* header;
-    static size_t maxheader = 0;
+    char* header;
+    size_t maxheader = 0;
     static char headstr[] = "WWW-Authenticate: Basic realm=\"";
 
-    httpd_realloc_str(
-	&header, &maxheader, sizeof(headstr) + strlen( realm ) + 3 );
+    arena_str(
+	&hc->arena, &header, &maxheader,
+	sizeof(headstr) + strlen( realm ) + 3 );
     (void) my_snprintf( header, maxheader, "%s%s\"\015\012", headstr, realm );
     httpd_send_err( hc, 401, err401title, header, err401form, hc->encodedurl );
     /* If the request was a POST then there might still be data to be read,
@@ -1313,27 +1371,18 @@ auth_check( httpd_conn* hc, char* dirname  )
 static int
 auth_check2( httpd_conn* hc, char* dirname  )
     {
-    static char* authpath;
-    static size_t maxauthpath = 0;
+    char* authpath;
+    size_t maxauthpath = 0;
     struct stat sb;
     char authinfo[500];
     char* authpass;
     char* colon;
     int l;
-    FILE* fp;
-    char line[500];
-    char* cryp;
-    static char* prevauthpath;
-    static size_t maxprevauthpath = 0;
-    static time_t prevmtime;
-    static char* prevuser;
-    static size_t maxprevuser = 0;
-    static char* prevcryp;
-    static size_t maxprevcryp = 0;
 
     /* Construct auth filename. */
-    httpd_realloc_str(
-	&authpath, &maxauthpath, strlen( dirname ) + 1 + sizeof(AUTH_FILE) );
+    arena_str(
+	&hc->arena, &authpath, &maxauthpath,
+	strlen( dirname ) + 1 + sizeof(AUTH_FILE) );
     (void) my_snprintf( authpath, maxauthpath, "%s/%s", dirname, AUTH_FILE );
 
     /* Does this directory have an auth file? */
@@ -1369,33 +1418,17 @@ auth_check2( httpd_conn* hc, char* dirname  )
     if ( colon != (char*) 0 )
 	*colon = '\0';
 
-    /* See if we have a cached entry and can use it. */
-    if ( maxprevauthpath != 0 &&
-	 strcmp( authpath, prevauthpath ) == 0 &&
-	 sb.st_mtime == prevmtime &&
-	 strcmp( authinfo, prevuser ) == 0 )
+    /* Check the password file, which normally comes from the cache. */
+    switch ( authcache_check(
+		 authpath, &sb, authinfo, authpass, (struct timeval*) 0 ) )
 	{
-	/* Yes.  Check against the cached encrypted password. */
-	if ( strcmp( crypt( authpass, prevcryp ), prevcryp ) == 0 )
-	    {
-	    /* Ok! */
-	    httpd_realloc_str(
-		&hc->remoteuser, &hc->maxremoteuser, strlen( authinfo ) );
-	    (void) strcpy( hc->remoteuser, authinfo );
-	    return 1;
-	    }
-	else
-	    {
-	    /* No. */
-	    send_authenticate( hc, dirname );
-	    return -1;
-	    }
-	}
+	case AC_OK:
+	arena_str(
+	    &hc->arena, &hc->remoteuser, &hc->maxremoteuser, strlen( authinfo ) );
+	(void) strcpy( hc->remoteuser, authinfo );
+	return 1;
 
-    /* Open the password file. */
-    fp = fopen( authpath, "r" );
-    if ( fp == (FILE*) 0 )
-	{
+	case AC_ERROR:
 	/* The file exists but we can't open it?  Disallow access. */
 	syslog(
 	    LOG_ERR, "%.80s auth file %.80s could not be opened - %m",
@@ -1407,53 +1440,7 @@ auth_check2( httpd_conn* hc, char* dirname  )
 	return -1;
 	}
 
-    /* Read it. */
-    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
-	{
-	/* Nuke newline. */
-	l = strlen( line );
-	if ( line[l - 1] == '\n' )
-	    line[l - 1] = '\0';
-	/* Split into user and encrypted password. */
-	cryp = strchr( line, ':' );
-	if ( cryp == (char*) 0 )
-	    continue;
-	*cryp++ = '\0';
-	/* Is this the right user? */
-	if ( strcmp( line, authinfo ) == 0 )
-	    {
-	    /* Yes. */
-	    (void) fclose( fp );
-	    /* So is the password right? */
-	    if ( strcmp( crypt( authpass, cryp ), cryp ) == 0 )
-		{
-		/* Ok! */
-		httpd_realloc_str(
-		    &hc->remoteuser, &hc->maxremoteuser, strlen( line ) );
-		(void) strcpy( hc->remoteuser, line );
-		/* And cache this user's info for next time. */
-		httpd_realloc_str(
-		    &prevauthpath, &maxprevauthpath, strlen( authpath ) );
-		(void) strcpy( prevauthpath, authpath );
-		prevmtime = sb.st_mtime;
-		httpd_realloc_str(
-		    &prevuser, &maxprevuser, strlen( authinfo ) );
-		(void) strcpy( prevuser, authinfo );
-		httpd_realloc_str( &prevcryp, &maxprevcryp, strlen( cryp ) );
-		(void) strcpy( prevcryp, cryp );
-		return 1;
-		}
-	    else
-		{
-		/* No. */
-		send_authenticate( hc, dirname );
-		return -1;
-		}
-	    }
-	}
-
-    /* Didn't find that user.  Access denied. */
-    (void) fclose( fp );
+    /* Wrong user or password.  Access denied. */
     send_authenticate( hc, dirname );
     return -1;
     }
@@ -1464,9 +1451,9 @@ auth_check2( httpd_conn* hc, char* dirname  )
 static void
 send_dirredirect( httpd_conn* hc )
     {
-    static char* location;
-    static char* header;
-    static size_t maxlocation = 0, maxheader = 0;
+    char* location;
+    char* header;
+    size_t maxlocation = 0, maxheader = 0;
     static char headstr[] = "Location: ";
 
     if ( hc->query[0] != '\0')
@@ -1474,21 +1461,23 @@ send_dirredirect( httpd_conn* hc )
 	char* cp = strchr( hc->encodedurl, '?' );
 	if ( cp != (char*) 0 )	/* should always find it */
 	    *cp = '\0';
-	httpd_realloc_str(
-	    &location, &maxlocation,
+	arena_str(
+	    &hc->arena, &location, &maxlocation,
 	    strlen( hc->encodedurl ) + 2 + strlen( hc->query ) );
 	(void) my_snprintf( location, maxlocation,
 	    "%s/?%s", hc->encodedurl, hc->query );
 	}
     else
 	{
-	httpd_realloc_str(
-	    &location, &maxlocation, strlen( hc->encodedurl ) + 1 );
+	arena_str(
+	    &hc->arena, &location, &maxlocation,
+	    strlen( hc->encodedurl ) + 1 );
 	(void) my_snprintf( location, maxlocation,
 	    "%s/", hc->encodedurl );
 	}
-    httpd_realloc_str(
-	&header, &maxheader, sizeof(headstr) + strlen( location ) );
+    arena_str(
+	&hc->arena, &header, &maxheader,
+	sizeof(headstr) + strlen( location ) );
     (void) my_snprintf( header, maxheader,
 	"%s%s\015\012", headstr, location );
     send_response( hc, 302, err302title, header, err302form, location );
@@ -1576,16 +1565,17 @@ strencode( char* to, int tosize, char* from )
 static int
 tilde_map_1( httpd_conn* hc )
     {
-    static char* temp;
-    static size_t maxtemp = 0;
+    char* temp;
+    size_t maxtemp = 0;
     int len;
     static char* prefix = TILDE_MAP_1;
 
     len = strlen( hc->expnfilename ) - 1;
-    httpd_realloc_str( &temp, &maxtemp, len );
+    arena_str( &hc->arena, &temp, &maxtemp, len );
     (void) strcpy( temp, &hc->expnfilename[1] );
-    httpd_realloc_str(
-	&hc->expnfilename, &hc->maxexpnfilename, strlen( prefix ) + 1 + len );
+    arena_str(
+	&hc->arena, &hc->expnfilename, &hc->maxexpnfilename,
+	strlen( prefix ) + 1 + len );
     (void) strcpy( hc->expnfilename, prefix );
     if ( prefix[0] != '\0' )
 	(void) strcat( hc->expnfilename, "/" );
@@ -1595,20 +1585,277 @@ tilde_map_1( httpd_conn* hc )
 #endif /* TILDE_MAP_1 */
 
 #ifdef TILDE_MAP_2
-/* Map a ~username/whatever URL into <user's homedir>/<postfix>. */
-static int
-tilde_map_2( httpd_conn* hc )
+/* Cache of username to resolved alternate directory, so getpwnam() and
+** the symlink walk don't happen on every ~user request.  Unknown users
+** get remembered too, with a null altdir.  Besides the hash chains, the
+** entries are on two lists: by last use, newest first, for dropping the
+** least recently used, and by expiry, soonest first, so that
+** httpd_tilde_cleanup() can refresh the ones in use a few at a time
+** before they expire.  That way requests only do the lookups for users
+** they haven't seen lately.
+*/
+typedef struct tilde_struct {
+    char* user;
+    char* altdir;
+    time_t expires;
+    time_t used;
+    struct tilde_struct* next;
+    struct tilde_struct* lru_prev;
+    struct tilde_struct* lru_next;
+    struct tilde_struct* exp_prev;
+    struct tilde_struct* exp_next;
+    } tilde_entry;
+#define TILDE_HASH_SIZE 1024	/* must be a power of two */
+static tilde_entry* tilde_table[TILDE_HASH_SIZE];
+static tilde_entry* tilde_lru_head = (tilde_entry*) 0;
+static tilde_entry* tilde_lru_tail = (tilde_entry*) 0;
+static tilde_entry* tilde_exp_head = (tilde_entry*) 0;
+static tilde_entry* tilde_exp_tail = (tilde_entry*) 0;
+static int tilde_count = 0;
+static long tilde_hits = 0, tilde_misses = 0;
+
+
+static unsigned int
+tilde_hash( const char* user )
+    {
+    unsigned int h = 5381;
+
+    while ( *user != '\0' )
+	h = ( h << 5 ) + h + (unsigned char) *user++;
+    return h & ( TILDE_HASH_SIZE - 1 );
+    }
+
+
+static tilde_entry*
+tilde_find( char* user )
+    {
+    tilde_entry* te;
+
+    for ( te = tilde_table[tilde_hash( user )]; te != (tilde_entry*) 0;
+	  te = te->next )
+	if ( strcmp( te->user, user ) == 0 )
+	    return te;
+    return (tilde_entry*) 0;
+    }
+
+
+/* Look up a user's alternate directory the slow way.  Returns a malloc()ed
+** string, or (char*) 0 if there's no such user or directory.
+*/
+static char*
+tilde_resolve( char* user )
     {
-    static char* temp;
-    static size_t maxtemp = 0;
+    Arena ar;
+    char* altdir;
+    size_t maxaltdir = 0;
     static char* postfix = TILDE_MAP_2;
-    char* cp;
     struct passwd* pw;
     char* alt;
     char* rest;
 
+    pw = getpwnam( user );
+    if ( pw == (struct passwd*) 0 )
+	return (char*) 0;
+    /* There's no connection here, so the scratch space is our own. */
+    arena_init( &ar, 0 );
+    arena_str(
+	&ar, &altdir, &maxaltdir,
+	strlen( pw->pw_dir ) + 1 + strlen( postfix ) );
+    (void) strcpy( altdir, pw->pw_dir );
+    if ( postfix[0] != '\0' )
+	{
+	(void) strcat( altdir, "/" );
+	(void) strcat( altdir, postfix );
+	}
+    alt = expand_symlinks( &ar, altdir, &rest, 0, 1 );
+    if ( alt == (char*) 0 || rest[0] != '\0' )
+	alt = (char*) 0;
+    else
+	{
+	alt = strdup( alt );
+	if ( alt == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory copying a tilde directory" );
+	    exit( 1 );
+	    }
+	}
+    arena_free( &ar );
+    return alt;
+    }
+
+
+static void
+tilde_lru_remove( tilde_entry* te )
+    {
+    if ( te->lru_prev != (tilde_entry*) 0 )
+	te->lru_prev->lru_next = te->lru_next;
+    else
+	tilde_lru_head = te->lru_next;
+    if ( te->lru_next != (tilde_entry*) 0 )
+	te->lru_next->lru_prev = te->lru_prev;
+    else
+	tilde_lru_tail = te->lru_prev;
+    }
+
+
+static void
+tilde_exp_remove( tilde_entry* te )
+    {
+    if ( te->exp_prev != (tilde_entry*) 0 )
+	te->exp_prev->exp_next = te->exp_next;
+    else
+	tilde_exp_head = te->exp_next;
+    if ( te->exp_next != (tilde_entry*) 0 )
+	te->exp_next->exp_prev = te->exp_prev;
+    else
+	tilde_exp_tail = te->exp_prev;
+    }
+
+
+/* Mark an entry used, moving it to the front of the LRU list. */
+static void
+tilde_used( tilde_entry* te, time_t now )
+    {
+    te->used = now;
+    if ( te == tilde_lru_head )
+	return;
+    tilde_lru_remove( te );
+    te->lru_prev = (tilde_entry*) 0;
+    te->lru_next = tilde_lru_head;
+    tilde_lru_head->lru_prev = te;
+    tilde_lru_head = te;
+    }
+
+
+/* Give an entry a freshly looked up directory, moving it to the end of
+** the expiry list.
+*/
+static void
+tilde_resolved( tilde_entry* te, char* altdir, time_t now )
+    {
+    if ( te->altdir != (char*) 0 )
+	free( (void*) te->altdir );
+    te->altdir = altdir;
+    te->expires = now + TILDE_CACHE_TIME;
+    if ( te == tilde_exp_tail )
+	return;
+    tilde_exp_remove( te );
+    te->exp_next = (tilde_entry*) 0;
+    te->exp_prev = tilde_exp_tail;
+    tilde_exp_tail->exp_next = te;
+    tilde_exp_tail = te;
+    }
+
+
+static void
+tilde_free( tilde_entry* te )
+    {
+    tilde_entry** tePP;
+
+    for ( tePP = &tilde_table[tilde_hash( te->user )]; *tePP != te;
+	  tePP = &(*tePP)->next )
+	;
+    *tePP = te->next;
+    tilde_lru_remove( te );
+    tilde_exp_remove( te );
+    free( (void*) te->user );
+    if ( te->altdir != (char*) 0 )
+	free( (void*) te->altdir );
+    free( (void*) te );
+    --tilde_count;
+    }
+
+
+/* Add an entry, making room first by dropping the least recently used
+** one if the cache is full.
+*/
+static tilde_entry*
+tilde_add( char* user, char* altdir, time_t now )
+    {
+    tilde_entry* te;
+    unsigned int h;
+
+    if ( tilde_count >= TILDE_CACHE_SIZE )
+	tilde_free( tilde_lru_tail );
+
+    te = NEW( tilde_entry, 1 );
+    if ( te == (tilde_entry*) 0 || ( te->user = strdup( user ) ) == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating a tilde entry" );
+	exit( 1 );
+	}
+    te->altdir = altdir;
+    te->expires = now + TILDE_CACHE_TIME;
+    te->used = now;
+    h = tilde_hash( user );
+    te->next = tilde_table[h];
+    tilde_table[h] = te;
+    te->lru_prev = (tilde_entry*) 0;
+    te->lru_next = tilde_lru_head;
+    if ( tilde_lru_head != (tilde_entry*) 0 )
+	tilde_lru_head->lru_prev = te;
+    else
+	tilde_lru_tail = te;
+    tilde_lru_head = te;
+    te->exp_next = (tilde_entry*) 0;
+    te->exp_prev = tilde_exp_tail;
+    if ( tilde_exp_tail != (tilde_entry*) 0 )
+	tilde_exp_tail->exp_next = te;
+    else
+	tilde_exp_head = te;
+    tilde_exp_tail = te;
+    ++tilde_count;
+    return te;
+    }
+
+
+#endif /* TILDE_MAP_2 */
+
+
+/* Drop the tilde cache entries that haven't been used lately, and
+** refresh up to TILDE_CACHE_REFRESH of the rest that are getting close
+** to expiring; any that miss out get looked up again by the next request
+** after they expire.  This should be called periodically, and more often
+** than TILDE_CACHE_TIME / 2.
+*/
+void
+httpd_tilde_cleanup( struct timeval* nowP )
+    {
+#ifdef TILDE_MAP_2
+    time_t now;
+    int n;
+
+    if ( nowP != (struct timeval*) 0 )
+	now = nowP->tv_sec;
+    else
+	now = time( (time_t*) 0 );
+    while ( tilde_lru_tail != (tilde_entry*) 0 &&
+	    tilde_lru_tail->used < now - TILDE_CACHE_TIME )
+	tilde_free( tilde_lru_tail );
+    for ( n = 0;
+	  n < TILDE_CACHE_REFRESH && tilde_exp_head != (tilde_entry*) 0 &&
+	    tilde_exp_head->expires - now < TILDE_CACHE_TIME / 2;
+	  ++n )
+	tilde_resolved(
+	    tilde_exp_head, tilde_resolve( tilde_exp_head->user ), now );
+#endif /* TILDE_MAP_2 */
+    }
+
+
+#ifdef TILDE_MAP_2
+/* Map a ~username/whatever URL into <user's homedir>/<postfix>. */
+static int
+tilde_map_2( httpd_conn* hc )
+    {
+    char* temp;
+    size_t maxtemp = 0;
+    char* cp;
+    tilde_entry* te;
+    time_t now;
+
     /* Get the username. */
-    httpd_realloc_str( &temp, &maxtemp, strlen( hc->expnfilename ) - 1 );
+    arena_str(
+	&hc->arena, &temp, &maxtemp, strlen( hc->expnfilename ) - 1 );
     (void) strcpy( temp, &hc->expnfilename[1] );
     cp = strchr( temp, '/' );
     if ( cp != (char*) 0 )
@@ -1616,30 +1863,31 @@ tilde_map_2( httpd_conn* hc )
     else
 	cp = "";
 
-    /* Get the passwd entry. */
-    pw = getpwnam( temp );
-    if ( pw == (struct passwd*) 0 )
-	return 0;
-
-    /* Set up altdir. */
-    httpd_realloc_str(
-	&hc->altdir, &hc->maxaltdir,
-	strlen( pw->pw_dir ) + 1 + strlen( postfix ) );
-    (void) strcpy( hc->altdir, pw->pw_dir );
-    if ( postfix[0] != '\0' )
+    /* Find the user's directory, in the cache if possible. */
+    now = time( (time_t*) 0 );
+    te = tilde_find( temp );
+    if ( te != (tilde_entry*) 0 && te->expires > now )
+	++tilde_hits;
+    else
 	{
-	(void) strcat( hc->altdir, "/" );
-	(void) strcat( hc->altdir, postfix );
+	++tilde_misses;
+	if ( te != (tilde_entry*) 0 )
+	    tilde_resolved( te, tilde_resolve( temp ), now );
+	else
+	    te = tilde_add( temp, tilde_resolve( temp ), now );
 	}
-    alt = expand_symlinks( hc->altdir, &rest, 0, 1 );
-    if ( rest[0] != '\0' )
+    tilde_used( te, now );
+    if ( te->altdir == (char*) 0 )
 	return 0;
-    httpd_realloc_str( &hc->altdir, &hc->maxaltdir, strlen( alt ) );
-    (void) strcpy( hc->altdir, alt );
+
+    /* Set up altdir. */
+    arena_str(
+	&hc->arena, &hc->altdir, &hc->maxaltdir, strlen( te->altdir ) );
+    (void) strcpy( hc->altdir, te->altdir );
 
     /* And the filename becomes altdir plus the post-~ part of the original. */
-    httpd_realloc_str(
-	&hc->expnfilename, &hc->maxexpnfilename,
+    arena_str(
+	&hc->arena, &hc->expnfilename, &hc->maxexpnfilename,
 	strlen( hc->altdir ) + 1 + strlen( cp ) );
     (void) my_snprintf( hc->expnfilename, hc->maxexpnfilename,
 	"%s/%s", hc->altdir, cp );
@@ -1652,54 +1900,68 @@ tilde_map_2( httpd_conn* hc )
 #endif /* TILDE_MAP_2 */
 
 
-/* Virtual host mapping. */
-static int
-vhost_map( httpd_conn* hc )
+/* The vhost table maps each hostname that has a directory in the web
+** tree to its precomputed host directory.  It gets built by scanning
+** the tree at startup and on SIGHUP, so per-request mapping is a hash
+** lookup and bogus Host headers never touch the filesystem.  If the
+** tree can't be scanned, vhost_map() falls back to building the host
+** directory for each request.
+*/
+typedef struct vhost_struct {
+    char* hostname;
+    char* hostdir;
+    size_t hostdirlen;
+    long requests;
+    off_t bytes;
+    struct vhost_struct* next;
+    } vhost_entry;
+static vhost_entry** vhost_table = (vhost_entry**) 0;
+static int vhost_table_size = 0;
+static int vhost_count = 0;
+static long vhost_unknown = 0;
+
+
+static unsigned int
+vhost_hash( const char* hostname )
     {
-    httpd_sockaddr sa;
-    socklen_t sz;
-    static char* tempfilename;
-    static size_t maxtempfilename = 0;
-    char* cp1;
-    int len;
-#ifdef VHOST_DIRLEVELS
-    int i;
-    char* cp2;
-#endif /* VHOST_DIRLEVELS */
+    unsigned int h = 5381;
 
-    /* Figure out the virtual hostname. */
-    if ( hc->reqhost[0] != '\0' )
-	hc->hostname = hc->reqhost;
-    else if ( hc->hdrhost[0] != '\0' )
-	hc->hostname = hc->hdrhost;
-    else
-	{
-	sz = sizeof(sa);
-	if ( getsockname( hc->conn_fd, &sa.sa, &sz ) < 0 )
-	    {
-	    syslog( LOG_ERR, "getsockname - %m" );
-	    return 0;
-	    }
-	hc->hostname = httpd_ntoa( &sa );
-	}
-    /* Pound it to lower case. */
-    for ( cp1 = hc->hostname; *cp1 != '\0'; ++cp1 )
-	if ( isupper( *cp1 ) )
-	    *cp1 = tolower( *cp1 );
+    while ( *hostname != '\0' )
+	h = ( h << 5 ) + h + (unsigned char) *hostname++;
+    return h;
+    }
 
-    if ( hc->tildemapped )
-	return 1;
 
-    /* Figure out the host directory. */
+static vhost_entry*
+vhost_find( const char* hostname )
+    {
+    vhost_entry* vh;
+
+    for ( vh = vhost_table[vhost_hash( hostname ) & ( vhost_table_size - 1 )];
+	  vh != (vhost_entry*) 0; vh = vh->next )
+	if ( strcmp( vh->hostname, hostname ) == 0 )
+	    return vh;
+    return (vhost_entry*) 0;
+    }
+
+
+/* Figure out the host directory for a hostname. */
+static void
+vhost_hostdir(
+    Arena* ar, char* hostname, char** hostdirP, size_t* maxhostdirP )
+    {
 #ifdef VHOST_DIRLEVELS
-    httpd_realloc_str(
-	&hc->hostdir, &hc->maxhostdir,
-	strlen( hc->hostname ) + 2 * VHOST_DIRLEVELS );
-    if ( strncmp( hc->hostname, "www.", 4 ) == 0 )
-	cp1 = &hc->hostname[4];
+    int i;
+    char* cp1;
+    char* cp2;
+
+    arena_str(
+	ar, hostdirP, maxhostdirP, strlen( hostname ) + 2 * VHOST_DIRLEVELS );
+    if ( strncmp( hostname, "www.", 4 ) == 0 )
+	cp1 = &hostname[4];
     else
-	cp1 = hc->hostname;
-    for ( cp2 = hc->hostdir, i = 0; i < VHOST_DIRLEVELS; ++i )
+	cp1 = hostname;
+    for ( cp2 = *hostdirP, i = 0; i < VHOST_DIRLEVELS; ++i )
 	{
 	/* Skip dots in the hostname.  If we don't, then we get vhost
 	** directories in higher level of filestructure if dot gets
@@ -1717,58 +1979,328 @@ vhost_map( httpd_conn* hc )
 	/* Copy a slash. */
 	*cp2++ = '/';
 	}
-    (void) strcpy( cp2, hc->hostname );
+    (void) strcpy( cp2, hostname );
 #else /* VHOST_DIRLEVELS */
-    httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, strlen( hc->hostname ) );
-    (void) strcpy( hc->hostdir, hc->hostname );
+    arena_str( ar, hostdirP, maxhostdirP, strlen( hostname ) );
+    (void) strcpy( *hostdirP, hostname );
 #endif /* VHOST_DIRLEVELS */
-
-    /* Prepend hostdir to the filename. */
-    len = strlen( hc->expnfilename );
-    httpd_realloc_str( &tempfilename, &maxtempfilename, len );
-    (void) strcpy( tempfilename, hc->expnfilename );
-    httpd_realloc_str(
-	&hc->expnfilename, &hc->maxexpnfilename,
-	strlen( hc->hostdir ) + 1 + len );
-    (void) strcpy( hc->expnfilename, hc->hostdir );
-    (void) strcat( hc->expnfilename, "/" );
-    (void) strcat( hc->expnfilename, tempfilename );
-    return 1;
     }
 
 
-/* Expands all symlinks in the given filename, eliding ..'s and leading /'s.
-** Returns the expanded path (pointer to static string), or (char*) 0 on
-** errors.  Also returns, in the string pointed to by restP, any trailing
-** parts of the path that don't exist.
-**
-** This is a fairly nice little routine.  It handles any size filenames
-** without excessive mallocs.
-*/
-static char*
-expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped )
+static void
+vhost_add( char* hostname, char* hostdir )
     {
-    static char* checked;
-    static char* rest;
-    char lnk[5000];
-    static size_t maxchecked = 0, maxrest = 0;
-    size_t checkedlen, restlen, linklen, prevcheckedlen, prevrestlen;
-    int nlinks, i;
-    char* r;
-    char* cp1;
-    char* cp2;
+    vhost_entry* vh;
+    vhost_entry** new_table;
+    vhost_entry* next;
+    int new_size, i;
+    unsigned int h;
+
+    /* Keep the chains short. */
+    if ( vhost_count >= vhost_table_size * 2 )
+	{
+	new_size = vhost_table_size * 2;
+	new_table = NEW( vhost_entry*, new_size );
+	if ( new_table == (vhost_entry**) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory growing the vhost table" );
+	    exit( 1 );
+	    }
+	for ( i = 0; i < new_size; ++i )
+	    new_table[i] = (vhost_entry*) 0;
+	for ( i = 0; i < vhost_table_size; ++i )
+	    for ( vh = vhost_table[i]; vh != (vhost_entry*) 0; vh = next )
+		{
+		next = vh->next;
+		h = vhost_hash( vh->hostname ) & ( new_size - 1 );
+		vh->next = new_table[h];
+		new_table[h] = vh;
+		}
+	free( (void*) vhost_table );
+	vhost_table = new_table;
+	vhost_table_size = new_size;
+	}
 
-    if ( no_symlink_check )
+    vh = NEW( vhost_entry, 1 );
+    if ( vh == (vhost_entry*) 0 )
 	{
-	/* If we are chrooted, we can actually skip the symlink-expansion,
-	** since it's impossible to get out of the tree.  However, we still
-	** need to do the pathinfo check, and the existing symlink expansion
-	** code is a pretty reasonable way to do this.  So, what we do is
-	** a single stat() of the whole filename - if it exists, then we
-	** return it as is with nothing in restP.  If it doesn't exist, we
-	** fall through to the existing code.
-	**
-	** One side-effect of this is that users can't symlink to central
+	syslog( LOG_CRIT, "out of memory allocating a vhost entry" );
+	exit( 1 );
+	}
+    vh->hostname = strdup( hostname );
+    vh->hostdir = strdup( hostdir );
+    if ( vh->hostname == (char*) 0 || vh->hostdir == (char*) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory copying a vhost name" );
+	exit( 1 );
+	}
+    vh->hostdirlen = strlen( hostdir );
+    vh->requests = 0;
+    vh->bytes = 0;
+    h = vhost_hash( hostname ) & ( vhost_table_size - 1 );
+    vh->next = vhost_table[h];
+    vhost_table[h] = vh;
+    ++vhost_count;
+    }
+
+
+/* Recursively scan the web tree for host directories.  With
+** VHOST_DIRLEVELS they sit that many levels down, and only count if
+** the hostname really maps to where they were found.
+*/
+static int
+vhost_scan( char* dir, int levels )
+    {
+    Arena ar;
+    char* hostdir;
+    size_t maxhostdir;
+    DIR* dirp;
+    struct dirent* de;
+    char path[MAXPATHLEN+1];
+    struct stat sb;
+    char* name;
+    char* cp;
+
+    dirp = opendir( dir );
+    if ( dirp == (DIR*) 0 )
+	return -1;
+    arena_init( &ar, 0 );
+    while ( ( de = readdir( dirp ) ) != (struct dirent*) 0 )
+	{
+	name = de->d_name;
+	/* Hostnames never start with a dot, and this skips . and .. too. */
+	if ( name[0] == '.' )
+	    continue;
+	if ( strcmp( dir, "." ) == 0 )
+	    (void) my_snprintf( path, sizeof(path), "%s", name );
+	else
+	    (void) my_snprintf( path, sizeof(path), "%s/%s", dir, name );
+	if ( stat( path, &sb ) < 0 || ! S_ISDIR( sb.st_mode ) )
+	    continue;
+	if ( levels > 0 )
+	    {
+	    (void) vhost_scan( path, levels - 1 );
+	    continue;
+	    }
+	/* Requested hostnames get lowercased, so others can't match. */
+	for ( cp = name; *cp != '\0'; ++cp )
+	    if ( isupper( *cp ) )
+		break;
+	if ( *cp != '\0' )
+	    continue;
+	maxhostdir = 0;
+	vhost_hostdir( &ar, name, &hostdir, &maxhostdir );
+	if ( strcmp( hostdir, path ) == 0 && vhost_find( name ) == (vhost_entry*) 0 )
+	    vhost_add( name, path );
+	arena_reset( &ar );
+	}
+    (void) closedir( dirp );
+    arena_free( &ar );
+    return 0;
+    }
+
+
+static void
+vhost_free( vhost_entry** table, int size )
+    {
+    vhost_entry* vh;
+    vhost_entry* next;
+    int i;
+
+    for ( i = 0; i < size; ++i )
+	for ( vh = table[i]; vh != (vhost_entry*) 0; vh = next )
+	    {
+	    next = vh->next;
+	    free( (void*) vh->hostname );
+	    free( (void*) vh->hostdir );
+	    free( (void*) vh );
+	    }
+    free( (void*) table );
+    }
+
+
+static void
+vhost_free_all( void )
+    {
+    if ( vhost_table != (vhost_entry**) 0 )
+	{
+	vhost_free( vhost_table, vhost_table_size );
+	vhost_table = (vhost_entry**) 0;
+	vhost_table_size = vhost_count = 0;
+	}
+    }
+
+
+void
+httpd_vhost_reload( httpd_server* hs )
+    {
+    vhost_entry** old_table;
+    int old_size, i;
+    vhost_entry* vh;
+    vhost_entry* ovh;
+
+    if ( ! hs->vhost )
+	return;
+
+    old_table = vhost_table;
+    old_size = vhost_table_size;
+    vhost_table_size = 64;
+    vhost_count = 0;
+    vhost_table = NEW( vhost_entry*, vhost_table_size );
+    if ( vhost_table == (vhost_entry**) 0 )
+	{
+	syslog( LOG_CRIT, "out of memory allocating the vhost table" );
+	exit( 1 );
+	}
+    for ( i = 0; i < vhost_table_size; ++i )
+	vhost_table[i] = (vhost_entry*) 0;
+#ifdef VHOST_DIRLEVELS
+    if ( vhost_scan( ".", VHOST_DIRLEVELS ) < 0 )
+#else /* VHOST_DIRLEVELS */
+    if ( vhost_scan( ".", 0 ) < 0 )
+#endif /* VHOST_DIRLEVELS */
+	{
+	syslog(
+	    LOG_WARNING,
+	    "can't scan the web directory for virtual hosts - %m - mapping them per request" );
+	vhost_free_all();
+	}
+
+    if ( old_table != (vhost_entry**) 0 )
+	{
+	/* Carry the counters over to the new table. */
+	if ( vhost_table != (vhost_entry**) 0 )
+	    for ( i = 0; i < old_size; ++i )
+		for ( ovh = old_table[i]; ovh != (vhost_entry*) 0;
+		      ovh = ovh->next )
+		    {
+		    vh = vhost_find( ovh->hostname );
+		    if ( vh != (vhost_entry*) 0 )
+			{
+			vh->requests = ovh->requests;
+			vh->bytes = ovh->bytes;
+			}
+		    }
+	vhost_free( old_table, old_size );
+	}
+    }
+
+
+/* Virtual host mapping.  Returns 1 on success, 0 on errors, or -1 if
+** there is no such host.
+*/
+static int
+vhost_map( httpd_conn* hc )
+    {
+    httpd_sockaddr sa;
+    socklen_t sz;
+    vhost_entry* vh;
+    char* cp1;
+    size_t len;
+
+    /* Figure out the virtual hostname. */
+    if ( hc->reqhost[0] != '\0' )
+	hc->hostname = hc->reqhost;
+    else if ( hc->hdrhost[0] != '\0' )
+	hc->hostname = hc->hdrhost;
+    else
+	{
+	sz = sizeof(sa);
+	if ( getsockname( hc->conn_fd, &sa.sa, &sz ) < 0 )
+	    {
+	    syslog( LOG_ERR, "getsockname - %m" );
+	    return 0;
+	    }
+	hc->hostname = httpd_ntoa( &sa );
+	}
+    /* Pound it to lower case. */
+    for ( cp1 = hc->hostname; *cp1 != '\0'; ++cp1 )
+	if ( isupper( *cp1 ) )
+	    *cp1 = tolower( *cp1 );
+
+    if ( hc->tildemapped )
+	return 1;
+
+    /* Figure out the host directory. */
+    if ( vhost_table != (vhost_entry**) 0 )
+	{
+	vh = vhost_find( hc->hostname );
+	if ( vh == (vhost_entry*) 0 )
+	    {
+	    ++vhost_unknown;
+	    return -1;
+	    }
+	arena_str( &hc->arena, &hc->hostdir, &hc->maxhostdir, vh->hostdirlen );
+	(void) memcpy( hc->hostdir, vh->hostdir, vh->hostdirlen + 1 );
+	}
+    else
+	vhost_hostdir(
+	    &hc->arena, hc->hostname, &hc->hostdir, &hc->maxhostdir );
+
+    /* Prepend hostdir to the filename. */
+    len = strlen( hc->hostdir );
+    arena_str(
+	&hc->arena, &hc->expnfilename, &hc->maxexpnfilename,
+	len + 1 + strlen( hc->expnfilename ) );
+    (void) memmove(
+	&hc->expnfilename[len + 1], hc->expnfilename,
+	strlen( hc->expnfilename ) + 1 );
+    (void) memcpy( hc->expnfilename, hc->hostdir, len );
+    hc->expnfilename[len] = '/';
+    return 1;
+    }
+
+
+/* Charge a finished request to its virtual host. */
+static void
+vhost_account( httpd_conn* hc )
+    {
+    vhost_entry* vh;
+
+    if ( vhost_table == (vhost_entry**) 0 || hc->hostdir[0] == '\0' ||
+	 hc->hostname == (char*) 0 )
+	return;
+    vh = vhost_find( hc->hostname );
+    if ( vh == (vhost_entry*) 0 )
+	return;
+    ++vh->requests;
+    if ( hc->bytes_sent > 0 )
+	vh->bytes += hc->bytes_sent;
+    }
+
+
+/* Expands all symlinks in the given filename, eliding ..'s and leading /'s.
+** Returns the expanded path, allocated from the given arena, or (char*) 0
+** on errors.  Also returns, in the string pointed to by restP, any
+** trailing parts of the path that don't exist.
+**
+** This is a fairly nice little routine.  It handles any size filenames
+** without excessive mallocs.
+*/
+static char*
+expand_symlinks( Arena* ar, char* path, char** restP, int no_symlink_check, int tildemapped )
+    {
+    char* checked;
+    char* rest;
+    char lnk[5000];
+    size_t maxchecked = 0, maxrest = 0;
+    size_t checkedlen, restlen, linklen, prevcheckedlen, prevrestlen;
+    int nlinks, i;
+    char* r;
+    char* cp1;
+    char* cp2;
+
+    if ( no_symlink_check )
+	{
+	/* If we are chrooted, we can actually skip the symlink-expansion,
+	** since it's impossible to get out of the tree.  However, we still
+	** need to do the pathinfo check, and the existing symlink expansion
+	** code is a pretty reasonable way to do this.  So, what we do is
+	** a single stat() of the whole filename - if it exists, then we
+	** return it as is with nothing in restP.  If it doesn't exist, we
+	** fall through to the existing code.
+	**
+	** One side-effect of this is that users can't symlink to central
 	** approved CGIs any more.  The workaround is to use the central
 	** URL for the CGI instead of a local symlinked one.
 	*/
@@ -1776,7 +2308,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 	if ( stat( path, &sb ) != -1 )
 	    {
 	    checkedlen = strlen( path );
-	    httpd_realloc_str( &checked, &maxchecked, checkedlen );
+	    arena_str( ar, &checked, &maxchecked, checkedlen );
 	    (void) strcpy( checked, path );
 	    /* Trim trailing slashes. */
 	    while ( checked[checkedlen - 1] == '/' )
@@ -1784,7 +2316,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 		checked[checkedlen - 1] = '\0';
 		--checkedlen;
 		}
-	    httpd_realloc_str( &rest, &maxrest, 0 );
+	    arena_str( ar, &rest, &maxrest, 0 );
 	    rest[0] = '\0';
 	    *restP = rest;
 	    return checked;
@@ -1792,11 +2324,11 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 	}
 
     /* Start out with nothing in checked and the whole filename in rest. */
-    httpd_realloc_str( &checked, &maxchecked, 1 );
+    arena_str( ar, &checked, &maxchecked, 1 );
     checked[0] = '\0';
     checkedlen = 0;
     restlen = strlen( path );
-    httpd_realloc_str( &rest, &maxrest, restlen );
+    arena_str( ar, &rest, &maxrest, restlen );
     (void) strcpy( rest, path );
     if ( rest[restlen - 1] == '/' )
 	rest[--restlen] = '\0';         /* trim trailing slash */
@@ -1827,7 +2359,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 	    if ( i == 0 )
 		{
 		/* Special case for absolute paths. */
-		httpd_realloc_str( &checked, &maxchecked, checkedlen + 1 );
+		arena_str( ar, &checked, &maxchecked, checkedlen + 1 );
 		(void) strncpy( &checked[checkedlen], r, 1 );
 		checkedlen += 1;
 		}
@@ -1847,7 +2379,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 		}
 	    else
 		{
-		httpd_realloc_str( &checked, &maxchecked, checkedlen + 1 + i );
+		arena_str( ar, &checked, &maxchecked, checkedlen + 1 + i );
 		if ( checkedlen > 0 && checked[checkedlen-1] != '/' )
 		    checked[checkedlen++] = '/';
 		(void) strncpy( &checked[checkedlen], r, i );
@@ -1877,8 +2409,8 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 		}
 	    else
 		{
-		httpd_realloc_str(
-		    &checked, &maxchecked, checkedlen + 1 + restlen );
+		arena_str(
+		    ar, &checked, &maxchecked, checkedlen + 1 + restlen );
 		if ( checkedlen > 0 && checked[checkedlen-1] != '/' )
 		    checked[checkedlen++] = '/';
 		(void) strcpy( &checked[checkedlen], r );
@@ -1923,7 +2455,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 	if ( restlen != 0 )
 	    {
 	    (void) ol_strcpy( rest, r );
-	    httpd_realloc_str( &rest, &maxrest, restlen + linklen + 1 );
+	    arena_str( ar, &rest, &maxrest, restlen + linklen + 1 );
 	    for ( i = restlen; i >= 0; --i )
 		rest[i + linklen + 1] = rest[i];
 	    (void) strcpy( rest, lnk );
@@ -1936,7 +2468,7 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 	    /* There's nothing left in the filename, so the link contents
 	    ** becomes the rest.
 	    */
-	    httpd_realloc_str( &rest, &maxrest, linklen );
+	    arena_str( ar, &rest, &maxrest, linklen );
 	    (void) strcpy( rest, lnk );
 	    restlen = linklen;
 	    r = rest;
@@ -1965,7 +2497,9 @@ expand_symlinks( char* path, char** restP, int no_symlink_check, int tildemapped
 
 
 int
-httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
+httpd_get_conn(
+    httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp,
+    struct timeval* nowP )
     {
     httpd_sockaddr sa;
     socklen_t sz;
@@ -1981,35 +2515,27 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 	{
 	hc->read_size = 0;
 	httpd_realloc_str( &hc->read_buf, &hc->read_size, 500 );
-	hc->maxdecodedurl =
-	    hc->maxorigfilename = hc->maxexpnfilename = hc->maxencodings =
-	    hc->maxpathinfo = hc->maxquery = hc->maxaccept =
-	    hc->maxaccepte = hc->maxreqhost = hc->maxhostdir =
-	    hc->maxremoteuser = hc->maxresponse = 0;
-#ifdef TILDE_MAP_2
-	hc->maxaltdir = 0;
-#endif /* TILDE_MAP_2 */
-	httpd_realloc_str( &hc->decodedurl, &hc->maxdecodedurl, 1 );
-	httpd_realloc_str( &hc->origfilename, &hc->maxorigfilename, 1 );
-	httpd_realloc_str( &hc->expnfilename, &hc->maxexpnfilename, 0 );
-	httpd_realloc_str( &hc->encodings, &hc->maxencodings, 0 );
-	httpd_realloc_str( &hc->pathinfo, &hc->maxpathinfo, 0 );
-	httpd_realloc_str( &hc->query, &hc->maxquery, 0 );
-	httpd_realloc_str( &hc->accept, &hc->maxaccept, 0 );
-	httpd_realloc_str( &hc->accepte, &hc->maxaccepte, 0 );
-	httpd_realloc_str( &hc->reqhost, &hc->maxreqhost, 0 );
-	httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, 0 );
-	httpd_realloc_str( &hc->remoteuser, &hc->maxremoteuser, 0 );
-	httpd_realloc_str( &hc->response, &hc->maxresponse, 0 );
-#ifdef TILDE_MAP_2
-	httpd_realloc_str( &hc->altdir, &hc->maxaltdir, 0 );
-#endif /* TILDE_MAP_2 */
+	hc->maxcgi_wbuf = hc->maxcgi_headers = 0;
+	httpd_realloc_str( &hc->cgi_wbuf, &hc->maxcgi_wbuf, 0 );
+	httpd_realloc_str( &hc->cgi_headers, &hc->maxcgi_headers, 0 );
+	arena_init( &hc->arena, CONN_ARENA_SIZE );
+	hc->cgi_state = CGIS_NONE;
+	hc->cgi_rfd = hc->cgi_wfd = -1;
+	hc->cgi_app = -1;
 	hc->initialized = 1;
 	}
 
-    /* Accept the new connection. */
+    /* Accept the new connection.  Where accept4() is available the new
+    ** socket comes back non-blocking and close-on-exec, saving three
+    ** fcntl() calls.
+    */
     sz = sizeof(sa);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    hc->conn_fd = accept4(
+	listen_fd, &sa.sa, &sz, SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else /* SOCK_NONBLOCK && SOCK_CLOEXEC */
     hc->conn_fd = accept( listen_fd, &sa.sa, &sz );
+#endif /* SOCK_NONBLOCK && SOCK_CLOEXEC */
     if ( hc->conn_fd < 0 )
 	{
 	if ( errno == EWOULDBLOCK )
@@ -2028,10 +2554,42 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 	hc->conn_fd = -1;
 	return GC_FAIL;
 	}
+
+    /* Turn the client away right now if it's over its limits. */
+    if ( ! clientlimit_admit( &sa, nowP ) )
+	{
+	close( hc->conn_fd );
+	hc->conn_fd = -1;
+	return GC_REFUSED;
+	}
+#if ! ( defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC) )
     (void) fcntl( hc->conn_fd, F_SETFD, 1 );
+    httpd_set_ndelay( hc->conn_fd );
+#endif /* ! ( SOCK_NONBLOCK && SOCK_CLOEXEC ) */
     hc->hs = hs;
     (void) memset( &hc->client_addr, 0, sizeof(hc->client_addr) );
     (void) memmove( &hc->client_addr, &sa, sockaddr_len( &sa ) );
+
+    /* The previous connection's strings all go back to the arena at
+    ** once, and this one's start out fresh.
+    */
+    arena_reset( &hc->arena );
+    hc->maxorigfilename = hc->maxexpnfilename = hc->maxencodings =
+	hc->maxpathinfo = hc->maxacceptbuf = hc->maxacceptebuf =
+	hc->maxhostdir = hc->maxremoteuser = hc->maxresponse = 0;
+    arena_str( &hc->arena, &hc->origfilename, &hc->maxorigfilename, 1 );
+    arena_str( &hc->arena, &hc->expnfilename, &hc->maxexpnfilename, 0 );
+    arena_str( &hc->arena, &hc->encodings, &hc->maxencodings, 0 );
+    arena_str( &hc->arena, &hc->pathinfo, &hc->maxpathinfo, 0 );
+    arena_str( &hc->arena, &hc->acceptbuf, &hc->maxacceptbuf, 0 );
+    arena_str( &hc->arena, &hc->acceptebuf, &hc->maxacceptebuf, 0 );
+    arena_str( &hc->arena, &hc->hostdir, &hc->maxhostdir, 0 );
+    arena_str( &hc->arena, &hc->remoteuser, &hc->maxremoteuser, 0 );
+    arena_str( &hc->arena, &hc->response, &hc->maxresponse, 0 );
+#ifdef TILDE_MAP_2
+    hc->maxaltdir = 0;
+    arena_str( &hc->arena, &hc->altdir, &hc->maxaltdir, 0 );
+#endif /* TILDE_MAP_2 */
     hc->read_idx = 0;
     hc->checked_idx = 0;
     hc->checked_state = CHST_FIRSTWORD;
@@ -2040,21 +2598,20 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
     hc->bytes_to_send = 0;
     hc->bytes_sent = 0;
     hc->encodedurl = "";
-    hc->decodedurl[0] = '\0';
     hc->protocol = "UNKNOWN";
     hc->origfilename[0] = '\0';
     hc->expnfilename[0] = '\0';
     hc->encodings[0] = '\0';
     hc->pathinfo[0] = '\0';
-    hc->query[0] = '\0';
+    hc->query = "";
     hc->referrer = "";
     hc->useragent = "";
-    hc->accept[0] = '\0';
-    hc->accepte[0] = '\0';
+    hc->accept = "";
+    hc->accepte = "";
     hc->acceptl = "";
     hc->cookie = "";
     hc->contenttype = "";
-    hc->reqhost[0] = '\0';
+    hc->reqhost = "";
     hc->hdrhost = "";
     hc->hostdir[0] = '\0';
     hc->authorization = "";
@@ -2078,6 +2635,8 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
     hc->keep_alive = 0;
     hc->should_linger = 0;
     hc->file_address = (char*) 0;
+    hc->file_fd = -1;
+    hc->cgi_fill = hc->cgi_hit = (void*) 0;
 #ifdef USE_SCTP
     hc->is_sctp = is_sctp;
     if ( is_sctp )
@@ -2086,6 +2645,7 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 	if ( getsockopt( hc->conn_fd, IPPROTO_SCTP, SCTP_STATUS, &status, &sz) < 0 )
 	    {
 	    syslog( LOG_CRIT, "getsockopt SCTP_STATUS - %m" );
+	    clientlimit_release( &sa );
 	    close( hc->conn_fd );
 	    hc->conn_fd = -1;
 	    return GC_FAIL;
@@ -2096,6 +2656,7 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 	if ( getsockopt( hc->conn_fd, SOL_SOCKET, SO_SNDBUF, &sb_size, &sz) < 0 )
 	    {
 	    syslog( LOG_CRIT, "getsockopt SO_SNDBUF - %m" );
+	    clientlimit_release( &sa );
 	    close( hc->conn_fd );
 	    hc->conn_fd = -1;
 	    return GC_FAIL;
@@ -2113,6 +2674,7 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 	    if ( setsockopt( hc->conn_fd, IPPROTO_SCTP, SCTP_EXPLICIT_EOR, &on, sz ) < 0 )
 		{
 		syslog( LOG_CRIT, "getsockopt SCTP_EXPLICIT_EOR - %m" );
+		clientlimit_release( &sa );
 		close( hc->conn_fd );
 		hc->conn_fd = -1;
 		return GC_FAIL;
@@ -2133,6 +2695,113 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
     }
 
 
+/* The response for connections turned away by httpd_shed_conn().  It
+** only gets rebuilt when the Date changes.
+*/
+static char shed_buf[1000];
+static int shed_len = 0;
+static time_t shed_date = (time_t) 0;
+
+static char* shed_body = "\
+<html><head><title>503 Service Temporarily Overloaded</title></head>\n\
+<body><h2>503 Service Temporarily Overloaded</h2>\n\
+The server is temporarily overloaded.  Please try again later.\n\
+</body></html>\n";
+
+
+int
+httpd_shed_conn( int listen_fd, int retry_after )
+    {
+    httpd_sockaddr sa;
+    socklen_t sz;
+    int fd;
+    time_t now;
+    const char* rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
+    char nowbuf[100];
+    char junk[2048];
+
+    sz = sizeof(sa);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    fd = accept4( listen_fd, &sa.sa, &sz, SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else /* SOCK_NONBLOCK && SOCK_CLOEXEC */
+    fd = accept( listen_fd, &sa.sa, &sz );
+#endif /* SOCK_NONBLOCK && SOCK_CLOEXEC */
+    if ( fd < 0 )
+	{
+	if ( errno == EWOULDBLOCK )
+	    return GC_NO_MORE;
+	if ( errno != ECONNABORTED )
+	    syslog( LOG_ERR, "accept - %m" );
+	return GC_FAIL;
+	}
+#if ! ( defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC) )
+    httpd_set_ndelay( fd );
+#endif /* ! ( SOCK_NONBLOCK && SOCK_CLOEXEC ) */
+
+    now = time( (time_t*) 0 );
+    if ( now != shed_date )
+	{
+	(void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
+	shed_len = my_snprintf( shed_buf, sizeof(shed_buf),
+	    "HTTP/1.0 503 %s\015\012Server: %s\015\012Content-Type: text/html\015\012Date: %s\015\012Retry-After: %d\015\012Cache-Control: no-cache,no-store\015\012Content-Length: %d\015\012Connection: close\015\012\015\012%s",
+	    httpd_err503title, EXPOSED_SERVER_SOFTWARE, nowbuf, retry_after,
+	    (int) strlen( shed_body ), shed_body );
+	if ( shed_len < 0 || shed_len >= (int) sizeof(shed_buf) )
+	    shed_len = strlen( shed_buf );
+	shed_date = now;
+	}
+
+    /* Soak up whatever request has already arrived, so the close doesn't
+    ** turn into a reset that throws away the response.  Anything still
+    ** in flight just gets dropped.
+    */
+    (void) read( fd, junk, sizeof(junk) );
+    (void) write( fd, shed_buf, shed_len );
+    (void) close( fd );
+    return GC_OK;
+    }
+
+
+/* Returns the offset of the first CR or LF in buf, or of the first space
+** or tab too if ws is set, or len if there isn't one.  With SSE2 this
+** looks at sixteen bytes at a time.
+*/
+static size_t
+request_scan( const char* buf, size_t len, int ws )
+    {
+    size_t i = 0;
+    char c;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8( '\015' );
+    const __m128i lf = _mm_set1_epi8( '\012' );
+    const __m128i sp = _mm_set1_epi8( ' ' );
+    const __m128i tab = _mm_set1_epi8( '\t' );
+    __m128i v, m;
+    int mask;
+
+    for ( ; i + 16 <= len; i += 16 )
+	{
+	v = _mm_loadu_si128( (const __m128i*) &buf[i] );
+	m = _mm_or_si128( _mm_cmpeq_epi8( v, cr ), _mm_cmpeq_epi8( v, lf ) );
+	if ( ws )
+	    m = _mm_or_si128(
+		m,
+		_mm_or_si128( _mm_cmpeq_epi8( v, sp ), _mm_cmpeq_epi8( v, tab ) ) );
+	mask = _mm_movemask_epi8( m );
+	if ( mask != 0 )
+	    return i + ffs( mask ) - 1;
+	}
+#endif /* __SSE2__ */
+    for ( ; i < len; ++i )
+	{
+	c = buf[i];
+	if ( c == '\012' || c == '\015' || ( ws && ( c == ' ' || c == '\t' ) ) )
+	    break;
+	}
+    return i;
+    }
+
+
 /* Checks hc->read_buf to see whether a complete request has been read so far;
 ** either the first line has two words (an HTTP/0.9 request), or the first
 ** line has three words and there's a blank line present.
@@ -2140,6 +2809,10 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp )
 ** hc->read_idx is how much has been read in; hc->checked_idx is how much we
 ** have checked so far; and hc->checked_state is the current state of the
 ** finite state machine.
+**
+** Within a header line or a word of the request line only a few bytes can
+** change the state, so request_scan() skips straight to the next of those
+** and the state machine just handles the boundaries.
 */
 int
 httpd_got_request( httpd_conn* hc )
@@ -2148,6 +2821,23 @@ httpd_got_request( httpd_conn* hc )
 
     for ( ; hc->checked_idx < hc->read_idx; ++hc->checked_idx )
 	{
+	switch ( hc->checked_state )
+	    {
+	    case CHST_LINE:
+	    hc->checked_idx += request_scan(
+		&hc->read_buf[hc->checked_idx],
+		hc->read_idx - hc->checked_idx, 0 );
+	    break;
+	    case CHST_FIRSTWORD:
+	    case CHST_SECONDWORD:
+	    case CHST_THIRDWORD:
+	    hc->checked_idx += request_scan(
+		&hc->read_buf[hc->checked_idx],
+		hc->read_idx - hc->checked_idx, 1 );
+	    break;
+	    }
+	if ( hc->checked_idx >= hc->read_idx )
+	    break;
 	c = hc->read_buf[hc->checked_idx];
 	switch ( hc->checked_state )
 	    {
@@ -2301,6 +2991,160 @@ httpd_got_request( httpd_conn* hc )
     }
 
 
+/* Append a repeated header's value to the earlier ones, comma-separated.
+** The first value stays where it is in read_buf; only repeats need the
+** buffer.
+*/
+static void
+merge_header(
+    Arena* ar, char** valP, char** bufP, size_t* maxbufP, char* cp )
+    {
+    int merged = ( *valP == *bufP );
+
+    arena_str(
+	ar, bufP, maxbufP, strlen( *valP ) + 2 + strlen( cp ) );
+    if ( ! merged )
+	(void) strcpy( *bufP, *valP );
+    (void) strcat( *bufP, ", " );
+    (void) strcat( *bufP, cp );
+    *valP = *bufP;
+    }
+
+
+/* Request headers, as identified by header_id(). */
+#define HDR_UNKNOWN 0
+#define HDR_IGNORED 1	/* known, but we don't use it */
+#define HDR_REFERER 2
+#define HDR_USER_AGENT 3
+#define HDR_HOST 4
+#define HDR_ACCEPT 5
+#define HDR_ACCEPT_ENCODING 6
+#define HDR_ACCEPT_LANGUAGE 7
+#define HDR_IF_MODIFIED_SINCE 8
+#define HDR_COOKIE 9
+#define HDR_RANGE 10
+#define HDR_RANGE_IF 11
+#define HDR_CONTENT_TYPE 12
+#define HDR_CONTENT_LENGTH 13
+#define HDR_AUTHORIZATION 14
+#define HDR_CONNECTION 15
+
+/* Identify a header by its name, which is not nul-terminated.  The name
+** gets lowercased once and then dispatched on its length, so each header
+** line costs a memcmp() or two instead of a strncasecmp() per known
+** header.
+*/
+static int
+header_id( char* name, size_t len )
+    {
+    char n[20];
+    size_t i;
+
+#define IS(str) ( memcmp( n, str, len ) == 0 )
+    if ( len >= 2 && ( name[0] == 'X' || name[0] == 'x' ) && name[1] == '-' )
+	return HDR_IGNORED;
+    if ( len > sizeof(n) )
+	return HDR_UNKNOWN;
+    for ( i = 0; i < len; ++i )
+	n[i] = isupper( name[i] ) ? tolower( name[i] ) : name[i];
+    switch ( len )
+	{
+	case 3:
+	if ( IS( "via" ) )
+	    return HDR_IGNORED;
+	break;
+	case 4:
+	if ( IS( "host" ) )
+	    return HDR_HOST;
+	if ( IS( "date" ) || IS( "from" ) || IS( "user" ) )
+	    return HDR_IGNORED;
+	break;
+	case 5:
+	if ( IS( "range" ) )
+	    return HDR_RANGE;
+	if ( IS( "agent" ) || IS( "ua-os" ) )
+	    return HDR_IGNORED;
+	break;
+	case 6:
+	if ( IS( "accept" ) )
+	    return HDR_ACCEPT;
+	if ( IS( "cookie" ) )
+	    return HDR_COOKIE;
+	if ( IS( "pragma" ) || IS( "ua-cpu" ) )
+	    return HDR_IGNORED;
+	break;
+	case 7:
+	if ( IS( "referer" ) )
+	    return HDR_REFERER;
+	if ( IS( "ua-disp" ) )
+	    return HDR_IGNORED;
+	break;
+	case 8:
+	if ( IS( "referrer" ) )
+	    return HDR_REFERER;
+	if ( IS( "if-range" ) || IS( "range-if" ) )
+	    return HDR_RANGE_IF;
+	if ( IS( "ua-color" ) )
+	    return HDR_IGNORED;
+	break;
+	case 9:
+	if ( IS( "forwarded" ) || IS( "charge-to" ) || IS( "client-ip" ) ||
+	     IS( "extension" ) || IS( "negotiate" ) || IS( "ua-pixels" ) )
+	    return HDR_IGNORED;
+	break;
+	case 10:
+	if ( IS( "user-agent" ) )
+	    return HDR_USER_AGENT;
+	if ( IS( "connection" ) )
+	    return HDR_CONNECTION;
+	if ( IS( "cache-info" ) || IS( "message-id" ) || IS( "session-id" ) )
+	    return HDR_IGNORED;
+	break;
+	case 11:
+	if ( IS( "proxy-agent" ) )
+	    return HDR_IGNORED;
+	break;
+	case 12:
+	if ( IS( "content-type" ) )
+	    return HDR_CONTENT_TYPE;
+	if ( IS( "http-version" ) || IS( "max-forwards" ) ||
+	     IS( "mime-version" ) )
+	    return HDR_IGNORED;
+	break;
+	case 13:
+	if ( IS( "authorization" ) )
+	    return HDR_AUTHORIZATION;
+	if ( IS( "cache-control" ) )
+	    return HDR_IGNORED;
+	break;
+	case 14:
+	if ( IS( "content-length" ) )
+	    return HDR_CONTENT_LENGTH;
+	if ( IS( "accept-charset" ) )
+	    return HDR_IGNORED;
+	break;
+	case 15:
+	if ( IS( "accept-encoding" ) )
+	    return HDR_ACCEPT_ENCODING;
+	if ( IS( "accept-language" ) )
+	    return HDR_ACCEPT_LANGUAGE;
+	if ( IS( "security-scheme" ) )
+	    return HDR_IGNORED;
+	break;
+	case 16:
+	if ( IS( "proxy-connection" ) )
+	    return HDR_IGNORED;
+	break;
+	case 17:
+	if ( IS( "if-modified-since" ) )
+	    return HDR_IF_MODIFIED_SINCE;
+	break;
+	}
+    return HDR_UNKNOWN;
+#undef IS
+    }
+
+
 int
 httpd_parse_request( httpd_conn* hc )
     {
@@ -2312,6 +3156,8 @@ httpd_parse_request( httpd_conn* hc )
     char* eol;
     char* cp;
     char* pi;
+    char* value;
+    int hdr;
 
     hc->checked_idx = 0;	/* reset */
     method_str = bufgets( hc );
@@ -2359,15 +3205,17 @@ httpd_parse_request( httpd_conn* hc )
 	    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 	    return -1;
 	    }
-	*url = '\0';
-	if ( strchr( reqhost, '/' ) != (char*) 0 || reqhost[0] == '.' )
+	if ( reqhost[0] == '.' )
 	    {
 	    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 	    return -1;
 	    }
-	httpd_realloc_str( &hc->reqhost, &hc->maxreqhost, strlen( reqhost ) );
-	(void) strcpy( hc->reqhost, reqhost );
-	*url = '/';
+	/* Slide the host back over the second slash of "http://", to make
+	** room for a terminating nul without touching the path.
+	*/
+	(void) memmove( reqhost - 1, reqhost, url - reqhost );
+	hc->reqhost = reqhost - 1;
+	url[-1] = '\0';
 	}
 
     if ( *url != '/' )
@@ -2389,13 +3237,11 @@ httpd_parse_request( httpd_conn* hc )
 	}
 
     hc->encodedurl = url;
-    httpd_realloc_str(
-	&hc->decodedurl, &hc->maxdecodedurl, strlen( hc->encodedurl ) );
-    strdecode( hc->decodedurl, hc->encodedurl );
-
-    httpd_realloc_str(
-	&hc->origfilename, &hc->maxorigfilename, strlen( hc->decodedurl ) );
-    (void) strcpy( hc->origfilename, &hc->decodedurl[1] );
+    /* Decode straight into the filename, skipping the leading slash. */
+    arena_str(
+	&hc->arena, &hc->origfilename, &hc->maxorigfilename,
+	strlen( hc->encodedurl ) );
+    strdecode( hc->origfilename, &hc->encodedurl[1] );
     /* Special case for top-level URL. */
     if ( hc->origfilename[0] == '\0' )
 	(void) strcpy( hc->origfilename, "." );
@@ -2404,9 +3250,8 @@ httpd_parse_request( httpd_conn* hc )
     cp = strchr( hc->encodedurl, '?' );
     if ( cp != (char*) 0 )
 	{
-	++cp;
-	httpd_realloc_str( &hc->query, &hc->maxquery, strlen( cp ) );
-	(void) strcpy( hc->query, cp );
+	/* It's the tail of the URL, so it can stay in read_buf. */
+	hc->query = cp + 1;
 	/* Remove query from (decoded) origfilename. */
 	cp = strchr( hc->origfilename, '?' );
 	if ( cp != (char*) 0 )
@@ -2429,27 +3274,26 @@ httpd_parse_request( httpd_conn* hc )
 	    {
 	    if ( buf[0] == '\0' )
 		break;
-	    if ( strncasecmp( buf, "Referer:", 8 ) == 0 )
-		{
-		cp = &buf[8];
-		cp += strspn( cp, " \t" );
-		hc->referrer = cp;
-		}
-	    else if ( strncasecmp( buf, "Referrer:", 9 ) == 0 )
+	    /* Find the header name and dispatch on it. */
+	    value = strchr( buf, ':' );
+	    if ( value == (char*) 0 )
+		hdr = HDR_UNKNOWN;
+	    else
+		hdr = header_id( buf, value - buf );
+	    switch ( hdr )
 		{
-		cp = &buf[9];
+		case HDR_REFERER:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->referrer = cp;
-		}
-	    else if ( strncasecmp( buf, "User-Agent:", 11 ) == 0 )
-		{
-		cp = &buf[11];
+		break;
+		case HDR_USER_AGENT:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->useragent = cp;
-		}
-	    else if ( strncasecmp( buf, "Host:", 5 ) == 0 )
-		{
-		cp = &buf[5];
+		break;
+		case HDR_HOST:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->hdrhost = cp;
 		cp = strrchr( hc->hdrhost, ':' );
@@ -2460,10 +3304,9 @@ httpd_parse_request( httpd_conn* hc )
 		    httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
 		    return -1;
 		    }
-		}
-	    else if ( strncasecmp( buf, "Accept:", 7 ) == 0 )
-		{
-		cp = &buf[7];
+		break;
+		case HDR_ACCEPT:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		if ( hc->accept[0] != '\0' )
 		    {
@@ -2474,19 +3317,14 @@ httpd_parse_request( httpd_conn* hc )
 			    httpd_ntoa( &hc->client_addr ) );
 			continue;
 			}
-		    httpd_realloc_str(
-			&hc->accept, &hc->maxaccept,
-			strlen( hc->accept ) + 2 + strlen( cp ) );
-		    (void) strcat( hc->accept, ", " );
+		    merge_header(
+			&hc->arena, &hc->accept, &hc->acceptbuf, &hc->maxacceptbuf, cp );
 		    }
 		else
-		    httpd_realloc_str(
-			&hc->accept, &hc->maxaccept, strlen( cp ) );
-		(void) strcat( hc->accept, cp );
-		}
-	    else if ( strncasecmp( buf, "Accept-Encoding:", 16 ) == 0 )
-		{
-		cp = &buf[16];
+		    hc->accept = cp;
+		break;
+		case HDR_ACCEPT_ENCODING:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		if ( hc->accepte[0] != '\0' )
 		    {
@@ -2497,37 +3335,30 @@ httpd_parse_request( httpd_conn* hc )
 			    httpd_ntoa( &hc->client_addr ) );
 			continue;
 			}
-		    httpd_realloc_str(
-			&hc->accepte, &hc->maxaccepte,
-			strlen( hc->accepte ) + 2 + strlen( cp ) );
-		    (void) strcat( hc->accepte, ", " );
+		    merge_header(
+			&hc->arena, &hc->accepte, &hc->acceptebuf,
+			&hc->maxacceptebuf, cp );
 		    }
 		else
-		    httpd_realloc_str(
-			&hc->accepte, &hc->maxaccepte, strlen( cp ) );
-		(void) strcpy( hc->accepte, cp );
-		}
-	    else if ( strncasecmp( buf, "Accept-Language:", 16 ) == 0 )
-		{
-		cp = &buf[16];
+		    hc->accepte = cp;
+		break;
+		case HDR_ACCEPT_LANGUAGE:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->acceptl = cp;
-		}
-	    else if ( strncasecmp( buf, "If-Modified-Since:", 18 ) == 0 )
-		{
-		cp = &buf[18];
+		break;
+		case HDR_IF_MODIFIED_SINCE:
+		cp = value + 1;
 		hc->if_modified_since = tdate_parse( cp );
 		if ( hc->if_modified_since == (time_t) -1 )
 		    syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-		}
-	    else if ( strncasecmp( buf, "Cookie:", 7 ) == 0 )
-		{
-		cp = &buf[7];
+		break;
+		case HDR_COOKIE:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->cookie = cp;
-		}
-	    else if ( strncasecmp( buf, "Range:", 6 ) == 0 )
-		{
+		break;
+		case HDR_RANGE:
 		/* Only support %d- and %d-%d, not %d-%d,%d-%d or -%d. */
 		if ( strchr( buf, ',' ) == (char*) 0 )
 		    {
@@ -2552,73 +3383,41 @@ httpd_parse_request( httpd_conn* hc )
 			    }
 			}
 		    }
-		}
-	    else if ( strncasecmp( buf, "Range-If:", 9 ) == 0 ||
-		      strncasecmp( buf, "If-Range:", 9 ) == 0 )
-		{
-		cp = &buf[9];
+		break;
+		case HDR_RANGE_IF:
+		cp = value + 1;
 		hc->range_if = tdate_parse( cp );
 		if ( hc->range_if == (time_t) -1 )
 		    syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
-		}
-	    else if ( strncasecmp( buf, "Content-Type:", 13 ) == 0 )
-		{
-		cp = &buf[13];
+		break;
+		case HDR_CONTENT_TYPE:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->contenttype = cp;
-		}
-	    else if ( strncasecmp( buf, "Content-Length:", 15 ) == 0 )
-		{
-		cp = &buf[15];
+		break;
+		case HDR_CONTENT_LENGTH:
+		cp = value + 1;
 		hc->contentlength = atol( cp );
-		}
-	    else if ( strncasecmp( buf, "Authorization:", 14 ) == 0 )
-		{
-		cp = &buf[14];
+		break;
+		case HDR_AUTHORIZATION:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		hc->authorization = cp;
-		}
-	    else if ( strncasecmp( buf, "Connection:", 11 ) == 0 )
-		{
-		cp = &buf[11];
+		break;
+		case HDR_CONNECTION:
+		cp = value + 1;
 		cp += strspn( cp, " \t" );
 		if ( strcasecmp( cp, "keep-alive" ) == 0 )
 		    hc->keep_alive = 1;
-		}
+		break;
 #ifdef LOG_UNKNOWN_HEADERS
-	    else if ( strncasecmp( buf, "Accept-Charset:", 15 ) == 0 ||
-		      strncasecmp( buf, "Accept-Language:", 16 ) == 0 ||
-		      strncasecmp( buf, "Agent:", 6 ) == 0 ||
-		      strncasecmp( buf, "Cache-Control:", 14 ) == 0 ||
-		      strncasecmp( buf, "Cache-Info:", 11 ) == 0 ||
-		      strncasecmp( buf, "Charge-To:", 10 ) == 0 ||
-		      strncasecmp( buf, "Client-IP:", 10 ) == 0 ||
-		      strncasecmp( buf, "Date:", 5 ) == 0 ||
-		      strncasecmp( buf, "Extension:", 10 ) == 0 ||
-		      strncasecmp( buf, "Forwarded:", 10 ) == 0 ||
-		      strncasecmp( buf, "From:", 5 ) == 0 ||
-		      strncasecmp( buf, "HTTP-Version:", 13 ) == 0 ||
-		      strncasecmp( buf, "Max-Forwards:", 13 ) == 0 ||
-		      strncasecmp( buf, "Message-Id:", 11 ) == 0 ||
-		      strncasecmp( buf, "MIME-Version:", 13 ) == 0 ||
-		      strncasecmp( buf, "Negotiate:", 10 ) == 0 ||
-		      strncasecmp( buf, "Pragma:", 7 ) == 0 ||
-		      strncasecmp( buf, "Proxy-Agent:", 12 ) == 0 ||
-		      strncasecmp( buf, "Proxy-Connection:", 17 ) == 0 ||
-		      strncasecmp( buf, "Security-Scheme:", 16 ) == 0 ||
-		      strncasecmp( buf, "Session-Id:", 11 ) == 0 ||
-		      strncasecmp( buf, "UA-Color:", 9 ) == 0 ||
-		      strncasecmp( buf, "UA-CPU:", 7 ) == 0 ||
-		      strncasecmp( buf, "UA-Disp:", 8 ) == 0 ||
-		      strncasecmp( buf, "UA-OS:", 6 ) == 0 ||
-		      strncasecmp( buf, "UA-Pixels:", 10 ) == 0 ||
-		      strncasecmp( buf, "User:", 5 ) == 0 ||
-		      strncasecmp( buf, "Via:", 4 ) == 0 ||
-		      strncasecmp( buf, "X-", 2 ) == 0 )
-		; /* ignore */
-	    else
+		case HDR_IGNORED:
+		break;
+		default:
 		syslog( LOG_DEBUG, "unknown request header: %.80s", buf );
+		break;
 #endif /* LOG_UNKNOWN_HEADERS */
+		}
 	    }
 	}
 
@@ -2646,8 +3445,9 @@ httpd_parse_request( httpd_conn* hc )
     */
 
     /* Copy original filename to expanded filename. */
-    httpd_realloc_str(
-	&hc->expnfilename, &hc->maxexpnfilename, strlen( hc->origfilename ) );
+    arena_str(
+	&hc->arena, &hc->expnfilename, &hc->maxexpnfilename,
+	strlen( hc->origfilename ) );
     (void) strcpy( hc->expnfilename, hc->origfilename );
 
     /* Tilde mapping. */
@@ -2671,24 +3471,39 @@ httpd_parse_request( httpd_conn* hc )
 
     /* Virtual host mapping. */
     if ( hc->hs->vhost )
-	if ( ! vhost_map( hc ) )
+	switch ( vhost_map( hc ) )
 	    {
+	    case 0:
 	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 	    return -1;
+	    case -1:
+	    httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
+	    return -1;
 	    }
 
+    /* Most requests name a plain file with no symlinks along the way.
+    ** If the kernel can open it for us without leaving the web tree,
+    ** there's nothing to expand and no pathinfo.
+    */
+    if ( open_beneath( hc, hc->expnfilename ) == 1 )
+	{
+	hc->pathinfo[0] = '\0';
+	return 0;
+	}
+
     /* Expand all symbolic links in the filename.  This also gives us
     ** any trailing non-existing components, for pathinfo.
     */
-    cp = expand_symlinks( hc->expnfilename, &pi, hc->hs->no_symlink_check, hc->tildemapped );
+    cp = expand_symlinks( &hc->arena, hc->expnfilename, &pi, hc->hs->no_symlink_check, hc->tildemapped );
     if ( cp == (char*) 0 )
 	{
 	httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 	return -1;
 	}
-    httpd_realloc_str( &hc->expnfilename, &hc->maxexpnfilename, strlen( cp ) );
+    arena_str(
+	&hc->arena, &hc->expnfilename, &hc->maxexpnfilename, strlen( cp ) );
     (void) strcpy( hc->expnfilename, cp );
-    httpd_realloc_str( &hc->pathinfo, &hc->maxpathinfo, strlen( pi ) );
+    arena_str( &hc->arena, &hc->pathinfo, &hc->maxpathinfo, strlen( pi ) );
     (void) strcpy( hc->pathinfo, pi );
 
     /* Remove pathinfo stuff from the original filename too. */
@@ -2738,6 +3553,76 @@ httpd_parse_request( httpd_conn* hc )
     }
 
 
+/* Tries to open a relative filename within the current directory in
+** a single system call, via openat2() with RESOLVE_BENEATH and
+** RESOLVE_NO_SYMLINKS.  On success the file is left open in hc->file_fd,
+** its status in hc->sb, and 1 is returned; the name is then known to be
+** exactly what expand_symlinks() would have come up with.  Returns 0 if
+** the file definitely doesn't exist, or -1 if the caller has to do it
+** the slow way - symlinks, absolute paths, no kernel support, etc.
+*/
+static int
+open_beneath( httpd_conn* hc, char* path )
+    {
+#ifdef HAVE_OPENAT2
+    static int unsupported = 0;
+    struct open_how how;
+    size_t len;
+    int fd;
+
+    if ( unsupported || hc->tildemapped )
+	return -1;
+
+    /* Only take names that are already in canonical form. */
+    len = strlen( path );
+    if ( len == 0 || path[0] == '/' || path[len - 1] == '/' ||
+	 strstr( path, "//" ) != (char*) 0 )
+	return -1;
+    if ( ( path[0] == '.' && ( path[1] == '/' || path[1] == '.' ) ) ||
+	 strstr( path, "/./" ) != (char*) 0 ||
+	 strstr( path, "/../" ) != (char*) 0 ||
+	 ( len >= 2 && strcmp( &path[len - 2], "/." ) == 0 ) ||
+	 ( len >= 3 && strcmp( &path[len - 3], "/.." ) == 0 ) )
+	return -1;
+
+    (void) memset( (char*) &how, 0, sizeof(how) );
+    how.flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+    fd = syscall( SYS_openat2, AT_FDCWD, path, &how, sizeof(how) );
+    if ( fd < 0 )
+	{
+	if ( errno == ENOSYS )
+	    unsupported = 1;
+	/* With no symlinks in the way, a missing component is final. */
+	if ( errno == ENOENT )
+	    return 0;
+	return -1;
+	}
+    if ( fstat( fd, &hc->sb ) < 0 )
+	{
+	(void) close( fd );
+	return -1;
+	}
+    close_file( hc );
+    hc->file_fd = fd;
+    return 1;
+#else /* HAVE_OPENAT2 */
+    return -1;
+#endif /* HAVE_OPENAT2 */
+    }
+
+
+static void
+close_file( httpd_conn* hc )
+    {
+    if ( hc->file_fd >= 0 )
+	{
+	(void) close( hc->file_fd );
+	hc->file_fd = -1;
+	}
+    }
+
+
 static char*
 bufgets( httpd_conn* hc )
     {
@@ -2815,17 +3700,28 @@ void
 httpd_close_conn( httpd_conn* hc, struct timeval* nowP )
     {
     make_log_entry( hc, nowP );
+    vhost_account( hc );
 
-    if ( hc->file_address != (char*) 0 )
+    httpd_cgi_close( hc );
+    if ( hc->cgi_hit != (void*) 0 )
+	{
+	/* The file address was a cached CGI response. */
+	cgicache_release( hc->cgi_hit );
+	hc->cgi_hit = (void*) 0;
+	hc->file_address = (char*) 0;
+	}
+    else if ( hc->file_address != (char*) 0 )
 	{
 	mmc_unmap( hc->file_address, &(hc->sb), nowP );
 	hc->file_address = (char*) 0;
 	}
+    close_file( hc );
     if ( hc->conn_fd >= 0 )
 	{
 	(void) close( hc->conn_fd );
 	hc->conn_fd = -1;
 	}
+    clientlimit_release( &hc->client_addr );
     }
 
 void
@@ -2834,21 +3730,9 @@ httpd_destroy_conn( httpd_conn* hc )
     if ( hc->initialized )
 	{
 	free( (void*) hc->read_buf );
-	free( (void*) hc->decodedurl );
-	free( (void*) hc->origfilename );
-	free( (void*) hc->expnfilename );
-	free( (void*) hc->encodings );
-	free( (void*) hc->pathinfo );
-	free( (void*) hc->query );
-	free( (void*) hc->accept );
-	free( (void*) hc->accepte );
-	free( (void*) hc->reqhost );
-	free( (void*) hc->hostdir );
-	free( (void*) hc->remoteuser );
-	free( (void*) hc->response );
-#ifdef TILDE_MAP_2
-	free( (void*) hc->altdir );
-#endif /* TILDE_MAP_2 */
+	free( (void*) hc->cgi_wbuf );
+	free( (void*) hc->cgi_headers );
+	arena_free( &hc->arena );
 	hc->initialized = 0;
 	}
     }
@@ -2869,39 +3753,267 @@ static struct mime_entry typ_tab[] = {
     };
 static const int n_typ_tab = sizeof(typ_tab) / sizeof(*typ_tab);
 
+/* Types loaded from a site file by httpd_load_mime_types(), which can
+** happen before or after init_mime().
+*/
+static struct mime_entry* site_typ_tab = (struct mime_entry*) 0;
+static int n_site_typ_tab = 0, max_site_typ_tab = 0;
 
-/* qsort comparison routine */
-static int
-ext_compare( const void* v1, const void* v2 )
+/* Each table gets a collision-free hash over its lowercased extensions,
+** so figure_mime() does one hash and one memcmp() per extension.  The
+** size and seed get searched for at startup, and again whenever a site
+** types file is loaded.  Values have the charset substituted already.
+*/
+#define MIME_MAX_EXT 64
+typedef struct {
+    struct mime_entry** slots;
+    unsigned int mask;
+    unsigned int seed;
+    } mime_hash;
+static mime_hash enc_hash, typ_hash;
+static char* mime_charset;
+
+
+static unsigned int
+mime_hash_ext( unsigned int seed, const char* ext, size_t len )
     {
-    const struct mime_entry* m1 = (const struct mime_entry*) v1;
-    const struct mime_entry* m2 = (const struct mime_entry*) v2;
+    unsigned int h = 2166136261U ^ seed;
 
-    return strcmp( m1->ext, m2->ext );
+    while ( len-- > 0 )
+	{
+	h ^= (unsigned char) *ext++;
+	h *= 16777619U;
+	}
+    return h;
     }
 
 
+/* Lowercase an entry's extension, substitute the charset into its value,
+** and fill in the lengths.
+*/
 static void
-init_mime( void )
+mime_fix_entry( struct mime_entry* me )
     {
-    int i;
+    char buf[500];
+    char* cp;
+
+    for ( cp = me->ext; *cp != '\0'; ++cp )
+	if ( isupper( *cp ) )
+	    break;
+    if ( *cp != '\0' )
+	{
+	me->ext = strdup( me->ext );
+	if ( me->ext == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory copying a MIME extension" );
+	    exit( 1 );
+	    }
+	for ( cp = me->ext; *cp != '\0'; ++cp )
+	    if ( isupper( *cp ) )
+		*cp = tolower( *cp );
+	}
+    me->ext_len = strlen( me->ext );
+    if ( strchr( me->val, '%' ) != (char*) 0 )
+	{
+	(void) my_snprintf( buf, sizeof(buf), me->val, mime_charset );
+	/* A value that still has a % in it gets formatted per response. */
+	if ( strchr( buf, '%' ) == (char*) 0 )
+	    {
+	    me->val = strdup( buf );
+	    if ( me->val == (char*) 0 )
+		{
+		syslog( LOG_CRIT, "out of memory copying a MIME type" );
+		exit( 1 );
+		}
+	    }
+	}
+    me->val_len = strlen( me->val );
+    }
+
+
+/* Find a size and seed that put every extension in its own slot.  When
+** an extension appears more than once, the first one wins.
+*/
+static void
+mime_hash_build( mime_hash* mh, struct mime_entry* tab1, int n1, struct mime_entry* tab2, int n2 )
+    {
+    unsigned int size, seed, h;
+    int i, ok;
+    struct mime_entry* me;
+
+    for ( size = 4; size < ( n1 + n2 ) * 2; size <<= 1 )
+	;
+    for ( ; ; size <<= 1 )
+	{
+	if ( mh->slots != (struct mime_entry**) 0 )
+	    free( (void*) mh->slots );
+	mh->slots = NEW( struct mime_entry*, size );
+	if ( mh->slots == (struct mime_entry**) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory allocating a MIME hash" );
+	    exit( 1 );
+	    }
+	mh->mask = size - 1;
+	for ( seed = 0; seed < 1000; ++seed )
+	    {
+	    for ( h = 0; h < size; ++h )
+		mh->slots[h] = (struct mime_entry*) 0;
+	    ok = 1;
+	    for ( i = 0; ok && i < n1 + n2; ++i )
+		{
+		me = i < n1 ? &tab1[i] : &tab2[i - n1];
+		h = mime_hash_ext( seed, me->ext, me->ext_len ) & mh->mask;
+		if ( mh->slots[h] == (struct mime_entry*) 0 )
+		    mh->slots[h] = me;
+		else if ( mh->slots[h]->ext_len != me->ext_len ||
+			  memcmp( mh->slots[h]->ext, me->ext, me->ext_len ) != 0 )
+		    ok = 0;
+		}
+	    if ( ok )
+		{
+		mh->seed = seed;
+		return;
+		}
+	    }
+	}
+    }
+
+
+static struct mime_entry*
+mime_lookup( mime_hash* mh, char* ext, size_t ext_len )
+    {
+    char lower[MIME_MAX_EXT];
+    struct mime_entry* me;
+    size_t i;
+
+    if ( ext_len > sizeof(lower) )
+	return (struct mime_entry*) 0;
+    for ( i = 0; i < ext_len; ++i )
+	lower[i] = isupper( ext[i] ) ? tolower( ext[i] ) : ext[i];
+    me = mh->slots[mime_hash_ext( mh->seed, lower, ext_len ) & mh->mask];
+    if ( me != (struct mime_entry*) 0 && me->ext_len == ext_len &&
+	 memcmp( me->ext, lower, ext_len ) == 0 )
+	return me;
+    return (struct mime_entry*) 0;
+    }
+
 
-    /* Sort the tables so we can do binary search. */
-    qsort( enc_tab, n_enc_tab, sizeof(*enc_tab), ext_compare );
-    qsort( typ_tab, n_typ_tab, sizeof(*typ_tab), ext_compare );
+static void
+init_mime( char* charset )
+    {
+    int i;
 
-    /* Fill in the lengths. */
+    mime_charset = charset;
     for ( i = 0; i < n_enc_tab; ++i )
+	mime_fix_entry( &enc_tab[i] );
+    for ( i = 0; i < n_typ_tab; ++i )
+	mime_fix_entry( &typ_tab[i] );
+    for ( i = 0; i < n_site_typ_tab; ++i )
+	mime_fix_entry( &site_typ_tab[i] );
+    mime_hash_build( &enc_hash, enc_tab, n_enc_tab, (struct mime_entry*) 0, 0 );
+    /* Site types go first, so they override the built-in ones. */
+    mime_hash_build(
+	&typ_hash, site_typ_tab, n_site_typ_tab, typ_tab, n_typ_tab );
+    }
+
+
+/* Site type values get used as printf formats, so they can't have any
+** conversions besides the one %s for the charset.
+*/
+static int
+mime_val_ok( char* val )
+    {
+    char* cp;
+    int n_s = 0;
+
+    for ( cp = strchr( val, '%' ); cp != (char*) 0; cp = strchr( cp, '%' ) )
 	{
-	enc_tab[i].ext_len = strlen( enc_tab[i].ext );
-	enc_tab[i].val_len = strlen( enc_tab[i].val );
+	++cp;
+	if ( *cp == 's' && n_s == 0 )
+	    ++n_s;
+	else if ( *cp != '%' )
+	    return 0;
+	++cp;
 	}
-    for ( i = 0; i < n_typ_tab; ++i )
+    return 1;
+    }
+
+
+int
+httpd_load_mime_types( char* filename )
+    {
+    FILE* fp;
+    char line[5000];
+    char ext[MIME_MAX_EXT + 1];
+    char val[1000];
+    char* cp;
+    int linenum;
+    struct mime_entry* me;
+
+    fp = fopen( filename, "r" );
+    if ( fp == (FILE*) 0 )
+	{
+	syslog( LOG_CRIT, "%.80s - %m", filename );
+	return -1;
+	}
+    linenum = 0;
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
 	{
-	typ_tab[i].ext_len = strlen( typ_tab[i].ext );
-	typ_tab[i].val_len = strlen( typ_tab[i].val );
+	++linenum;
+	/* Nuke comments. */
+	cp = strchr( line, '#' );
+	if ( cp != (char*) 0 )
+	    *cp = '\0';
+	if ( sscanf( line, "%64s %999[^\n]", ext, val ) != 2 )
+	    continue;
+	/* Nuke trailing whitespace. */
+	cp = &val[strlen( val ) - 1];
+	while ( cp > val && ( *cp == ' ' || *cp == '\t' || *cp == '\r' ) )
+	    *cp-- = '\0';
+	if ( ! mime_val_ok( val ) )
+	    {
+	    syslog(
+		LOG_ERR, "%.80s line %d: type '%.80s' has a %% other than one %%s, ignored",
+		filename, linenum, val );
+	    continue;
+	    }
+	if ( n_site_typ_tab >= max_site_typ_tab )
+	    {
+	    if ( max_site_typ_tab == 0 )
+		{
+		max_site_typ_tab = 100;
+		site_typ_tab = NEW( struct mime_entry, max_site_typ_tab );
+		}
+	    else
+		{
+		max_site_typ_tab *= 2;
+		site_typ_tab = RENEW( site_typ_tab, struct mime_entry, max_site_typ_tab );
+		}
+	    if ( site_typ_tab == (struct mime_entry*) 0 )
+		{
+		syslog( LOG_CRIT, "out of memory allocating site MIME types" );
+		exit( 1 );
+		}
+	    }
+	me = &site_typ_tab[n_site_typ_tab];
+	me->ext = strdup( ext );
+	me->val = strdup( val );
+	if ( me->ext == (char*) 0 || me->val == (char*) 0 )
+	    {
+	    syslog( LOG_CRIT, "out of memory copying a site MIME type" );
+	    exit( 1 );
+	    }
+	if ( mime_charset != (char*) 0 )
+	    mime_fix_entry( me );
+	++n_site_typ_tab;
 	}
+    (void) fclose( fp );
 
+    /* If init_mime() already ran, rebuild the type hash. */
+    if ( mime_charset != (char*) 0 )
+	mime_hash_build(
+	    &typ_hash, site_typ_tab, n_site_typ_tab, typ_tab, n_typ_tab );
+    return 0;
     }
 
 
@@ -2915,14 +4027,15 @@ figure_mime( httpd_conn* hc )
     char* prev_dot;
     char* dot;
     char* ext;
-    int me_indexes[100], n_me_indexes;
+    struct mime_entry* me;
+    struct mime_entry* mes[100];
+    int n_mes;
     size_t ext_len, encodings_len;
-    int i, top, bot, mid;
-    int r;
+    int i;
     char* default_type = "text/plain; charset=%s";
 
     /* Peel off encoding extensions until there aren't any more. */
-    n_me_indexes = 0;
+    n_mes = 0;
     for ( prev_dot = &hc->expnfilename[strlen(hc->expnfilename)]; ; prev_dot = dot )
 	{
 	for ( dot = prev_dot - 1; dot >= hc->expnfilename && *dot != '.'; --dot )
@@ -2937,68 +4050,39 @@ figure_mime( httpd_conn* hc )
 	    }
 	ext = dot + 1;
 	ext_len = prev_dot - ext;
-	/* Search the encodings table.  Linear search is fine here, there
-	** are only a few entries.
-	*/
-	for ( i = 0; i < n_enc_tab; ++i )
-	    {
-	    if ( ext_len == enc_tab[i].ext_len && strncasecmp( ext, enc_tab[i].ext, ext_len ) == 0 )
-		{
-		if ( n_me_indexes < sizeof(me_indexes)/sizeof(*me_indexes) )
-		    {
-		    me_indexes[n_me_indexes] = i;
-		    ++n_me_indexes;
-		    }
-		goto next;
-		}
-	    }
-	/* No encoding extension found.  Break and look for a type extension. */
-	break;
-
-	next: ;
+	me = mime_lookup( &enc_hash, ext, ext_len );
+	if ( me == (struct mime_entry*) 0 )
+	    /* No encoding extension found.  Break and look for a type
+	    ** extension.
+	    */
+	    break;
+	if ( n_mes < sizeof(mes) / sizeof(*mes) )
+	    mes[n_mes++] = me;
 	}
 
-    /* Binary search for a matching type extension. */
-    top = n_typ_tab - 1;
-    bot = 0;
-    while ( top >= bot )
-	{
-	mid = ( top + bot ) / 2;
-	r = strncasecmp( ext, typ_tab[mid].ext, ext_len );
-	if ( r < 0 )
-	    top = mid - 1;
-	else if ( r > 0 )
-	    bot = mid + 1;
-	else
-	    if ( ext_len < typ_tab[mid].ext_len )
-		top = mid - 1;
-	    else if ( ext_len > typ_tab[mid].ext_len )
-		bot = mid + 1;
-	    else
-		{
-		hc->type = typ_tab[mid].val;
-		goto done;
-		}
-	}
-    hc->type = default_type;
+    me = mime_lookup( &typ_hash, ext, ext_len );
+    if ( me != (struct mime_entry*) 0 )
+	hc->type = me->val;
+    else
+	hc->type = default_type;
 
     done:
 
     /* The last thing we do is actually generate the mime-encoding header. */
     hc->encodings[0] = '\0';
     encodings_len = 0;
-    for ( i = n_me_indexes - 1; i >= 0; --i )
+    for ( i = n_mes - 1; i >= 0; --i )
 	{
-	httpd_realloc_str(
-	    &hc->encodings, &hc->maxencodings,
-	    encodings_len + enc_tab[me_indexes[i]].val_len + 1 );
+	arena_str(
+	    &hc->arena, &hc->encodings, &hc->maxencodings,
+	    encodings_len + mes[i]->val_len + 1 );
 	if ( hc->encodings[0] != '\0' )
 	    {
 	    (void) strcpy( &hc->encodings[encodings_len], "," );
 	    ++encodings_len;
 	    }
-	(void) strcpy( &hc->encodings[encodings_len], enc_tab[me_indexes[i]].val );
-	encodings_len += enc_tab[me_indexes[i]].val_len;
+	(void) strcpy( &hc->encodings[encodings_len], mes[i]->val );
+	encodings_len += mes[i]->val_len;
 	}
 
     }
@@ -3035,6 +4119,13 @@ cgi_kill( ClientData client_data, struct timeval* nowP )
 #endif /* CGI_TIMELIMIT */
 
 
+/* The signals we catch, which a CGI or an indexing process should get
+** with default handling.
+*/
+static int cgi_signals[] = {
+    SIGTERM, SIGINT, SIGCHLD, SIGPIPE, SIGHUP, SIGUSR1, SIGUSR2, SIGALRM };
+
+
 #ifdef GENERATE_INDEXES
 
 /* qsort comparison routine */
@@ -3047,23 +4138,24 @@ name_compare( const void* v1, const void* v2 )
     }
 
 
-static int
-ls( httpd_conn* hc )
+/* Build the listing page into hc->response. */
+static void
+ls_generate( httpd_conn* hc, DIR* dirp )
     {
-    DIR* dirp;
     struct dirent* de;
     int namlen;
-    static int maxnames = 0;
     int nnames;
-    static char* names;
-    static char** nameptrs;
-    static char* name;
-    static size_t maxname = 0;
-    static char* rname;
-    static size_t maxrname = 0;
-    static char* encrname;
-    static size_t maxencrname = 0;
-    int i, r;
+    char* names;
+    size_t maxnames, nameslen;
+    char** nameptrs;
+    char* np;
+    char* name;
+    size_t maxname = 0;
+    char* rname;
+    size_t maxrname = 0;
+    char* encrname;
+    size_t maxencrname = 0;
+    int i;
     struct stat sb;
     struct stat lsb;
     char modestr[20];
@@ -3073,244 +4165,256 @@ ls( httpd_conn* hc )
     char* fileclass;
     time_t now;
     char* timestr;
-    ClientData client_data;
-
-    dirp = opendir( hc->expnfilename );
-    if ( dirp == (DIR*) 0 )
-	{
-	syslog( LOG_ERR, "opendir %.80s - %m", hc->expnfilename );
-	httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
-	return -1;
-	}
+    char buf[MAXPATHLEN+1000];
 
-    if ( hc->method == METHOD_HEAD )
-	{
-	closedir( dirp );
-	send_mime(
-	    hc, 200, ok200title, "", "", "text/html; charset=%s", (off_t) -1,
-	    hc->sb.st_mtime );
-	}
-    else if ( hc->method == METHOD_GET )
-	{
-	if ( hc->hs->cgi_limit != 0 && hc->hs->cgi_count >= hc->hs->cgi_limit )
+    add_response( hc, "\
+<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">\n\
+\n\
+<html>\n\
+\n\
+  <head>\n\
+    <meta http-equiv=\"Content-type\" content=\"text/html;charset=UTF-8\">\n\
+    <title>Index of " );
+    (void) my_snprintf( buf, sizeof(buf), "%.80s", hc->encodedurl );
+    add_response( hc, buf );
+    add_response( hc, "</title>\n\
+  </head>\n\
+\n\
+  <body bgcolor=\"#99cc99\" text=\"#000000\" link=\"#2020ff\" vlink=\"#4040cc\">\n\
+\n\
+    <h2>Index of " );
+    add_response( hc, buf );
+    add_response( hc, "</h2>\n\
+\n\
+    <pre>\n\
+mode  links    bytes  last-changed  name\n\
+    <hr>" );
+
+    /* Read in names, packed one after another. */
+    nnames = 0;
+    nameslen = 0;
+    maxnames = 0;
+    arena_str( &hc->arena, &names, &maxnames, 0 );
+    while ( ( de = readdir( dirp ) ) != 0 )     /* dirent or direct */
+	{
+	namlen = NAMLEN(de);
+	arena_str( &hc->arena, &names, &maxnames, nameslen + namlen );
+	(void) memcpy( &names[nameslen], de->d_name, namlen );
+	names[nameslen + namlen] = '\0';
+	nameslen += namlen + 1;
+	++nnames;
+	}
+    closedir( dirp );
+
+    /* Now that they've stopped moving, point at them. */
+    nameptrs = (char**) arena_alloc( &hc->arena, nnames * sizeof(char*) );
+    for ( i = 0, np = names; i < nnames; ++i, np += strlen( np ) + 1 )
+	nameptrs[i] = np;
+
+    /* Sort the names. */
+    qsort( nameptrs, nnames, sizeof(*nameptrs), name_compare );
+
+    /* Generate output. */
+    now = time( (time_t*) 0 );
+    for ( i = 0; i < nnames; ++i )
+	{
+	arena_str(
+	    &hc->arena, &name, &maxname,
+	    strlen( hc->expnfilename ) + 1 + strlen( nameptrs[i] ) );
+	arena_str(
+	    &hc->arena, &rname, &maxrname,
+	    strlen( hc->origfilename ) + 1 + strlen( nameptrs[i] ) );
+	if ( hc->expnfilename[0] == '\0' ||
+	     strcmp( hc->expnfilename, "." ) == 0 )
 	    {
-	    closedir( dirp );
-	    httpd_send_err(
-		hc, 503, httpd_err503title, "", httpd_err503form,
-		hc->encodedurl );
-	    return -1;
+	    (void) strcpy( name, nameptrs[i] );
+	    (void) strcpy( rname, nameptrs[i] );
 	    }
-	++hc->hs->cgi_count;
-	r = fork( );
-	if ( r < 0 )
+	else
 	    {
-	    syslog( LOG_ERR, "fork - %m" );
-	    closedir( dirp );
-	    httpd_send_err(
-		hc, 500, err500title, "", err500form, hc->encodedurl );
-	    return -1;
+	    (void) my_snprintf( name, maxname,
+		"%s/%s", hc->expnfilename, nameptrs[i] );
+	    if ( strcmp( hc->origfilename, "." ) == 0 )
+		(void) my_snprintf( rname, maxrname,
+		    "%s", nameptrs[i] );
+	    else
+		(void) my_snprintf( rname, maxrname,
+		    "%s%s", hc->origfilename, nameptrs[i] );
 	    }
-	if ( r == 0 )
-	    {
-	    /* Child process. */
-	    sub_process = 1;
-	    httpd_unlisten( hc->hs );
-	    send_mime(
-		hc, 200, ok200title, "", "", "text/html; charset=%s",
-		(off_t) -1, hc->sb.st_mtime );
-	    httpd_write_response( hc );
-
-#ifdef CGI_NICE
-	    /* Set priority. */
-	    (void) nice( CGI_NICE );
-#endif /* CGI_NICE */
+	arena_str(
+	    &hc->arena, &encrname, &maxencrname, 3 * strlen( rname ) + 1 );
+	strencode( encrname, maxencrname, rname );
 
-	    (void) dprintf( hc->conn_fd, "\
-<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">\n\
-\n\
-<html>\n\
-\n\
-  <head>\n\
-    <meta http-equiv=\"Content-type\" content=\"text/html;charset=UTF-8\">\n\
-    <title>Index of %.80s</title>\n\
-  </head>\n\
-\n\
-  <body bgcolor=\"#99cc99\" text=\"#000000\" link=\"#2020ff\" vlink=\"#4040cc\">\n\
-\n\
-    <h2>Index of %.80s</h2>\n\
-\n\
-    <pre>\n\
-mode  links    bytes  last-changed  name\n\
-    <hr>",
-		hc->encodedurl, hc->encodedurl );
+	if ( stat( name, &sb ) < 0 || lstat( name, &lsb ) < 0 )
+	    continue;
 
-	    /* Read in names. */
-	    nnames = 0;
-	    while ( ( de = readdir( dirp ) ) != 0 )     /* dirent or direct */
+	linkprefix = "";
+	lnk[0] = '\0';
+	/* Break down mode word.  First the file type. */
+	switch ( lsb.st_mode & S_IFMT )
+	    {
+	    case S_IFIFO:  modestr[0] = 'p'; break;
+	    case S_IFCHR:  modestr[0] = 'c'; break;
+	    case S_IFDIR:  modestr[0] = 'd'; break;
+	    case S_IFBLK:  modestr[0] = 'b'; break;
+	    case S_IFREG:  modestr[0] = '-'; break;
+	    case S_IFSOCK: modestr[0] = 's'; break;
+	    case S_IFLNK:  modestr[0] = 'l';
+	    linklen = readlink( name, lnk, sizeof(lnk) - 1 );
+	    if ( linklen != -1 )
 		{
-		if ( nnames >= maxnames )
-		    {
-		    if ( maxnames == 0 )
-			{
-			maxnames = 100;
-			names = NEW( char, maxnames * ( MAXPATHLEN + 1 ) );
-			nameptrs = NEW( char*, maxnames );
-			}
-		    else
-			{
-			maxnames *= 2;
-			names = RENEW( names, char, maxnames * ( MAXPATHLEN + 1 ) );
-			nameptrs = RENEW( nameptrs, char*, maxnames );
-			}
-		    if ( names == (char*) 0 || nameptrs == (char**) 0 )
-			{
-			syslog( LOG_ERR, "out of memory reallocating directory names" );
-			exit( 1 );
-			}
-		    for ( i = 0; i < maxnames; ++i )
-			nameptrs[i] = &names[i * ( MAXPATHLEN + 1 )];
-		    }
-		namlen = NAMLEN(de);
-		(void) strncpy( nameptrs[nnames], de->d_name, namlen );
-		nameptrs[nnames][namlen] = '\0';
-		++nnames;
+		lnk[linklen] = '\0';
+		linkprefix = " -&gt; ";
 		}
-	    closedir( dirp );
+	    break;
+	    default:       modestr[0] = '?'; break;
+	    }
+	/* Now the world permissions.  Owner and group permissions
+	** are not of interest to web clients.
+	*/
+	modestr[1] = ( lsb.st_mode & S_IROTH ) ? 'r' : '-';
+	modestr[2] = ( lsb.st_mode & S_IWOTH ) ? 'w' : '-';
+	modestr[3] = ( lsb.st_mode & S_IXOTH ) ? 'x' : '-';
+	modestr[4] = '\0';
+
+	/* We also leave out the owner and group name, they are
+	** also not of interest to web clients.  Plus if we're
+	** running under chroot(), they would require a copy
+	** of /etc/passwd and /etc/group, which we want to avoid.
+	*/
 
-	    /* Sort the names. */
-	    qsort( nameptrs, nnames, sizeof(*nameptrs), name_compare );
+	/* Get time string. */
+	timestr = ctime( &lsb.st_mtime );
+	timestr[ 0] = timestr[ 4];
+	timestr[ 1] = timestr[ 5];
+	timestr[ 2] = timestr[ 6];
+	timestr[ 3] = ' ';
+	timestr[ 4] = timestr[ 8];
+	timestr[ 5] = timestr[ 9];
+	timestr[ 6] = ' ';
+	if ( now - lsb.st_mtime > 60*60*24*182 )        /* 1/2 year */
+	    {
+	    timestr[ 7] = ' ';
+	    timestr[ 8] = timestr[20];
+	    timestr[ 9] = timestr[21];
+	    timestr[10] = timestr[22];
+	    timestr[11] = timestr[23];
+	    }
+	else
+	    {
+	    timestr[ 7] = timestr[11];
+	    timestr[ 8] = timestr[12];
+	    timestr[ 9] = ':';
+	    timestr[10] = timestr[14];
+	    timestr[11] = timestr[15];
+	    }
+	timestr[12] = '\0';
 
-	    /* Generate output. */
-	    for ( i = 0; i < nnames; ++i )
-		{
-		httpd_realloc_str(
-		    &name, &maxname,
-		    strlen( hc->expnfilename ) + 1 + strlen( nameptrs[i] ) );
-		httpd_realloc_str(
-		    &rname, &maxrname,
-		    strlen( hc->origfilename ) + 1 + strlen( nameptrs[i] ) );
-		if ( hc->expnfilename[0] == '\0' ||
-		     strcmp( hc->expnfilename, "." ) == 0 )
-		    {
-		    (void) strcpy( name, nameptrs[i] );
-		    (void) strcpy( rname, nameptrs[i] );
-		    }
-		else
-		    {
-		    (void) my_snprintf( name, maxname,
-			"%s/%s", hc->expnfilename, nameptrs[i] );
-		    if ( strcmp( hc->origfilename, "." ) == 0 )
-			(void) my_snprintf( rname, maxrname,
-			    "%s", nameptrs[i] );
-		    else
-			(void) my_snprintf( rname, maxrname,
-			    "%s%s", hc->origfilename, nameptrs[i] );
-		    }
-		httpd_realloc_str(
-		    &encrname, &maxencrname, 3 * strlen( rname ) + 1 );
-		strencode( encrname, maxencrname, rname );
+	/* The ls -F file class. */
+	switch ( sb.st_mode & S_IFMT )
+	    {
+	    case S_IFDIR:  fileclass = "/"; break;
+	    case S_IFSOCK: fileclass = "="; break;
+	    case S_IFLNK:  fileclass = "@"; break;
+	    default:
+	    fileclass = ( sb.st_mode & S_IXOTH ) ? "*" : "";
+	    break;
+	    }
 
-		if ( stat( name, &sb ) < 0 || lstat( name, &lsb ) < 0 )
-		    continue;
+	/* And add it to the listing. */
+	(void) my_snprintf( buf, sizeof(buf),
+	   "%s %3ld  %10lld  %s  <a href=\"/%.500s%s\">%.80s</a>%s%s%s\n",
+	    modestr, (long) lsb.st_nlink, (long long) lsb.st_size,
+	    timestr, encrname, S_ISDIR(sb.st_mode) ? "/" : "",
+	    nameptrs[i], linkprefix, lnk, fileclass );
+	add_response( hc, buf );
+	}
 
-		linkprefix = "";
-		lnk[0] = '\0';
-		/* Break down mode word.  First the file type. */
-		switch ( lsb.st_mode & S_IFMT )
-		    {
-		    case S_IFIFO:  modestr[0] = 'p'; break;
-		    case S_IFCHR:  modestr[0] = 'c'; break;
-		    case S_IFDIR:  modestr[0] = 'd'; break;
-		    case S_IFBLK:  modestr[0] = 'b'; break;
-		    case S_IFREG:  modestr[0] = '-'; break;
-		    case S_IFSOCK: modestr[0] = 's'; break;
-		    case S_IFLNK:  modestr[0] = 'l';
-		    linklen = readlink( name, lnk, sizeof(lnk) - 1 );
-		    if ( linklen != -1 )
-			{
-			lnk[linklen] = '\0';
-			linkprefix = " -&gt; ";
-			}
-		    break;
-		    default:       modestr[0] = '?'; break;
-		    }
-		/* Now the world permissions.  Owner and group permissions
-		** are not of interest to web clients.
-		*/
-		modestr[1] = ( lsb.st_mode & S_IROTH ) ? 'r' : '-';
-		modestr[2] = ( lsb.st_mode & S_IWOTH ) ? 'w' : '-';
-		modestr[3] = ( lsb.st_mode & S_IXOTH ) ? 'x' : '-';
-		modestr[4] = '\0';
-
-		/* We also leave out the owner and group name, they are
-		** also not of interest to web clients.  Plus if we're
-		** running under chroot(), they would require a copy
-		** of /etc/passwd and /etc/group, which we want to avoid.
-		*/
+    add_response( hc, "    </pre>\n  </body>\n</html>\n" );
+    }
 
-		/* Get time string. */
-		now = time( (time_t*) 0 );
-		timestr = ctime( &lsb.st_mtime );
-		timestr[ 0] = timestr[ 4];
-		timestr[ 1] = timestr[ 5];
-		timestr[ 2] = timestr[ 6];
-		timestr[ 3] = ' ';
-		timestr[ 4] = timestr[ 8];
-		timestr[ 5] = timestr[ 9];
-		timestr[ 6] = ' ';
-		if ( now - lsb.st_mtime > 60*60*24*182 )        /* 1/2 year */
-		    {
-		    timestr[ 7] = ' ';
-		    timestr[ 8] = timestr[20];
-		    timestr[ 9] = timestr[21];
-		    timestr[10] = timestr[22];
-		    timestr[11] = timestr[23];
-		    }
-		else
-		    {
-		    timestr[ 7] = timestr[11];
-		    timestr[ 8] = timestr[12];
-		    timestr[ 9] = ':';
-		    timestr[10] = timestr[14];
-		    timestr[11] = timestr[15];
-		    }
-		timestr[12] = '\0';
 
-		/* The ls -F file class. */
-		switch ( sb.st_mode & S_IFMT )
-		    {
-		    case S_IFDIR:  fileclass = "/"; break;
-		    case S_IFSOCK: fileclass = "="; break;
-		    case S_IFLNK:  fileclass = "@"; break;
-		    default:
-		    fileclass = ( sb.st_mode & S_IXOTH ) ? "*" : "";
-		    break;
-		    }
+static int
+ls( httpd_conn* hc )
+    {
+    DIR* dirp;
+    int op[2];
+    int i;
+    pid_t r;
+#ifdef CGI_TIMELIMIT
+    ClientData client_data;
+#endif /* CGI_TIMELIMIT */
 
-		/* And print. */
-		(void)  dprintf( hc->conn_fd,
-		   "%s %3ld  %10lld  %s  <a href=\"/%.500s%s\">%.80s</a>%s%s%s\n",
-		    modestr, (long) lsb.st_nlink, (long long) lsb.st_size,
-		    timestr, encrname, S_ISDIR(sb.st_mode) ? "/" : "",
-		    nameptrs[i], linkprefix, lnk, fileclass );
-		}
+    dirp = opendir( hc->expnfilename );
+    if ( dirp == (DIR*) 0 )
+	{
+	syslog( LOG_ERR, "opendir %.80s - %m", hc->expnfilename );
+	httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
+	return -1;
+	}
 
-#ifdef USE_SCTP
-	    if ( hc->is_sctp )
-		{
-		const char *trailer = "    </pre>\n  </body>\n</html>\n";
-		(void) httpd_write_sctp( hc->conn_fd, trailer, strlen(trailer), hc->use_eeor, 1, HTTP_OVER_SCTP_PPID, 0 );
-		}
-	    else
-		(void) dprintf( hc->conn_fd, "    </pre>\n  </body>\n</html>\n" );
-#else
-	    (void) dprintf( hc->conn_fd, "    </pre>\n  </body>\n</html>\n" );
-#endif
-	    exit( 0 );
+    if ( hc->method == METHOD_HEAD )
+	{
+	closedir( dirp );
+	send_mime(
+	    hc, 200, ok200title, "", "", "text/html; charset=%s", (off_t) -1,
+	    hc->sb.st_mtime );
+	}
+    else if ( hc->method == METHOD_GET )
+	{
+	if ( hc->hs->cgi_limit != 0 && hc->hs->cgi_count >= hc->hs->cgi_limit )
+	    {
+	    closedir( dirp );
+	    httpd_send_err(
+		hc, 503, httpd_err503title, "", httpd_err503form,
+		hc->encodedurl );
+	    return -1;
+	    }
+	if ( pipe( op ) < 0 )
+	    {
+	    syslog( LOG_ERR, "pipe - %m" );
+	    closedir( dirp );
+	    httpd_send_err(
+		hc, 500, err500title, "", err500form, hc->encodedurl );
+	    return -1;
 	    }
 
-	/* Parent process. */
+	/* A big directory means a lot of stat()s, which mustn't hold up
+	** the main loop, so the page gets built in a child process and
+	** relayed back through a pipe like a non-parsed-header CGI.  The
+	** child runs our own code instead of exec()ing something, so this
+	** one has to be a real fork().
+	*/
+	r = fork( );
+	if ( r < 0 )
+	    {
+	    syslog( LOG_ERR, "fork - %m" );
+	    (void) close( op[0] );
+	    (void) close( op[1] );
+	    closedir( dirp );
+	    httpd_send_err(
+		hc, 500, err500title, "", err500form, hc->encodedurl );
+	    return -1;
+	    }
+	if ( r == 0 )
+	    {
+	    /* Child process. */
+	    for ( i = 0; i < sizeof(cgi_signals) / sizeof(*cgi_signals); ++i )
+		(void) signal( cgi_signals[i], SIG_DFL );
+	    httpd_unlisten( hc->hs );
+	    (void) close( op[0] );
+#ifdef CGI_NICE
+	    /* Set priority. */
+	    (void) nice( CGI_NICE );
+#endif /* CGI_NICE */
+	    hc->responselen = 0;
+	    ls_generate( hc, dirp );
+	    (void) httpd_write_fully( op[1], hc->response, hc->responselen );
+	    _exit( 0 );
+	    }
 	closedir( dirp );
+	(void) close( op[1] );
+	++hc->hs->cgi_count;
 	syslog( LOG_DEBUG, "spawned indexing process %d for directory '%.200s'", r, hc->expnfilename );
 #ifdef CGI_TIMELIMIT
 	/* Schedule a kill for the child process, in case it runs too long */
@@ -3321,9 +4425,19 @@ mode  links    bytes  last-changed  name\n\
 	    exit( 1 );
 	    }
 #endif /* CGI_TIMELIMIT */
-	hc->status = 200;
-	hc->bytes_sent = CGI_BYTECOUNT;
-	hc->should_linger = 0;
+
+	/* The relay sends our headers, then whatever the child writes. */
+	send_mime(
+	    hc, 200, ok200title, "", "", "text/html; charset=%s", (off_t) -1,
+	    hc->sb.st_mtime );
+	op[0] = cgi_fd_setup( op[0] );
+	httpd_set_ndelay( op[0] );
+	hc->cgi_rfd = op[0];
+	hc->cgi_wfd = -1;
+	hc->cgi_app = -1;
+	hc->cgi_nph = 1;
+	hc->cgi_wbuf_len = hc->cgi_wbuf_idx = 0;
+	cgi_start_relay( hc );
 	}
     else
 	{
@@ -3340,23 +4454,14 @@ mode  links    bytes  last-changed  name\n\
 
 
 static char*
-build_env( char* fmt, char* arg )
+build_env( httpd_conn* hc, char* fmt, char* arg )
     {
     char* cp;
     size_t size;
-    static char* buf;
-    static size_t maxbuf = 0;
 
     size = strlen( fmt ) + strlen( arg );
-    if ( size > maxbuf )
-	httpd_realloc_str( &buf, &maxbuf, size );
-    (void) my_snprintf( buf, maxbuf, fmt, arg );
-    cp = strdup( buf );
-    if ( cp == (char*) 0 )
-	{
-	syslog( LOG_ERR, "out of memory copying environment variable" );
-	exit( 1 );
-	}
+    cp = (char*) arena_alloc( &hc->arena, size + 1 );
+    (void) my_snprintf( cp, size + 1, fmt, arg );
     return cp;
     }
 
@@ -3379,23 +4484,24 @@ hostname_map( char* hostname )
 
 
 /* Set up environment variables. Be real careful here to avoid
-** letting malicious clients overrun a buffer.  We don't have
-** to worry about freeing stuff since we're a sub-process.
+** letting malicious clients overrun a buffer.  The vector and the
+** strings come from the connection's arena.
 */
 static char**
 make_envp( httpd_conn* hc )
     {
-    static char* envp[50];
+    char** envp;
     int envn;
     char* cp;
     char buf[256];
 
+    envp = (char**) arena_alloc( &hc->arena, 50 * sizeof(char*) );
     envn = 0;
-    envp[envn++] = build_env( "PATH=%s", CGI_PATH );
+    envp[envn++] = build_env( hc, "PATH=%s", CGI_PATH );
 #ifdef CGI_LD_LIBRARY_PATH
-    envp[envn++] = build_env( "LD_LIBRARY_PATH=%s", CGI_LD_LIBRARY_PATH );
+    envp[envn++] = build_env( hc, "LD_LIBRARY_PATH=%s", CGI_LD_LIBRARY_PATH );
 #endif /* CGI_LD_LIBRARY_PATH */
-    envp[envn++] = build_env( "SERVER_SOFTWARE=%s", SERVER_SOFTWARE );
+    envp[envn++] = build_env( hc, "SERVER_SOFTWARE=%s", SERVER_SOFTWARE );
     if ( hc->hs->vhost && hc->hostname != (char*) 0 && hc->hostname[0] != '\0' )
 	cp = hc->hostname;
     else if ( hc->hdrhost != (char*) 0 && hc->hdrhost[0] != '\0' )
@@ -3405,38 +4511,39 @@ make_envp( httpd_conn* hc )
     else
 	cp = hc->hs->server_hostname;
     if ( cp != (char*) 0 )
-	envp[envn++] = build_env( "SERVER_NAME=%s", cp );
-    envp[envn++] = "GATEWAY_INTERFACE=CGI/1.1";
-    envp[envn++] = build_env("SERVER_PROTOCOL=%s", hc->protocol);
+	envp[envn++] = build_env( hc, "SERVER_NAME=%s", cp );
+    envp[envn++] = build_env( hc, "GATEWAY_INTERFACE=%s", "CGI/1.1" );
+    envp[envn++] = build_env( hc, "SERVER_PROTOCOL=%s", hc->protocol);
     (void) my_snprintf( buf, sizeof(buf), "%d", (int) hc->hs->port );
-    envp[envn++] = build_env( "SERVER_PORT=%s", buf );
+    envp[envn++] = build_env( hc, "SERVER_PORT=%s", buf );
     envp[envn++] = build_env(
-	"REQUEST_METHOD=%s", httpd_method_str( hc->method ) );
+	hc, "REQUEST_METHOD=%s", httpd_method_str( hc->method ) );
     if ( hc->pathinfo[0] != '\0' )
 	{
 	char* cp2;
 	size_t l;
-	envp[envn++] = build_env( "PATH_INFO=/%s", hc->pathinfo );
+	envp[envn++] = build_env( hc, "PATH_INFO=/%s", hc->pathinfo );
 	l = strlen( hc->hs->cwd ) + strlen( hc->pathinfo ) + 1;
 	cp2 = NEW( char, l );
 	if ( cp2 != (char*) 0 )
 	    {
 	    (void) my_snprintf( cp2, l, "%s%s", hc->hs->cwd, hc->pathinfo );
-	    envp[envn++] = build_env( "PATH_TRANSLATED=%s", cp2 );
+	    envp[envn++] = build_env( hc, "PATH_TRANSLATED=%s", cp2 );
+	    free( (void*) cp2 );
 	    }
 	}
     envp[envn++] = build_env(
-	"SCRIPT_NAME=/%s", strcmp( hc->origfilename, "." ) == 0 ?
+	hc, "SCRIPT_NAME=/%s", strcmp( hc->origfilename, "." ) == 0 ?
 	"" : hc->origfilename );
     if ( hc->query[0] != '\0')
-	envp[envn++] = build_env( "QUERY_STRING=%s", hc->query );
+	envp[envn++] = build_env( hc, "QUERY_STRING=%s", hc->query );
     envp[envn++] = build_env(
-	"REMOTE_ADDR=%s", httpd_ntoa( &hc->client_addr ) );
+	hc, "REMOTE_ADDR=%s", httpd_ntoa( &hc->client_addr ) );
     if ( hc->client_addr.sa.sa_family == AF_INET )
 	(void) my_snprintf( buf, sizeof(buf), "%d", (int) ntohs( hc->client_addr.sa_in.sin_port ) );
     else
 	(void) my_snprintf( buf, sizeof(buf), "%d", (int) ntohs( hc->client_addr.sa_in6.sin6_port ) );
-    envp[envn++] = build_env( "REMOTE_PORT=%s", buf );
+    envp[envn++] = build_env( hc, "REMOTE_PORT=%s", buf );
 #if defined(TCP_FASTOPEN) && defined(__FreeBSD__)
 #ifdef USE_SCTP
     if ( !hc->is_sctp )
@@ -3449,7 +4556,7 @@ make_envp( httpd_conn* hc )
 
 	optlen = (socklen_t)sizeof(int);
 	if ( getsockopt( hc->conn_fd, IPPROTO_TCP, TCP_FASTOPEN, &optval, &optlen ) == 0 )
-	    envp[envn++] = build_env( "FASTOPEN=%s", optval != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "FASTOPEN=%s", optval != 0 ? "YES" : "NO" );
 	}
 #endif
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__linux__)
@@ -3466,10 +4573,10 @@ make_envp( httpd_conn* hc )
 	optlen = (socklen_t)sizeof(struct tcp_connection_info);
 	if ( getsockopt( hc->conn_fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &optlen ) == 0 )
 	    {
-	    envp[envn++] = build_env( "TCP_TIMESTAMPS=%s", (info.tcpi_options & TCPCI_OPT_TIMESTAMPS) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_SACK=%s", (info.tcpi_options & TCPCI_OPT_SACK) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_WINDOW_SCALING=%s", (info.tcpi_options & TCPCI_OPT_WSCALE) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_ECN=%s", (info.tcpi_options & TCPCI_OPT_ECN) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_TIMESTAMPS=%s", (info.tcpi_options & TCPCI_OPT_TIMESTAMPS) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_SACK=%s", (info.tcpi_options & TCPCI_OPT_SACK) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_WINDOW_SCALING=%s", (info.tcpi_options & TCPCI_OPT_WSCALE) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_ECN=%s", (info.tcpi_options & TCPCI_OPT_ECN) != 0 ? "YES" : "NO" );
 	    }
 	}
 #endif
@@ -3480,10 +4587,10 @@ make_envp( httpd_conn* hc )
 	optlen = (socklen_t)sizeof(struct tcp_info);
 	if ( getsockopt( hc->conn_fd, IPPROTO_TCP, TCP_INFO, &info, &optlen ) == 0 )
 	    {
-	    envp[envn++] = build_env( "TCP_TIMESTAMPS=%s", (info.tcpi_options & TCPI_OPT_TIMESTAMPS) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_SACK=%s", (info.tcpi_options & TCPI_OPT_SACK) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_WINDOW_SCALING=%s", (info.tcpi_options & TCPI_OPT_WSCALE) != 0 ? "YES" : "NO" );
-	    envp[envn++] = build_env( "TCP_ECN=%s", (info.tcpi_options & TCPI_OPT_ECN) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_TIMESTAMPS=%s", (info.tcpi_options & TCPI_OPT_TIMESTAMPS) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_SACK=%s", (info.tcpi_options & TCPI_OPT_SACK) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_WINDOW_SCALING=%s", (info.tcpi_options & TCPI_OPT_WSCALE) != 0 ? "YES" : "NO" );
+	    envp[envn++] = build_env( hc, "TCP_ECN=%s", (info.tcpi_options & TCPI_OPT_ECN) != 0 ? "YES" : "NO" );
 	    }
 	}
 #endif
@@ -3515,14 +4622,14 @@ make_envp( httpd_conn* hc )
 	    if ( sysctlbyname( "net.inet.tcp.udp_tunneling_port", &local_encaps_port, &len, NULL, 0 ) < 0 )
 		local_encaps_port = 0;
 	    (void) my_snprintf( buf, sizeof(buf), "%d", local_encaps_port );
-	    envp[envn++] = build_env( "SERVER_UDP_ENCAPS_PORT=%s", buf );
+	    envp[envn++] = build_env( hc, "SERVER_UDP_ENCAPS_PORT=%s", buf );
 #endif
 	    (void) my_snprintf( buf, sizeof(buf), "%d", remote_encaps_port );
-	    envp[envn++] = build_env( "REMOTE_UDP_ENCAPS_PORT=%s", buf );
-	    envp[envn++] = build_env( "TRANSPORT_PROTOCOL=%s", "TCP/UDP" );
+	    envp[envn++] = build_env( hc, "REMOTE_UDP_ENCAPS_PORT=%s", buf );
+	    envp[envn++] = build_env( hc, "TRANSPORT_PROTOCOL=%s", "TCP/UDP" );
 	    }
 	else
-	    envp[envn++] = build_env( "TRANSPORT_PROTOCOL=%s", "TCP" );
+	    envp[envn++] = build_env( hc, "TRANSPORT_PROTOCOL=%s", "TCP" );
 	}
     else
 	{
@@ -3551,63 +4658,66 @@ make_envp( httpd_conn* hc )
 	    if ( sysctlbyname( "net.inet.sctp.udp_tunneling_port", &local_encaps_port, &len, NULL, 0 ) < 0 )
 		local_encaps_port = 0;
 	    (void) my_snprintf( buf, sizeof(buf), "%d", (int) local_encaps_port );
-	    envp[envn++] = build_env( "SERVER_UDP_ENCAPS_PORT=%s", buf );
+	    envp[envn++] = build_env( hc, "SERVER_UDP_ENCAPS_PORT=%s", buf );
 #endif
 	    (void) my_snprintf( buf, sizeof(buf), "%d", (int) remote_encaps_port );
-	    envp[envn++] = build_env( "REMOTE_UDP_ENCAPS_PORT=%s", buf );
-	    envp[envn++] = build_env( "TRANSPORT_PROTOCOL=%s", "SCTP/UDP" );
+	    envp[envn++] = build_env( hc, "REMOTE_UDP_ENCAPS_PORT=%s", buf );
+	    envp[envn++] = build_env( hc, "TRANSPORT_PROTOCOL=%s", "SCTP/UDP" );
 	    }
 	else
-	    envp[envn++] = build_env( "TRANSPORT_PROTOCOL=%s", "SCTP" );
+	    envp[envn++] = build_env( hc, "TRANSPORT_PROTOCOL=%s", "SCTP" );
 	}
     if ( hc->referrer[0] != '\0' )
 	{
-	envp[envn++] = build_env( "HTTP_REFERER=%s", hc->referrer );
-	envp[envn++] = build_env( "HTTP_REFERRER=%s", hc->referrer );
+	envp[envn++] = build_env( hc, "HTTP_REFERER=%s", hc->referrer );
+	envp[envn++] = build_env( hc, "HTTP_REFERRER=%s", hc->referrer );
 	}
     if ( hc->useragent[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_USER_AGENT=%s", hc->useragent );
+	envp[envn++] = build_env( hc, "HTTP_USER_AGENT=%s", hc->useragent );
     if ( hc->accept[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_ACCEPT=%s", hc->accept );
+	envp[envn++] = build_env( hc, "HTTP_ACCEPT=%s", hc->accept );
     if ( hc->accepte[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_ACCEPT_ENCODING=%s", hc->accepte );
+	envp[envn++] = build_env( hc, "HTTP_ACCEPT_ENCODING=%s", hc->accepte );
     if ( hc->acceptl[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_ACCEPT_LANGUAGE=%s", hc->acceptl );
+	envp[envn++] = build_env( hc, "HTTP_ACCEPT_LANGUAGE=%s", hc->acceptl );
     if ( hc->cookie[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_COOKIE=%s", hc->cookie );
+	envp[envn++] = build_env( hc, "HTTP_COOKIE=%s", hc->cookie );
     if ( hc->contenttype[0] != '\0' )
-	envp[envn++] = build_env( "CONTENT_TYPE=%s", hc->contenttype );
+	envp[envn++] = build_env( hc, "CONTENT_TYPE=%s", hc->contenttype );
     if ( hc->hdrhost[0] != '\0' )
-	envp[envn++] = build_env( "HTTP_HOST=%s", hc->hdrhost );
+	envp[envn++] = build_env( hc, "HTTP_HOST=%s", hc->hdrhost );
     if ( hc->contentlength != -1 )
 	{
 	(void) my_snprintf(
 	    buf, sizeof(buf), "%lu", (unsigned long) hc->contentlength );
-	envp[envn++] = build_env( "CONTENT_LENGTH=%s", buf );
+	envp[envn++] = build_env( hc, "CONTENT_LENGTH=%s", buf );
 	}
     if ( hc->remoteuser[0] != '\0' )
-	envp[envn++] = build_env( "REMOTE_USER=%s", hc->remoteuser );
+	envp[envn++] = build_env( hc, "REMOTE_USER=%s", hc->remoteuser );
     if ( hc->authorization[0] != '\0' )
-	envp[envn++] = build_env( "AUTH_TYPE=%s", "Basic" );
+	envp[envn++] = build_env( hc, "AUTH_TYPE=%s", "Basic" );
 	/* We only support Basic auth at the moment. */
     if ( getenv( "TZ" ) != (char*) 0 )
-	envp[envn++] = build_env( "TZ=%s", getenv( "TZ" ) );
-    envp[envn++] = build_env( "CGI_PATTERN=%s", hc->hs->cgi_pattern );
+	envp[envn++] = build_env( hc, "TZ=%s", getenv( "TZ" ) );
+    envp[envn++] = build_env( hc, "CGI_PATTERN=%s", hc->hs->cgi_pattern );
 
     envp[envn] = (char*) 0;
     return envp;
     }
 
 
-/* Set up argument vector.  Again, we don't have to worry about freeing stuff
-** since we're a sub-process.  This gets done after make_envp() because we
-** scribble on hc->query.
+/* Set up argument vector.  The vector comes from the arena, and the query
+** arguments get decoded into a copy of hc->query allocated along with
+** it, since hc->query points into the request and the log still needs
+** it.  The filename points into hc.
 */
 static char**
 make_argp( httpd_conn* hc )
     {
     char** argp;
     int argn;
+    size_t querylen;
+    char* query;
     char* cp1;
     char* cp2;
 
@@ -3615,9 +4725,11 @@ make_argp( httpd_conn* hc )
     ** one for the filename and one for the NULL, we are guaranteed to
     ** have enough.  We could actually use strlen/2.
     */
-    argp = NEW( char*, strlen( hc->query ) + 2 );
-    if ( argp == (char**) 0 )
-	return (char**) 0;
+    querylen = strlen( hc->query );
+    argp = (char**) arena_alloc(
+	&hc->arena, sizeof(char*) * ( querylen + 2 ) + querylen + 1 );
+    query = (char*) &argp[querylen + 2];
+    (void) memcpy( query, hc->query, querylen + 1 );
 
     argp[0] = strrchr( hc->expnfilename, '/' );
     if ( argp[0] != (char*) 0 )
@@ -3631,9 +4743,9 @@ make_argp( httpd_conn* hc )
     ** character to determine if the command line is to be used, if it finds
     ** one, the command line is not to be used."
     */
-    if ( strchr( hc->query, '=' ) == (char*) 0 )
+    if ( strchr( query, '=' ) == (char*) 0 )
 	{
-	for ( cp1 = cp2 = hc->query; *cp2 != '\0'; ++cp2 )
+	for ( cp1 = cp2 = query; *cp2 != '\0'; ++cp2 )
 	    {
 	    if ( *cp2 == '+' )
 		{
@@ -3655,135 +4767,30 @@ make_argp( httpd_conn* hc )
     }
 
 
-/* This routine is used only for POST requests.  It reads the data
-** from the request and sends it to the child process.  The only reason
-** we need to do it this way instead of just letting the child read
-** directly is that we have already read part of the data into our
-** buffer.
-*/
-static void
-cgi_interpose_input( httpd_conn* hc, int wfd )
-    {
-    ssize_t c, r;
-    char buf[1024];
-
-    c = hc->read_idx - hc->checked_idx;
-    if ( c > 0 )
-	{
-	if ( httpd_write_fully( wfd, &(hc->read_buf[hc->checked_idx]), (size_t)c ) != c )
-	    return;
-	}
-    while ( c < hc->contentlength )
-	{
-	r = read( hc->conn_fd, buf, MIN( sizeof(buf), hc->contentlength - c ) );
-	if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
-	    {
-	    sleep( 1 );
-	    continue;
-	    }
-	if ( r <= 0 )
-	    return;
-	if ( httpd_write_fully( wfd, buf, r ) != r )
-	    return;
-	c += r;
-	}
-    post_post_garbage_hack( hc );
-    }
-
-
 /* Special hack to deal with broken browsers that send a LF or CRLF
 ** after POST data, causing TCP resets - we just read and discard up
-** to 2 bytes.  Unfortunately this doesn't fix the problem for CGIs
-** which avoid the interposer process due to their POST data being
-** short.  Creating an interposer process for all POST CGIs is
-** unacceptably expensive.  The eventual fix will come when interposing
-** gets integrated into the main loop as a tasklet instead of a process.
+** to 2 bytes.
 */
 static void
 post_post_garbage_hack( httpd_conn* hc )
     {
     char buf[2];
 
-    /* If we are in a sub-process, turn on no-delay mode in case we
-    ** previously cleared it.
-    */
-    if ( sub_process )
-	httpd_set_ndelay( hc->conn_fd );
-    /* And read up to 2 bytes. */
+    /* The connection is non-blocking, so this only gets what's there. */
     (void) read( hc->conn_fd, buf, sizeof(buf) );
     }
 
 
-/* This routine is used for parsed-header CGIs.  The idea here is that the
-** CGI can return special headers such as "Status:" and "Location:" which
-** change the return status of the response.  Since the return status has to
-** be the very first line written out, we have to accumulate all the headers
-** and check for the special ones before writing the status.  Then we write
-** out the saved headers and proceed to echo the rest of the response.
+/* Figure out the status of a parsed-header CGI response whose headers end
+** at br.  Look for a Status: or Location: header; else if there's an HTTP
+** header line, get it from there; else default to 200.
 */
-
-#define BUFSIZE 1024
-static void
-cgi_interpose_output( httpd_conn* hc, int rfd )
+static int
+cgi_header_status( char* headers, char* br )
     {
-    ssize_t r;
-#ifdef USE_SCTP
-    ssize_t r1, r2;
-    char buf1[BUFSIZE];
-    char buf2[BUFSIZE];
-    char *buf;
-#else
-    char buf[BUFSIZE];
-#endif
-    size_t headers_size, headers_len;
-    char* headers;
-    char* br;
     int status;
-    char* title;
     char* cp;
 
-    /* Make sure the connection is in blocking mode.  It should already
-    ** be blocking, but we might as well be sure.
-    */
-    httpd_clear_ndelay( hc->conn_fd );
-
-    /* Slurp in all headers. */
-    headers_size = 0;
-    httpd_realloc_str( &headers, &headers_size, 500 );
-    headers_len = 0;
-#ifdef USE_SCTP
-    buf = buf1;
-#endif
-    for (;;)
-	{
-	r = read( rfd, buf, BUFSIZE );
-	if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
-	    {
-	    sleep( 1 );
-	    continue;
-	    }
-	if ( r <= 0 )
-	    {
-	    br = &(headers[headers_len]);
-	    break;
-	    }
-	httpd_realloc_str( &headers, &headers_size, headers_len + r );
-	(void) memmove( &(headers[headers_len]), buf, r );
-	headers_len += r;
-	headers[headers_len] = '\0';
-	if ( ( br = strstr( headers, "\015\012\015\012" ) ) != (char*) 0 ||
-	     ( br = strstr( headers, "\012\012" ) ) != (char*) 0 )
-	    break;
-	}
-
-    /* If there were no headers, bail. */
-    if ( headers[0] == '\0' )
-	return;
-
-    /* Figure out the status.  Look for a Status: or Location: header;
-    ** else if there's an HTTP header line, get it from there; else
-    ** default to 200.
-    */
     status = 200;
     if ( strncmp( headers, "HTTP/", 5 ) == 0 )
 	{
@@ -3803,350 +4810,814 @@ cgi_interpose_output( httpd_conn* hc, int rfd )
 	cp += strspn( cp, " \t" );
 	status = atoi( cp );
 	}
+    return status;
+    }
+
 
-    /* Write the status line. */
+static char*
+cgi_status_title( int status )
+    {
     switch ( status )
 	{
-	case 200: title = ok200title; break;
-	case 302: title = err302title; break;
-	case 304: title = err304title; break;
-	case 400: title = httpd_err400title; break;
+	case 200: return ok200title;
+	case 302: return err302title;
+	case 304: return err304title;
+	case 400: return httpd_err400title;
 #ifdef AUTH_FILE
-	case 401: title = err401title; break;
+	case 401: return err401title;
 #endif /* AUTH_FILE */
-	case 403: title = err403title; break;
-	case 404: title = err404title; break;
-	case 408: title = httpd_err408title; break;
-	case 451: title = err451title; break;
-	case 500: title = err500title; break;
-	case 501: title = err501title; break;
-	case 503: title = httpd_err503title; break;
-	default: title = "Something"; break;
+	case 403: return err403title;
+	case 404: return err404title;
+	case 408: return httpd_err408title;
+	case 451: return err451title;
+	case 500: return err500title;
+	case 501: return err501title;
+	case 503: return httpd_err503title;
+	default: return "Something";
 	}
-#ifdef USE_SCTP
-    if ( hc->is_sctp )
+    }
+
+
+/* Moves a descriptor for a CGI above stderr if need be, so the child's
+** dup2 calls can't clobber it, and sets close-on-exec.
+*/
+static int
+cgi_fd_setup( int fd )
+    {
+    int nfd;
+
+    if ( fd >= 0 && fd <= STDERR_FILENO )
 	{
-	int headers_written, buffer_cached;
+	nfd = fcntl( fd, F_DUPFD, STDERR_FILENO + 1 );
+	(void) close( fd );
+	fd = nfd;
+	}
+    if ( fd >= 0 )
+	(void) fcntl( fd, F_SETFD, 1 );
+    return fd;
+    }
+
+
+/* Start a CGI program.  Everything that needs memory - the environment,
+** the argument vector, the directory name - gets prepared here in the
+** parent, so that the child from vfork() only has to shuffle descriptors
+** and exec.  Unlike fork(), that doesn't copy our page tables, which can
+** be big with lots of files mapped.  in_fd becomes stdin, or -1 for
+** /dev/null; out_fd becomes stdout and stderr.  Both should be set up
+** with cgi_fd_setup().  Returns the child's pid, or -1.
+*/
+static pid_t
+cgi_spawn( httpd_conn* hc, int in_fd, int out_fd )
+    {
+    char** argp;
+    char** envp;
+    char* binary;
+    char* directory;
+    int null_fd, i, err;
+    volatile int child_in;	/* mustn't live in a register across vfork() */
+    pid_t r;
+    sigset_t set, oset;
 
-	headers_written = 0;
-	buffer_cached = 0;
-	for (;;)
+    null_fd = -1;
+    if ( in_fd < 0 )
+	{
+	null_fd = cgi_fd_setup( open( "/dev/null", O_RDONLY ) );
+	if ( null_fd < 0 )
 	    {
-	    r = read( rfd, buf, BUFSIZE );
-	    if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
-		{
-		sleep( 1 );
-		continue;
-		}
-	    if (headers_written == 0)
-		{
-		int eor;
+	    syslog( LOG_ERR, "open /dev/null - %m" );
+	    return -1;
+	    }
+	}
+    child_in = in_fd >= 0 ? in_fd : null_fd;
 
-		if ( (headers_len == 0) && (r == 0) )
-		    eor = 1;
-		else
-		    eor = 0;
-		(void) my_snprintf( buf2, BUFSIZE, "HTTP/1.0 %d %s\015\012", status, title );
-		(void) httpd_write_fully_sctp( hc->conn_fd, buf2, strlen( buf2 ),
-		                               hc->use_eeor, eor, hc->send_at_once_limit );
-		if ( r == 0 )
-		    eor = 1;
-		else
-		    eor = 0;
-		(void) httpd_write_fully_sctp( hc->conn_fd, headers, headers_len,
-		                               hc->use_eeor, eor, hc->send_at_once_limit );
-		headers_written = 1;
-		}
-	    if ( r <= 0 )
+    /* Make the environment and argument vectors.  The query stays as
+    ** is - hc->query points into read_buf, so make_argp() decodes its
+    ** own copy.
+    */
+    envp = make_envp( hc );
+    argp = make_argp( hc );
+
+    /* Split the program into directory and binary, so we can chdir()
+    ** to the program's own directory.  This isn't in the CGI 1.1
+    ** spec, but it's what other HTTP servers do.
+    */
+    directory = (char*) arena_alloc(
+	&hc->arena, strlen( hc->expnfilename ) + 1 );
+    (void) strcpy( directory, hc->expnfilename );
+    binary = strrchr( directory, '/' );
+    if ( binary == (char*) 0 )
+	binary = hc->expnfilename;
+    else
+	*binary++ = '\0';
+
+    /* None of our signal handlers may run in the child while it's
+    ** sharing our memory.
+    */
+    (void) sigfillset( &set );
+    (void) sigprocmask( SIG_BLOCK, &set, &oset );
+    r = vfork( );
+    if ( r == 0 )
+	{
+	/* Child process.  Until the exec this is borrowing the parent's
+	** memory, so it sticks to system calls.  The syslog descriptor,
+	** listen sockets, connections and other pipes are all
+	** close-on-exec.
+	*/
+	for ( i = 0; i < sizeof(cgi_signals) / sizeof(*cgi_signals); ++i )
+	    (void) signal( cgi_signals[i], SIG_DFL );
+	(void) sigprocmask( SIG_SETMASK, &oset, (sigset_t*) 0 );
+	(void) dup2( child_in, STDIN_FILENO );
+	(void) dup2( out_fd, STDOUT_FILENO );
+	(void) dup2( out_fd, STDERR_FILENO );
+	if ( binary != hc->expnfilename )
+	    (void) chdir( directory );  /* ignore errors */
+#ifdef CGI_NICE
+	/* Set priority. */
+	(void) nice( CGI_NICE );
+#endif /* CGI_NICE */
+	(void) execve( binary, argp, envp );
+	/* Something went wrong.  The parent sees the CGI exit without any
+	** output, and sends the error.
+	*/
+	_exit( 1 );
+	}
+    err = errno;
+    (void) sigprocmask( SIG_SETMASK, &oset, (sigset_t*) 0 );
+    if ( r < 0 )
+	{
+	errno = err;
+	syslog( LOG_ERR, "vfork - %m" );
+	}
+    if ( child_in != in_fd )
+	(void) close( child_in );
+    return r;
+    }
+
+
+/* Relayed CGI.  Rather than handing the connection over to child
+** processes, the main loop moves the request body to the CGI and the
+** CGI's output back to the client, one non-blocking read or write at a
+** time.  A regular CGI talks to us over a pair of pipes; a persistent
+** FastCGI worker over a socket, with the data wrapped in records.
+*/
+
+static ssize_t
+cgi_client_write( httpd_conn* hc, char* buf, size_t len )
+    {
+#ifdef USE_SCTP
+    if ( hc->is_sctp )
+	return httpd_write_sctp(
+	    hc->conn_fd, buf, MIN( len, hc->send_at_once_limit ), hc->use_eeor,
+	    0, HTTP_OVER_SCTP_PPID, 0 );
+#endif
+    return write( hc->conn_fd, buf, len );
+    }
+
+
+/* How long a CGI response may be cached, from its headers.  Only
+** responses that give a lifetime with Cache-Control max-age or
+** s-maxage are cached, and not if they're marked private, set a cookie,
+** or vary with request headers we don't key on.  Returns 0 for
+** uncacheable.
+*/
+static int
+cgi_cache_max_age( char* headers, char* br )
+    {
+    char* cp;
+    char* ep;
+    int max_age, s_maxage;
+
+    max_age = s_maxage = 0;
+    for ( cp = headers; cp < br; cp = ep + 1 )
+	{
+	ep = memchr( cp, '\012', br - cp );
+	if ( ep == (char*) 0 )
+	    break;
+	if ( strncasecmp( cp, "Set-Cookie:", 11 ) == 0 ||
+	     strncasecmp( cp, "Vary:", 5 ) == 0 )
+	    return 0;
+	if ( strncasecmp( cp, "Cache-Control:", 14 ) != 0 )
+	    continue;
+	for ( cp += 14; cp < ep; ++cp )
+	    {
+	    cp += strspn( cp, " \t," );
+	    if ( strncasecmp( cp, "no-store", 8 ) == 0 ||
+		 strncasecmp( cp, "no-cache", 8 ) == 0 ||
+		 strncasecmp( cp, "private", 7 ) == 0 )
+		return 0;
+	    if ( strncasecmp( cp, "max-age=", 8 ) == 0 )
+		max_age = atoi( cp + 8 );
+	    else if ( strncasecmp( cp, "s-maxage=", 9 ) == 0 )
+		s_maxage = atoi( cp + 9 );
+	    cp += strcspn( cp, ",\012" );
+	    if ( *cp == '\012' )
 		break;
-	    if ( buffer_cached == 1 )
-		{
-		if (buf == buf1)
-		    {
-		    if ( httpd_write_fully_sctp( hc->conn_fd, buf2, r2,
-		                                 hc->use_eeor, 0,
-		                                 hc->send_at_once_limit ) != r2 )
-			break;
-		    }
-		else
-		    {
-		    if ( httpd_write_fully_sctp( hc->conn_fd, buf1, r1,
-		                                 hc->use_eeor, 0,
-		                                 hc->send_at_once_limit ) != r1 )
-			break;
-		    }
-		buffer_cached = 0;
-		}
-	    if ( buf == buf1 )
-		{
-		r1 = r;
-		buf = buf2;
-		}
-	    else
-		{
-		r2 = r;
-		buf = buf1;
-		}
-	    buffer_cached = 1;
 	    }
-	if ( buffer_cached == 1 )
+	}
+    /* We're a shared cache, so s-maxage wins. */
+    return MAX( s_maxage > 0 ? s_maxage : max_age, 0 );
+    }
+
+
+/* The Content-Length a CGI response's headers promise, or -1. */
+static off_t
+cgi_content_length( char* headers, char* br )
+    {
+    char* cp;
+    char* ep;
+
+    for ( cp = headers; cp < br; cp = ep + 1 )
+	{
+	ep = memchr( cp, '\012', br - cp );
+	if ( ep == (char*) 0 )
+	    break;
+	if ( strncasecmp( cp, "Content-Length:", 15 ) == 0 )
+	    return (off_t) atoll( cp + 15 );
+	}
+    return -1;
+    }
+
+
+/* Adds body bytes to the cache entry being filled, if any. */
+static void
+cgi_cache_body( httpd_conn* hc, char* data, size_t len )
+    {
+    if ( hc->cgi_fill != (void*) 0 &&
+	 cgicache_add_body( hc->cgi_fill, data, len ) < 0 )
+	hc->cgi_fill = (void*) 0;
+    }
+
+
+/* The saved headers are complete - the blank line that ends them starts
+** at br, and the first hlen bytes are headers.  Now we can generate the
+** status line, and anything after the headers is body.
+*/
+static void
+cgi_relay_headers( httpd_conn* hc, char* br, size_t hlen )
+    {
+    char buf[100];
+    size_t start;
+    int max_age;
+
+    hc->status = cgi_header_status( hc->cgi_headers, br );
+    (void) my_snprintf(
+	buf, sizeof(buf), "HTTP/1.0 %d %s\015\012", hc->status,
+	cgi_status_title( hc->status ) );
+    start = hc->responselen;
+    add_response( hc, buf );
+    add_response_len( hc, hc->cgi_headers, hlen );
+    if ( hc->cgi_fill != (void*) 0 )
+	{
+	max_age = 0;
+	if ( hc->status == 200 )
+	    max_age = cgi_cache_max_age( hc->cgi_headers, br );
+	if ( max_age > 0 )
 	    {
-	    if ( buf == buf1 )
-		(void)httpd_write_fully_sctp( hc->conn_fd, buf2, r2,
-		                              hc->use_eeor, 1,
-		                              hc->send_at_once_limit );
+	    if ( cgicache_set_headers(
+		     hc->cgi_fill, hc->status, &(hc->response[start]),
+		     hc->responselen - start, max_age ) < 0 )
+		hc->cgi_fill = (void*) 0;
 	    else
-		(void)httpd_write_fully_sctp( hc->conn_fd, buf1, r1,
-		                              hc->use_eeor, 1,
-		                              hc->send_at_once_limit );
+		hc->cgi_fill_length = cgi_content_length( hc->cgi_headers, br );
+	    }
+	else
+	    {
+	    cgicache_uncacheable( hc->cgi_fill, (struct timeval*) 0 );
+	    hc->cgi_fill = (void*) 0;
+	    }
+	}
+    if ( hc->cgi_headers_len > hlen )
+	{
+	add_response_len(
+	    hc, &(hc->cgi_headers[hlen]), hc->cgi_headers_len - hlen );
+	cgi_cache_body(
+	    hc, &(hc->cgi_headers[hlen]), hc->cgi_headers_len - hlen );
+	hc->bytes_sent += hc->cgi_headers_len - hlen;
+	}
+    hc->cgi_headers_len = 0;
+    hc->cgi_state = CGIS_BODY;
+    }
+
+
+/* Output from the CGI.  Until the end of the headers shows up it just gets
+** saved.
+*/
+static void
+cgi_relay_output( httpd_conn* hc, char* data, size_t len )
+    {
+    char* cp;
+    char* ep;
+    size_t start;
+
+    if ( hc->cgi_state == CGIS_BODY )
+	{
+	add_response_len( hc, data, len );
+	cgi_cache_body( hc, data, len );
+	hc->bytes_sent += len;
+	return;
+	}
+
+    /* Only the new bytes need scanning, plus a few old ones in case the
+    ** blank line straddles the boundary.
+    */
+    start = hc->cgi_headers_len < 3 ? 0 : hc->cgi_headers_len - 3;
+    httpd_realloc_str(
+	&hc->cgi_headers, &hc->maxcgi_headers, hc->cgi_headers_len + len );
+    (void) memmove( &(hc->cgi_headers[hc->cgi_headers_len]), data, len );
+    hc->cgi_headers_len += len;
+    hc->cgi_headers[hc->cgi_headers_len] = '\0';
+    ep = &(hc->cgi_headers[hc->cgi_headers_len]);
+    for ( cp = &(hc->cgi_headers[start]);
+	  ( cp = memchr( cp, '\012', ep - cp ) ) != (char*) 0;
+	  ++cp )
+	{
+	if ( cp[1] == '\012' )
+	    {
+	    cgi_relay_headers( hc, cp + 1, cp + 2 - hc->cgi_headers );
+	    return;
+	    }
+	if ( cp[1] == '\015' && cp[2] == '\012' )
+	    {
+	    cgi_relay_headers( hc, cp + 1, cp + 3 - hc->cgi_headers );
+	    return;
+	    }
+	}
+    }
+
+
+/* The CGI has finished its output. */
+static void
+cgi_relay_eof( httpd_conn* hc )
+    {
+    int complete;
+    int status;
+    char* headers;
+    char* body;
+    size_t headers_len, body_len;
+
+    /* Output that stops before the headers do has been cut short. */
+    complete = ( hc->cgi_state == CGIS_BODY );
+    if ( hc->cgi_state == CGIS_HEADERS )
+	{
+	if ( hc->cgi_headers_len == 0 )
+	    {
+	    syslog(
+		LOG_ERR, "CGI %.80s produced no output", hc->expnfilename );
+	    httpd_send_err(
+		hc, 500, err500title, "", err500form, hc->encodedurl );
 	    }
+	else
+	    cgi_relay_headers(
+		hc, &(hc->cgi_headers[hc->cgi_headers_len]),
+		hc->cgi_headers_len );
 	}
-    else
+    if ( hc->cgi_fill != (void*) 0 )
 	{
-	(void) my_snprintf( buf, BUFSIZE, "HTTP/1.0 %d %s\015\012", status, title );
-	(void) httpd_write_fully( hc->conn_fd, buf, strlen( buf ) );
-
-	/* Write the saved headers. */
-	(void) httpd_write_fully( hc->conn_fd, headers, headers_len );
-
-	/* Echo the rest of the output. */
-	for (;;)
+	/* Only cache a response that's known to be whole - as long as it
+	** said it would be, and from a FastCGI program that exited cleanly.
+	** A plain CGI's exit status isn't available here.
+	*/
+	if ( hc->cgi_app >= 0 && hc->cgi_parser.app_status != 0 )
+	    complete = 0;
+	if ( complete && hc->cgi_fill_length >= 0 )
 	    {
-	    r = read( rfd, buf, BUFSIZE );
-	    if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
-		{
-		sleep( 1 );
-		continue;
-		}
-	    if ( r <= 0 )
-		break;
-	    if ( httpd_write_fully( hc->conn_fd, buf, r ) != r )
-		break;
+	    cgicache_get(
+		hc->cgi_fill, &status, &headers, &headers_len, &body,
+		&body_len );
+	    if ( (off_t) body_len != hc->cgi_fill_length )
+		complete = 0;
 	    }
+	if ( complete )
+	    cgicache_finish( hc->cgi_fill, (struct timeval*) 0 );
+	else
+	    cgicache_abandon( hc->cgi_fill );
+	hc->cgi_fill = (void*) 0;
 	}
-#else
-    (void) my_snprintf( buf, BUFSIZE, "HTTP/1.0 %d %s\015\012", status, title );
-    (void) httpd_write_fully( hc->conn_fd, buf, strlen( buf ) );
+    hc->cgi_state = CGIS_DONE;
+    }
 
-    /* Write the saved headers. */
-    (void) httpd_write_fully( hc->conn_fd, headers, headers_len );
 
-    /* Echo the rest of the output. */
-    for (;;)
+/* Queue request body bytes for the CGI.  A len of zero marks the end. */
+static void
+cgi_queue_input( httpd_conn* hc, char* data, size_t len )
+    {
+    size_t off, n;
+
+    /* Whatever already went out can make room. */
+    if ( hc->cgi_wbuf_idx > 0 )
 	{
-	r = read( rfd, buf, BUFSIZE );
-	if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
+	hc->cgi_wbuf_len -= hc->cgi_wbuf_idx;
+	(void) memmove(
+	    hc->cgi_wbuf, &(hc->cgi_wbuf[hc->cgi_wbuf_idx]), hc->cgi_wbuf_len );
+	hc->cgi_wbuf_idx = 0;
+	}
+    if ( hc->cgi_app >= 0 )
+	{
+	if ( len == 0 )
+	    fcgi_add_record(
+		&hc->cgi_wbuf, &hc->maxcgi_wbuf, &hc->cgi_wbuf_len, FCGI_STDIN,
+		(char*) 0, 0 );
+	for ( off = 0; off < len; off += n )
 	    {
-	    sleep( 1 );
-	    continue;
+	    n = MIN( len - off, FCGI_MAX_CONTENT );
+	    fcgi_add_record(
+		&hc->cgi_wbuf, &hc->maxcgi_wbuf, &hc->cgi_wbuf_len, FCGI_STDIN,
+		&data[off], n );
 	    }
-	if ( r <= 0 )
-	    break;
-	if ( httpd_write_fully( hc->conn_fd, buf, r ) != r )
-	    break;
 	}
-#endif
-    shutdown( hc->conn_fd, SHUT_WR );
+    else if ( len > 0 )
+	{
+	httpd_realloc_str(
+	    &hc->cgi_wbuf, &hc->maxcgi_wbuf, hc->cgi_wbuf_len + len );
+	(void) memmove( &(hc->cgi_wbuf[hc->cgi_wbuf_len]), data, len );
+	hc->cgi_wbuf_len += len;
+	}
     }
 
 
-/* CGI child process. */
+/* Set up the relay, once the descriptors are ready. */
 static void
-cgi_child( httpd_conn* hc )
+cgi_start_relay( httpd_conn* hc )
     {
-    int r;
-    char** argp;
-    char** envp;
-    char* binary;
-    char* directory;
+    size_t c;
 
-    /* Unset close-on-exec flag for this socket.  This actually shouldn't
-    ** be necessary, according to POSIX a dup()'d file descriptor does
-    ** *not* inherit the close-on-exec flag, its flag is always clear.
-    ** However, Linux messes this up and does copy the flag to the
-    ** dup()'d descriptor, so we have to clear it.  This could be
-    ** ifdeffed for Linux only.
+    /* Whatever part of the request body came in with the headers can go
+    ** to the CGI right away.
     */
-    (void) fcntl( hc->conn_fd, F_SETFD, 0 );
+    hc->cgi_body_left = 0;
+    if ( hc->method == METHOD_POST && hc->contentlength != (size_t) -1 )
+	{
+	c = MIN( hc->read_idx - hc->checked_idx, hc->contentlength );
+	cgi_queue_input( hc, &(hc->read_buf[hc->checked_idx]), c );
+	hc->cgi_body_left = hc->contentlength - c;
+	}
+    if ( hc->cgi_body_left == 0 )
+	cgi_queue_input( hc, (char*) 0, 0 );
 
-    /* Close the syslog descriptor so that the CGI program can't
-    ** mess with it.  All other open descriptors should be either
-    ** the listen socket(s), sockets from accept(), or the file-logging
-    ** fd, and all of those are set to close-on-exec, so we don't
-    ** have to close anything else.
-    */
-    closelog();
-
-    /* If the socket happens to be using one of the stdin/stdout/stderr
-    ** descriptors, move it to another descriptor so that the dup2 calls
-    ** below don't screw things up.  We arbitrarily pick fd 3 - if there
-    ** was already something on it, we clobber it, but that doesn't matter
-    ** since at this point the only fd of interest is the connection.
-    ** All others will be closed on exec.
-    */
-    if ( hc->conn_fd == STDIN_FILENO || hc->conn_fd == STDOUT_FILENO || hc->conn_fd == STDERR_FILENO )
+    fcgi_parser_init( &hc->cgi_parser );
+    hc->cgi_headers_len = 0;
+    hc->cgi_state = hc->cgi_nph ? CGIS_BODY : CGIS_HEADERS;
+    hc->status = 200;
+    hc->bytes_sent = 0;
+    hc->should_linger = 0;
+    }
+
+
+static int
+cgi_start_fcgi( httpd_conn* hc )
+    {
+    char** envp;
+    int fd;
+
+    fd = fcgi_connect(
+	hc->expnfilename, &hc->hs->cgi_count, hc->hs->cgi_limit,
+	&hc->cgi_app );
+    if ( fd == -2 )
 	{
-	int newfd = dup2( hc->conn_fd, STDERR_FILENO + 1 );
-	if ( newfd >= 0 )
-	    hc->conn_fd = newfd;
-	/* If the dup2 fails, shrug.  We'll just take our chances.
-	** Shouldn't happen though.
-	*/
+	hc->cgi_state = CGIS_WAIT;
+	return 0;
+	}
+    if ( fd < 0 )
+	{
+	httpd_send_err(
+	    hc, 503, httpd_err503title, "", httpd_err503form,
+	    hc->encodedurl );
+	return -1;
 	}
+    /* Reading and writing get watched separately, so they need separate
+    ** descriptors.
+    */
+    hc->cgi_rfd = fd;
+    hc->cgi_wfd = dup( fd );
+    if ( hc->cgi_wfd < 0 )
+	{
+	syslog( LOG_ERR, "dup - %m" );
+	fcgi_release( hc->cgi_app, fd );
+	hc->cgi_rfd = -1;
+	hc->cgi_app = -1;
+	httpd_send_err(
+	    hc, 500, err500title, "", err500form, hc->encodedurl );
+	return -1;
+	}
+    hc->cgi_nph = 0;
 
-    /* Make the environment vector. */
+    hc->cgi_wbuf_len = hc->cgi_wbuf_idx = 0;
+    fcgi_add_begin_request( &hc->cgi_wbuf, &hc->maxcgi_wbuf, &hc->cgi_wbuf_len );
     envp = make_envp( hc );
+    fcgi_add_params(
+	&hc->cgi_wbuf, &hc->maxcgi_wbuf, &hc->cgi_wbuf_len, envp );
+    cgi_start_relay( hc );
+    return 0;
+    }
 
-    /* Make the argument vector. */
-    argp = make_argp( hc );
 
-    /* Set up stdin.  For POSTs we may have to set up a pipe from an
-    ** interposer process, depending on if we've read some of the data
-    ** into our buffer.
+/* How far a relayed CGI can get ahead of the other side, each way. */
+#define CGI_RELAY_BUFFER 65536
+
+int
+httpd_cgi_relay( httpd_conn* hc, size_t max_bytes, int* wfdP, int* rfdP )
+    {
+    char buf[16384];
+    ssize_t r;
+    char* bp;
+    size_t len;
+    char* data;
+    size_t data_len;
+    int pipe_full;
+#ifdef CGI_SPLICE
+    static int splice_broken = 0;
+    int avail;
+#endif /* CGI_SPLICE */
+
+    /* The request and the response move independently - a CGI may well
+    ** start writing before it has read all its input, and if we waited
+    ** for one before the other we could both end up stuck.  Each step
+    ** that gets somewhere goes back to the top; when none can, we're
+    ** done for now.
     */
-    if ( hc->method == METHOD_POST && hc->read_idx > hc->checked_idx )
+    pipe_full = 0;
+    for (;;)
 	{
-	int p[2];
+	/* Anything queued for the CGI. */
+	if ( hc->cgi_wbuf_idx < hc->cgi_wbuf_len )
+	    {
+	    r = write(
+		hc->cgi_wfd, &(hc->cgi_wbuf[hc->cgi_wbuf_idx]),
+		hc->cgi_wbuf_len - hc->cgi_wbuf_idx );
+	    if ( r < 0 && errno == EINTR )
+		continue;
+	    if ( r > 0 )
+		{
+		hc->cgi_wbuf_idx += r;
+		if ( hc->cgi_wbuf_idx == hc->cgi_wbuf_len )
+		    hc->cgi_wbuf_idx = hc->cgi_wbuf_len = 0;
+		continue;
+		}
+	    if ( r == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
+		{
+		/* The CGI isn't reading any more.  Skip the rest of the
+		** request and see what it has to say.
+		*/
+		hc->cgi_wbuf_idx = hc->cgi_wbuf_len = 0;
+		hc->cgi_body_left = 0;
+		continue;
+		}
+	    }
 
-	if ( pipe( p ) < 0 )
+	/* More of the request body, as the client sends it. */
+	if ( hc->cgi_body_left > 0 && hc->cgi_state != CGIS_DONE &&
+	     hc->cgi_wbuf_len - hc->cgi_wbuf_idx < CGI_RELAY_BUFFER )
 	    {
-	    syslog( LOG_ERR, "pipe - %m" );
-	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	    httpd_write_response( hc );
-	    exit( 1 );
+	    r = read(
+		hc->conn_fd, buf, MIN( sizeof(buf), hc->cgi_body_left ) );
+	    if ( r < 0 && errno == EINTR )
+		continue;
+	    if ( r >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
+		{
+		if ( r <= 0 )
+		    hc->cgi_body_left = 0;
+		else
+		    {
+		    cgi_queue_input( hc, buf, r );
+		    hc->cgi_body_left -= r;
+		    }
+		if ( hc->cgi_body_left == 0 )
+		    cgi_queue_input( hc, (char*) 0, 0 );
+		continue;
+		}
 	    }
-	r = fork( );
-	if ( r < 0 )
+
+	/* Once the request is all sent, the CGI sees end of file. */
+	if ( hc->cgi_wfd >= 0 && hc->cgi_body_left == 0 &&
+	     hc->cgi_wbuf_idx == hc->cgi_wbuf_len )
 	    {
-	    syslog( LOG_ERR, "fork - %m" );
-	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	    httpd_write_response( hc );
-	    exit( 1 );
+	    (void) close( hc->cgi_wfd );
+	    hc->cgi_wfd = -1;
+	    if ( hc->method == METHOD_POST )
+		post_post_garbage_hack( hc );
+	    continue;
 	    }
-	if ( r == 0 )
+
+	/* Response text for the client. */
+	if ( hc->responselen > 0 && max_bytes > 0 )
 	    {
-	    /* Interposer process. */
-	    sub_process = 1;
-	    (void) close( p[0] );
-	    cgi_interpose_input( hc, p[1] );
-	    exit( 0 );
+	    r = cgi_client_write(
+		hc, hc->response, MIN( hc->responselen, max_bytes ) );
+	    if ( r < 0 && errno == EINTR )
+		continue;
+	    if ( r > 0 )
+		{
+		hc->responselen -= r;
+		(void) memmove(
+		    hc->response, &(hc->response[r]), hc->responselen );
+		max_bytes -= r;
+		continue;
+		}
+	    if ( r == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
+		{
+		/* The client went away. */
+		hc->responselen = 0;
+		httpd_cgi_close( hc );
+		return CR_DONE;
+		}
 	    }
-	/* Need to schedule a kill for process r; but in the main process! */
-	(void) close( p[1] );
-	if ( p[0] != STDIN_FILENO )
+	if ( hc->cgi_state == CGIS_DONE )
 	    {
-	    (void) dup2( p[0], STDIN_FILENO );
-	    (void) close( p[0] );
+	    if ( hc->responselen > 0 )
+		break;
+#ifdef USE_SCTP
+	    if ( hc->is_sctp )
+		(void) httpd_write_sctp(
+		    hc->conn_fd, "", 0, hc->use_eeor, 1, HTTP_OVER_SCTP_PPID, 0 );
+#endif
+	    httpd_cgi_close( hc );
+	    return CR_DONE;
 	    }
-	}
-    else
-	{
-	/* Otherwise, the request socket is stdin. */
-	if ( hc->conn_fd != STDIN_FILENO )
-	    (void) dup2( hc->conn_fd, STDIN_FILENO );
-	}
 
-    /* Set up stdout/stderr.  If we're doing CGI header parsing,
-    ** we need an output interposer too.
-    */
-    if ( strncmp( argp[0], "nph-", 4 ) != 0 && hc->mime_flag )
-	{
-	int p[2];
+	/* Don't get too far ahead of the client. */
+	if ( hc->responselen >= CGI_RELAY_BUFFER )
+	    break;
 
-	if ( pipe( p ) < 0 )
+#ifdef CGI_SPLICE
+	/* Once past the headers, a pipe's contents can go straight to the
+	** socket without a trip through user space.
+	*/
+	if ( hc->cgi_state == CGIS_BODY && hc->cgi_app < 0 && ! splice_broken
+	     && hc->cgi_fill == (void*) 0 && hc->responselen == 0
+	     && max_bytes > 0
+#ifdef USE_SCTP
+	     && ! hc->is_sctp
+#endif
+	     )
 	    {
-	    syslog( LOG_ERR, "pipe - %m" );
-	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	    httpd_write_response( hc );
-	    exit( 1 );
+	    r = splice(
+		hc->cgi_rfd, (loff_t*) 0, hc->conn_fd, (loff_t*) 0,
+		MIN( max_bytes, 65536 ), SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	    if ( r < 0 && errno == EINTR )
+		continue;
+	    if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		{
+		/* Either side could be the holdup. */
+		if ( ioctl( hc->cgi_rfd, FIONREAD, &avail ) == 0 && avail > 0 )
+		    pipe_full = 1;
+		break;
+		}
+	    if ( r < 0 && ( errno == EINVAL || errno == ENOSYS ) )
+		{
+		/* Not supported here, don't try again. */
+		splice_broken = 1;
+		continue;
+		}
+	    if ( r < 0 )
+		{
+		/* The client went away. */
+		httpd_cgi_close( hc );
+		return CR_DONE;
+		}
+	    if ( r == 0 )
+		{
+		cgi_relay_eof( hc );
+		continue;
+		}
+	    hc->bytes_sent += r;
+	    max_bytes -= r;
+	    continue;
 	    }
-	r = fork( );
-	if ( r < 0 )
+#endif /* CGI_SPLICE */
+
+	r = read(
+	    hc->cgi_rfd, buf,
+	    MIN( sizeof(buf), CGI_RELAY_BUFFER - hc->responselen ) );
+	if ( r < 0 && errno == EINTR )
+	    continue;
+	if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+	    break;
+	if ( r <= 0 )
 	    {
-	    syslog( LOG_ERR, "fork - %m" );
-	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	    httpd_write_response( hc );
-	    exit( 1 );
+	    cgi_relay_eof( hc );
+	    continue;
 	    }
-	if ( r == 0 )
+	if ( hc->cgi_app < 0 )
+	    {
+	    cgi_relay_output( hc, buf, r );
+	    continue;
+	    }
+	bp = buf;
+	len = r;
+	while ( hc->cgi_state != CGIS_DONE )
 	    {
-	    /* Interposer process. */
-	    sub_process = 1;
-	    (void) close( p[1] );
-	    cgi_interpose_output( hc, p[0] );
-	    exit( 0 );
+	    switch ( fcgi_parse( &hc->cgi_parser, &bp, &len, &data, &data_len ) )
+		{
+		case FP_STDOUT:
+		cgi_relay_output( hc, data, data_len );
+		continue;
+		case FP_STDERR:
+		syslog(
+		    LOG_NOTICE, "CGI %.80s stderr: %.*s", hc->expnfilename,
+		    (int) MIN( data_len, 500 ), data );
+		continue;
+		case FP_END:
+		cgi_relay_eof( hc );
+		continue;
+		}
+	    break;
 	    }
-	/* Need to schedule a kill for process r; but in the main process! */
-	(void) close( p[0] );
-	if ( p[1] != STDOUT_FILENO )
-	    (void) dup2( p[1], STDOUT_FILENO );
-	if ( p[1] != STDERR_FILENO )
-	    (void) dup2( p[1], STDERR_FILENO );
-	if ( p[1] != STDOUT_FILENO && p[1] != STDERR_FILENO )
-	    (void) close( p[1] );
 	}
-    else
-	{
-	/* Otherwise, the request socket is stdout/stderr. */
-	if ( hc->conn_fd != STDOUT_FILENO )
-	    (void) dup2( hc->conn_fd, STDOUT_FILENO );
-	if ( hc->conn_fd != STDERR_FILENO )
-	    (void) dup2( hc->conn_fd, STDERR_FILENO );
-	}
-
-    /* At this point we would like to set close-on-exec again for hc->conn_fd
-    ** (see previous comments on Linux's broken behavior re: close-on-exec
-    ** and dup.)  Unfortunately there seems to be another Linux problem, or
-    ** perhaps a different aspect of the same problem - if we do this
-    ** close-on-exec in Linux, the socket stays open but stderr gets
-    ** closed - the last fd duped from the socket.  What a mess.  So we'll
-    ** just leave the socket as is, which under other OSs means an extra
-    ** file descriptor gets passed to the child process.  Since the child
-    ** probably already has that file open via stdin stdout and/or stderr,
-    ** this is not a problem.
-    */
-    /* (void) fcntl( hc->conn_fd, F_SETFD, 1 ); */
-
-#ifdef CGI_NICE
-    /* Set priority. */
-    (void) nice( CGI_NICE );
-#endif /* CGI_NICE */
 
-    /* Split the program into directory and binary, so we can chdir()
-    ** to the program's own directory.  This isn't in the CGI 1.1
-    ** spec, but it's what other HTTP servers do.
-    */
-    directory = strdup( hc->expnfilename );
-    if ( directory == (char*) 0 )
-	binary = hc->expnfilename;      /* ignore errors */
+    /* Stuck.  Say what would get things moving again. */
+    if ( hc->cgi_wbuf_idx < hc->cgi_wbuf_len )
+	*wfdP = hc->cgi_wfd;
+    else
+	*wfdP = -1;
+    if ( hc->cgi_state != CGIS_DONE && ! pipe_full &&
+	 hc->responselen < CGI_RELAY_BUFFER )
+	*rfdP = hc->cgi_rfd;
     else
+	*rfdP = -1;
+    if ( hc->cgi_body_left > 0 && hc->cgi_state != CGIS_DONE &&
+	 hc->cgi_wbuf_len - hc->cgi_wbuf_idx < CGI_RELAY_BUFFER )
+	return CR_WANT_READ;
+    if ( hc->responselen > 0 || pipe_full )
+	return CR_WANT_WRITE;
+    return CR_WANT_NONE;
+    }
+
+void
+httpd_cgi_close( httpd_conn* hc )
+    {
+    if ( hc->cgi_fill != (void*) 0 )
 	{
-	binary = strrchr( directory, '/' );
-	if ( binary == (char*) 0 )
-	    binary = hc->expnfilename;
-	else
-	    {
-	    *binary++ = '\0';
-	    (void) chdir( directory );  /* ignore errors */
-	    }
+	/* It didn't get to the end, so there's nothing to cache. */
+	cgicache_abandon( hc->cgi_fill );
+	hc->cgi_fill = (void*) 0;
 	}
+    if ( hc->cgi_state == CGIS_NONE )
+	return;
+    if ( hc->cgi_wfd >= 0 )
+	(void) close( hc->cgi_wfd );
+    if ( hc->cgi_app >= 0 )
+	fcgi_release( hc->cgi_app, hc->cgi_rfd );
+    else if ( hc->cgi_rfd >= 0 )
+	(void) close( hc->cgi_rfd );
+    hc->cgi_rfd = hc->cgi_wfd = -1;
+    hc->cgi_app = -1;
+    hc->cgi_state = CGIS_NONE;
+    }
 
-    /* Default behavior for SIGPIPE. */
-#ifdef HAVE_SIGSET
-    (void) sigset( SIGPIPE, SIG_DFL );
-#else /* HAVE_SIGSET */
-    (void) signal( SIGPIPE, SIG_DFL );
-#endif /* HAVE_SIGSET */
 
-    /* Run the program. */
-    (void) execve( binary, argp, envp );
+#ifdef CGI_CACHE_SIZE
+/* Looks a CGI request up in the response cache.  Returns 1 if that took
+** care of it, either with a response from the cache, sent like a file,
+** or by leaving it in CGIS_CACHEWAIT until the request that's already
+** running the CGI finishes.  Returns 0 if the CGI should be run; if
+** hc->cgi_fill got set, its response may be cacheable.
+*/
+static int
+cgi_cache_lookup( httpd_conn* hc )
+    {
+    char* key;
+    size_t maxkey = 0;
+    void* entry;
+    char* headers;
+    size_t headers_len;
+    char* body;
+    size_t body_len;
+
+    /* Only plain GETs get cached, not ones with credentials. */
+    if ( hc->method != METHOD_GET || ! hc->mime_flag ||
+	 hc->authorization[0] != '\0' )
+	return 0;
+
+    arena_str(
+	&hc->arena, &key, &maxkey,
+	strlen( hc->expnfilename ) + strlen( hc->pathinfo ) +
+	strlen( hc->query ) + 3 );
+    (void) my_snprintf(
+	key, maxkey, "%s\012%s\012%s", hc->expnfilename, hc->pathinfo,
+	hc->query );
+    switch ( cgicache_lookup( key, (struct timeval*) 0, &entry ) )
+	{
+	case CGC_HIT:
+	cgicache_get(
+	    entry, &hc->status, &headers, &headers_len, &body, &body_len );
+	add_response_len( hc, headers, headers_len );
+	hc->cgi_hit = entry;
+	hc->file_address = body;
+	hc->bytes_to_send = body_len;
+	hc->got_range = 0;
+	return 1;
 
-    /* Something went wrong. */
-    syslog( LOG_ERR, "execve %.80s - %m", hc->expnfilename );
-    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-    httpd_write_response( hc );
-    _exit( 1 );
+	case CGC_BUSY:
+	hc->cgi_state = CGIS_CACHEWAIT;
+	return 1;
+
+	case CGC_MISS:
+	hc->cgi_fill = entry;
+	return 0;
+	}
+    return 0;
     }
+#endif /* CGI_CACHE_SIZE */
 
 
 static int
@@ -4154,35 +5625,84 @@ cgi( httpd_conn* hc )
     {
     int r;
     ClientData client_data;
+    int ip[2], op[2];
+    char* cp;
 
     if ( hc->method == METHOD_GET || hc->method == METHOD_POST )
 	{
-	if ( hc->hs->cgi_limit != 0 && hc->hs->cgi_count >= hc->hs->cgi_limit )
+	hc->cgi_state = CGIS_NONE;
+#ifdef CGI_CACHE_SIZE
+	if ( cgi_cache_lookup( hc ) )
+	    return 0;
+#endif /* CGI_CACHE_SIZE */
+
+	/* Persistent workers don't fork here, and fcgi_connect() checks
+	** the CGI limit itself when it needs a new one.
+	*/
+	if ( hc->hs->fcgi_pattern != (char*) 0 &&
+	     match( hc->hs->fcgi_pattern, hc->expnfilename ) )
+	    {
+	    r = cgi_start_fcgi( hc );
+	    if ( hc->cgi_state != CGIS_WAIT )
+		return r;
+	    }
+	else if ( hc->hs->cgi_limit != 0 &&
+		  hc->hs->cgi_count >= hc->hs->cgi_limit )
+	    hc->cgi_state = CGIS_WAIT;
+
+	/* If too many are running, let the caller decide whether the
+	** request waits or gets a 503.  A waiting request mustn't hold up
+	** others for the same cache entry.
+	*/
+	if ( hc->cgi_state == CGIS_WAIT )
+	    {
+	    if ( hc->cgi_fill != (void*) 0 )
+		{
+		cgicache_abandon( hc->cgi_fill );
+		hc->cgi_fill = (void*) 0;
+		}
+	    return 0;
+	    }
+
+	/* The CGI's output comes back through a pipe, and so does the
+	** request body if there is one.
+	*/
+	if ( pipe( op ) < 0 )
 	    {
+	    syslog( LOG_ERR, "pipe - %m" );
 	    httpd_send_err(
-		hc, 503, httpd_err503title, "", httpd_err503form,
-		hc->encodedurl );
+		hc, 500, err500title, "", err500form, hc->encodedurl );
 	    return -1;
 	    }
-	++hc->hs->cgi_count;
-	httpd_clear_ndelay( hc->conn_fd );
-	r = fork( );
-	if ( r < 0 )
+	ip[0] = ip[1] = -1;
+	if ( hc->method == METHOD_POST && pipe( ip ) < 0 )
 	    {
-	    syslog( LOG_ERR, "fork - %m" );
+	    syslog( LOG_ERR, "pipe - %m" );
+	    (void) close( op[0] );
+	    (void) close( op[1] );
 	    httpd_send_err(
 		hc, 500, err500title, "", err500form, hc->encodedurl );
 	    return -1;
 	    }
-	if ( r == 0 )
+	op[0] = cgi_fd_setup( op[0] );
+	op[1] = cgi_fd_setup( op[1] );
+	ip[0] = cgi_fd_setup( ip[0] );
+	ip[1] = cgi_fd_setup( ip[1] );
+	r = cgi_spawn( hc, ip[0], op[1] );
+	if ( r < 0 )
 	    {
-	    /* Child process. */
-	    sub_process = 1;
-	    httpd_unlisten( hc->hs );
-	    cgi_child( hc );
+	    (void) close( op[0] );
+	    (void) close( op[1] );
+	    if ( ip[0] >= 0 )
+		{
+		(void) close( ip[0] );
+		(void) close( ip[1] );
+		}
+	    httpd_send_err(
+		hc, 500, err500title, "", err500form, hc->encodedurl );
+	    return -1;
 	    }
-
-	/* Parent process. */
+	++hc->hs->cgi_count;
 	syslog( LOG_DEBUG, "spawned CGI process %d for file '%.200s'", r, hc->expnfilename );
 #ifdef CGI_TIMELIMIT
 	/* Schedule a kill for the child process, in case it runs too long */
@@ -4193,9 +5713,30 @@ cgi( httpd_conn* hc )
 	    exit( 1 );
 	    }
 #endif /* CGI_TIMELIMIT */
-	hc->status = 200;
-	hc->bytes_sent = CGI_BYTECOUNT;
-	hc->should_linger = 0;
+	(void) close( op[1] );
+	httpd_set_ndelay( op[0] );
+	hc->cgi_rfd = op[0];
+	if ( ip[0] >= 0 )
+	    {
+	    (void) close( ip[0] );
+	    httpd_set_ndelay( ip[1] );
+	    }
+	hc->cgi_wfd = ip[1];
+	hc->cgi_app = -1;
+
+	/* Non-parsed-header CGIs, and old HTTP/0.9 requests, get the
+	** output passed along as is.
+	*/
+	cp = strrchr( hc->expnfilename, '/' );
+	cp = ( cp == (char*) 0 ) ? hc->expnfilename : cp + 1;
+	hc->cgi_nph = ( strncmp( cp, "nph-", 4 ) == 0 || ! hc->mime_flag );
+	if ( hc->cgi_nph && hc->cgi_fill != (void*) 0 )
+	    {
+	    cgicache_uncacheable( hc->cgi_fill, (struct timeval*) 0 );
+	    hc->cgi_fill = (void*) 0;
+	    }
+	hc->cgi_wbuf_len = hc->cgi_wbuf_idx = 0;
+	cgi_start_relay( hc );
 	}
     else
 	{
@@ -4208,16 +5749,23 @@ cgi( httpd_conn* hc )
     }
 
 
+int
+httpd_start_cgi( httpd_conn* hc )
+    {
+    return cgi( hc );
+    }
+
+
 static int
 really_start_request( httpd_conn* hc, struct timeval* nowP )
     {
-    static char* indexname;
-    static size_t maxindexname = 0;
+    char* indexname;
+    size_t maxindexname = 0;
     static const char* index_names[] = { INDEX_NAMES };
-    int i;
+    int i, r;
 #ifdef AUTH_FILE
-    static char* dirname;
-    static size_t maxdirname = 0;
+    char* dirname;
+    size_t maxdirname = 0;
 #endif /* AUTH_FILE */
     size_t expnlen, indxlen;
     char* cp;
@@ -4233,8 +5781,8 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	return -1;
 	}
 
-    /* Stat the file. */
-    if ( stat( hc->expnfilename, &hc->sb ) < 0 )
+    /* Stat the file, unless it got opened during path resolution. */
+    if ( hc->file_fd < 0 && stat( hc->expnfilename, &hc->sb ) < 0 )
 	{
 	httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 	return -1;
@@ -4281,10 +5829,11 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	    }
 
 	/* Check for an index file. */
+	close_file( hc );
 	for ( i = 0; i < sizeof(index_names) / sizeof(char*); ++i )
 	    {
-	    httpd_realloc_str(
-		&indexname, &maxindexname,
+	    arena_str(
+		&hc->arena, &indexname, &maxindexname,
 		expnlen + 1 + strlen( index_names[i] ) );
 	    (void) strcpy( indexname, hc->expnfilename );
 	    indxlen = strlen( indexname );
@@ -4293,7 +5842,10 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	    if ( strcmp( indexname, "./" ) == 0 )
 		indexname[0] = '\0';
 	    (void) strcat( indexname, index_names[i] );
-	    if ( stat( indexname, &hc->sb ) >= 0 )
+	    r = open_beneath( hc, indexname );
+	    if ( r == 1 )
+		goto got_one;
+	    if ( r == -1 && stat( indexname, &hc->sb ) >= 0 )
 		goto got_one;
 	    }
 
@@ -4334,17 +5886,23 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 #endif /* GENERATE_INDEXES */
 
 	got_one: ;
-	/* Got an index file.  Expand symlinks again.  More pathinfo means
-	** something went wrong.
+	/* Got an index file.  Expand symlinks again, unless open_beneath()
+	** already found there weren't any.  More pathinfo means something
+	** went wrong.
 	*/
-	cp = expand_symlinks( indexname, &pi, hc->hs->no_symlink_check, hc->tildemapped );
-	if ( cp == (char*) 0 || pi[0] != '\0' )
+	if ( hc->file_fd >= 0 )
+	    cp = indexname;
+	else
 	    {
-	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	    return -1;
+	    cp = expand_symlinks( &hc->arena, indexname, &pi, hc->hs->no_symlink_check, hc->tildemapped );
+	    if ( cp == (char*) 0 || pi[0] != '\0' )
+		{
+		httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+		return -1;
+		}
 	    }
 	expnlen = strlen( cp );
-	httpd_realloc_str( &hc->expnfilename, &hc->maxexpnfilename, expnlen );
+	arena_str( &hc->arena, &hc->expnfilename, &hc->maxexpnfilename, expnlen );
 	(void) strcpy( hc->expnfilename, cp );
 
 	/* Now, is the index version world-readable or world-executable? */
@@ -4364,7 +5922,7 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 
 #ifdef AUTH_FILE
     /* Check authorization for this directory. */
-    httpd_realloc_str( &dirname, &maxdirname, expnlen );
+    arena_str( &hc->arena, &dirname, &maxdirname, expnlen );
     (void) strcpy( dirname, hc->expnfilename );
     cp = strrchr( dirname, '/' );
     if ( cp == (char*) 0 )
@@ -4414,7 +5972,10 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
     if ( hc->hs->cgi_pattern != (char*) 0 &&
 	 ( hc->sb.st_mode & S_IXOTH ) &&
 	 match( hc->hs->cgi_pattern, hc->expnfilename ) )
+	{
+	close_file( hc );
 	return cgi( hc );
+	}
 
     /* It's not CGI.  If it's executable or there's pathinfo, someone's
     ** trying to either serve or run a non-CGI file as CGI.   Either case
@@ -4465,7 +6026,9 @@ really_start_request( httpd_conn* hc, struct timeval* nowP )
 	}
     else
 	{
-	hc->file_address = mmc_map( hc->expnfilename, &(hc->sb), nowP );
+	hc->file_address = mmc_map(
+	    hc->expnfilename, hc->file_fd, &(hc->sb), nowP );
+	close_file( hc );
 	if ( hc->file_address == (char*) 0 )
 	    {
 	    httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
@@ -4649,8 +6212,8 @@ really_check_referrer( httpd_conn* hc )
     char* cp1;
     char* cp2;
     char* cp3;
-    static char* refhost = (char*) 0;
-    static size_t refhost_size = 0;
+    char* refhost;
+    size_t refhost_size = 0;
     char *lp;
 
     hs = hc->hs;
@@ -4670,7 +6233,7 @@ really_check_referrer( httpd_conn* hc )
     cp1 += 2;
     for ( cp2 = cp1; *cp2 != '/' && *cp2 != ':' && *cp2 != '\0'; ++cp2 )
 	continue;
-    httpd_realloc_str( &refhost, &refhost_size, cp2 - cp1 );
+    arena_str( &hc->arena, &refhost, &refhost_size, cp2 - cp1 );
     for ( cp3 = refhost; cp1 < cp2; ++cp1, ++cp3 )
 	if ( isupper(*cp1) )
 	    *cp3 = tolower(*cp1);
@@ -5006,4 +6569,31 @@ httpd_logstats( long secs )
 	    "  libhttpd - %d strings allocated, %lu bytes (%g bytes/str)",
 	    str_alloc_count, (unsigned long) str_alloc_size,
 	    (float) str_alloc_size / str_alloc_count );
+#ifdef TILDE_MAP_2
+    syslog( LOG_NOTICE,
+	"  libhttpd - %d tilde users cached, %ld hits (%g/sec), %ld misses",
+	tilde_count, tilde_hits, (float) tilde_hits / secs, tilde_misses );
+    tilde_hits = tilde_misses = 0;
+#endif /* TILDE_MAP_2 */
+    if ( vhost_table != (vhost_entry**) 0 )
+	{
+	vhost_entry* vh;
+	int i;
+
+	syslog( LOG_NOTICE,
+	    "  libhttpd - %d virtual hosts, %ld requests for unknown hosts",
+	    vhost_count, vhost_unknown );
+	for ( i = 0; i < vhost_table_size; ++i )
+	    for ( vh = vhost_table[i]; vh != (vhost_entry*) 0; vh = vh->next )
+		if ( vh->requests > 0 )
+		    {
+		    syslog( LOG_NOTICE,
+			"    vhost %.80s - %ld requests, %lld bytes (%g bytes/sec)",
+			vh->hostname, vh->requests, (long long) vh->bytes,
+			(float) vh->bytes / secs );
+		    vh->requests = 0;
+		    vh->bytes = 0;
+		    }
+	vhost_unknown = 0;
+	}
     }
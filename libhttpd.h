@@ -40,6 +40,9 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "arena.h"
+#include "fcgi.h"
+
 #if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
 #define USE_IPV6
 #endif
@@ -81,6 +84,7 @@ typedef struct {
     unsigned short port;
     char* cgi_pattern;
     int cgi_limit, cgi_count;
+    char* fcgi_pattern;
     char* charset;
     char* p3p;
     int max_age;
@@ -101,20 +105,37 @@ typedef struct {
     int no_empty_referrers;
     } httpd_server;
 
-/* A connection. */
+/* A connection.  The fields the main loop touches on every read or write
+** event come first, so they share a cache line or two; the parsed request,
+** the stat buffer and the client address, which get looked at once or
+** twice per request, come after.
+*/
 typedef struct {
-    int initialized;
-    httpd_server* hs;
-    httpd_sockaddr client_addr;
+    int conn_fd;
+    int checked_state;
     char* read_buf;
     size_t read_size, read_idx, checked_idx;
-    int checked_state;
-    int method;
-    int status;
+    char* response;
+    size_t responselen;
+    char* file_address;
     off_t bytes_to_send;
     off_t bytes_sent;
+    int cgi_state;	/* relayed CGI, see httpd_cgi_relay() */
+    int status;
+#ifdef USE_SCTP
+    int is_sctp;
+    int use_eeor;
+    size_t send_at_once_limit;
+    unsigned int no_i_streams;
+    unsigned int no_o_streams;
+#endif
+    httpd_server* hs;
+
+    /* Colder request data. */
+    int initialized;
+    int method;
+    Arena arena;	/* per-request strings, reset for each connection */
     char* encodedurl;
-    char* decodedurl;
     char* protocol;
     char* origfilename;
     char* expnfilename;
@@ -124,7 +145,9 @@ typedef struct {
     char* referrer;
     char* useragent;
     char* accept;
+    char* acceptbuf;	/* for merging repeated Accept: headers */
     char* accepte;
+    char* acceptebuf;
     char* acceptl;
     char* cookie;
     char* contenttype;
@@ -133,15 +156,12 @@ typedef struct {
     char* hostdir;
     char* authorization;
     char* remoteuser;
-    char* response;
-    size_t maxdecodedurl, maxorigfilename, maxexpnfilename, maxencodings,
-	maxpathinfo, maxquery, maxaccept, maxaccepte, maxreqhost, maxhostdir,
-	maxremoteuser, maxresponse;
+    size_t maxorigfilename, maxexpnfilename, maxencodings, maxpathinfo,
+	maxacceptbuf, maxacceptebuf, maxhostdir, maxremoteuser, maxresponse;
 #ifdef TILDE_MAP_2
     char* altdir;
     size_t maxaltdir;
 #endif /* TILDE_MAP_2 */
-    size_t responselen;
     time_t if_modified_since, range_if;
     size_t contentlength;
     char* type;		/* not malloc()ed */
@@ -153,16 +173,21 @@ typedef struct {
     off_t first_byte_index, last_byte_index;
     int keep_alive;
     int should_linger;
+    int file_fd;	/* file opened during path resolution, or -1 */
+    int cgi_rfd, cgi_wfd;
+    int cgi_app;	/* FastCGI app handle, or -1 */
+    int cgi_nph;	/* output goes to the client as is */
+    char* cgi_wbuf;
+    size_t maxcgi_wbuf, cgi_wbuf_len, cgi_wbuf_idx;
+    char* cgi_headers;
+    size_t maxcgi_headers, cgi_headers_len;
+    size_t cgi_body_left;
+    fcgi_parser cgi_parser;
+    void* cgi_fill;	/* CGI cache entry this response is filling */
+    off_t cgi_fill_length;	/* its promised Content-Length, or -1 */
+    void* cgi_hit;	/* CGI cache entry file_address points into */
     struct stat sb;
-    int conn_fd;
-#ifdef USE_SCTP
-    int is_sctp;
-    unsigned int no_i_streams;
-    unsigned int no_o_streams;
-    size_t send_at_once_limit;
-    int use_eeor;
-#endif
-    char* file_address;
+    httpd_sockaddr client_addr;
     } httpd_conn;
 
 /* Methods. */
@@ -188,6 +213,14 @@ typedef struct {
 #define CHST_CRLFCR 10
 #define CHST_BOGUS 11
 
+/* States for cgi_state. */
+#define CGIS_NONE 0
+#define CGIS_HEADERS 2
+#define CGIS_BODY 3
+#define CGIS_DONE 4
+#define CGIS_WAIT 5	/* over the CGI limit, see httpd_start_cgi() */
+#define CGIS_CACHEWAIT 6	/* response being cached by another request */
+
 
 /* Initializes.  Does the socket(), bind(), and listen().   Returns an
 ** httpd_server* which includes a socket fd that you can select() on.
@@ -195,7 +228,8 @@ typedef struct {
 */
 httpd_server* httpd_initialize(
     char* hostname, httpd_sockaddr* sa4P, httpd_sockaddr* sa6P,
-    unsigned short port, char* cgi_pattern, int cgi_limit, char* charset,
+    unsigned short port, char* cgi_pattern, int cgi_limit,
+    char* fcgi_pattern, char* charset,
     char* p3p, int max_age, char* cwd, int no_log, FILE* logfp,
 #ifdef TCP_FASTOPEN
     int fastopen,
@@ -213,24 +247,51 @@ void httpd_set_logfp( httpd_server* hs, FILE* logfp );
 /* Call to unlisten/close socket(s) listening for new connections. */
 void httpd_unlisten( httpd_server* hs );
 
+/* Load extra MIME types from a file in the same format as mime_types.txt.
+** They take precedence over the built-in ones.  This can be called before
+** httpd_initialize(), e.g. to read the file before chroot().  Returns -1
+** on errors.
+*/
+int httpd_load_mime_types( char* filename );
+
+/* Rescan the web directory for virtual host subdirectories. */
+void httpd_vhost_reload( httpd_server* hs );
+
+/* Refresh the ~user directory cache.  This should be called
+** periodically, say every couple of minutes.
+*/
+void httpd_tilde_cleanup( struct timeval* nowP );
+
 /* Call to shut down. */
 void httpd_terminate( httpd_server* hs );
 
 
 /* When a listen fd is ready to read, call this.  It does the accept() and
 ** returns an httpd_conn* which includes the fd to read the request from and
-** write the response to.  Returns an indication of whether the accept()
-** failed, succeeded, or if there were no more connections to accept.
+** write the response to.  The fd is already non-blocking and close-on-exec.
+** Returns an indication of whether the accept() failed, succeeded, or if
+** there were no more connections to accept.  A client that is over its
+** clientlimit_admit() limits gets closed right away, with GC_REFUSED.
+** If you have the current time, pass it in, otherwise pass 0.
 **
 ** In order to minimize malloc()s, the caller passes in the httpd_conn.
 ** The caller is also responsible for setting initialized to zero before the
 ** first call using each different httpd_conn.
 */
 int httpd_get_conn(
-    httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp );
+    httpd_server* hs, int listen_fd, httpd_conn* hc, int is_sctp,
+    struct timeval* nowP );
 #define GC_FAIL 0
 #define GC_OK 1
 #define GC_NO_MORE 2
+#define GC_REFUSED 3
+
+/* Like httpd_get_conn(), but for when the server is too busy to take the
+** connection.  It gets accepted, sent a canned 503 with a Retry-After of
+** the given number of seconds, and closed, all without blocking and
+** without an httpd_conn.  Returns GC_OK, GC_FAIL or GC_NO_MORE.
+*/
+int httpd_shed_conn( int listen_fd, int retry_after );
 
 /* Checks whether the data in hc->read_buf constitutes a complete request
 ** yet.  The caller reads data into hc->read_buf[hc->read_idx] and advances
@@ -261,6 +322,37 @@ int httpd_parse_request( httpd_conn* hc );
 */
 int httpd_start_request( httpd_conn* hc, struct timeval* nowP );
 
+/* Moves data for a relayed CGI, one that httpd_start_request() left
+** with hc->cgi_state != CGIS_NONE.  Call it when the request starts and
+** then whenever any of the descriptors it asked for is ready.  At most
+** max_bytes get sent to the client per call, for throttling;
+** hc->bytes_sent keeps the running total.  Returns CR_DONE when the
+** response is complete.  Otherwise returns what to wait for on the
+** client connection - CR_WANT_READ, CR_WANT_WRITE, or CR_WANT_NONE -
+** and sets *wfdP and *rfdP to the CGI descriptors to wait on for writing
+** and reading, or -1.
+*/
+int httpd_cgi_relay( httpd_conn* hc, size_t max_bytes, int* wfdP, int* rfdP );
+#define CR_WANT_READ 0
+#define CR_WANT_WRITE 1
+#define CR_DONE 2
+#define CR_WANT_NONE 3
+
+/* Starts a CGI that httpd_start_request() couldn't start because
+** hs->cgi_limit were already running; it left hc->cgi_state at
+** CGIS_WAIT and queued no response, so the caller can hold the
+** connection and try again here once a CGI finishes.  Afterwards
+** cgi_state is CGIS_WAIT again if there's still no room.
+**
+** Returns -1 on error.
+*/
+int httpd_start_cgi( httpd_conn* hc );
+
+/* Closes the descriptors of a relayed CGI.  httpd_close_conn() does this
+** too, but calling it as soon as the relay is done frees up the CGI.
+*/
+void httpd_cgi_close( httpd_conn* hc );
+
 /* Actually sends any buffered response text. */
 void httpd_write_response( httpd_conn* hc );
 
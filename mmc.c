@@ -112,16 +112,24 @@ static unsigned int hash( ino_t ino, dev_t dev, off_t size, time_t ct );
 
 
 void*
-mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
+mmc_map( char* filename, int fd, struct stat* sbP, struct timeval* nowP )
     {
     time_t now;
     struct stat sb;
     Map* m;
-    int fd;
+    int given_fd = ( fd >= 0 );
 
     /* Stat the file, if necessary. */
     if ( sbP != (struct stat*) 0 )
 	sb = *sbP;
+    else if ( given_fd )
+	{
+	if ( fstat( fd, &sb ) != 0 )
+	    {
+	    syslog( LOG_ERR, "fstat - %m" );
+	    return (void*) 0;
+	    }
+	}
     else
 	{
 	if ( stat( filename, &sb ) != 0 )
@@ -152,12 +160,15 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	return m->addr;
 	}
 
-    /* Open the file. */
-    fd = open( filename, O_RDONLY );
-    if ( fd < 0 )
+    /* Open the file, if necessary. */
+    if ( ! given_fd )
 	{
-	syslog( LOG_ERR, "open - %m" );
-	return (void*) 0;
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+	    {
+	    syslog( LOG_ERR, "open - %m" );
+	    return (void*) 0;
+	    }
 	}
 
     /* Find a free Map entry or make a new one. */
@@ -172,7 +183,8 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	m = (Map*) malloc( sizeof(Map) );
 	if ( m == (Map*) 0 )
 	    {
-	    (void) close( fd );
+	    if ( ! given_fd )
+		(void) close( fd );
 	    syslog( LOG_ERR, "out of memory allocating a Map" );
 	    return (void*) 0;
 	    }
@@ -209,7 +221,8 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	if ( m->addr == (void*) -1 )
 	    {
 	    syslog( LOG_ERR, "mmap - %m" );
-	    (void) close( fd );
+	    if ( ! given_fd )
+		(void) close( fd );
 	    free( (void*) m );
 	    --alloc_count;
 	    return (void*) 0;
@@ -228,7 +241,8 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	if ( m->addr == (void*) 0 )
 	    {
 	    syslog( LOG_ERR, "out of memory storing a file" );
-	    (void) close( fd );
+	    if ( ! given_fd )
+		(void) close( fd );
 	    free( (void*) m );
 	    --alloc_count;
 	    return (void*) 0;
@@ -236,14 +250,16 @@ mmc_map( char* filename, struct stat* sbP, struct timeval* nowP )
 	if ( httpd_read_fully( fd, m->addr, size_size ) != size_size )
 	    {
 	    syslog( LOG_ERR, "read - %m" );
-	    (void) close( fd );
+	    if ( ! given_fd )
+		(void) close( fd );
 	    free( (void*) m );
 	    --alloc_count;
 	    return (void*) 0;
 	    }
 #endif /* HAVE_MMAP */
 	}
-    (void) close( fd );
+    if ( ! given_fd )
+	(void) close( fd );
 
     /* Put the Map into the hash table. */
     if ( add_hash( m ) < 0 )
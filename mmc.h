@@ -29,10 +29,12 @@
 #define _MMC_H_
 
 /* Returns an mmap()ed area for the given file, or (void*) 0 on errors.
+** If you already have the file open, pass in the descriptor, otherwise
+** pass -1; mmc never closes a descriptor it didn't open itself.
 ** If you have a stat buffer on the file, pass it in, otherwise pass 0.
 ** Same for the current time.
 */
-void* mmc_map( char* filename, struct stat* sbP, struct timeval* nowP );
+void* mmc_map( char* filename, int fd, struct stat* sbP, struct timeval* nowP );
 
 /* Done with an mmap()ed area that was returned by mmc_map().
 ** If you have a stat buffer on the file, pass it in, otherwise pass 0.
@@ -55,6 +55,11 @@
 #include <unistd.h>
 
 #include "fdwatch.h"
+#include "fcgi.h"
+#include "cgicache.h"
+#include "authcache.h"
+#include "clientlimit.h"
+#include "arena.h"
 #include "libhttpd.h"
 #include "mmc.h"
 #include "timers.h"
@@ -77,17 +82,23 @@ static char* data_dir;
 static int do_chroot, no_log, no_symlink_check, do_vhost, do_global_passwd;
 static char* cgi_pattern;
 static int cgi_limit;
+static char* fcgi_pattern;
 static char* url_pattern;
 static int no_empty_referrers;
 static char* local_pattern;
 static char* logfile;
 static char* throttlefile;
+static char* mimetypesfile;
 static char* hostname;
 static char* pidfile;
 static char* user;
 static char* charset;
 static char* p3p;
 static int max_age;
+static int read_timeout, send_timeout, linger_time;
+static int client_conns, client_rate, client_burst;
+static int shed_lag, stop_lag;
+static int rate_window, min_read_bytes, min_send_bytes;
 #ifdef TCP_FASTOPEN
 static int fastopen;
 #endif
@@ -96,12 +107,24 @@ static size_t send_at_once_limit;
 static int use_eeor;
 #endif
 
+/* A token bucket.  The tokens are bytes; they build up at the owner's
+** rate, to at most burst, and sending uses them up.
+*/
+typedef struct {
+    long tokens;
+    long burst;
+    struct timeval filled_at;
+    } tokenbucket;
+
 typedef struct {
     char* pattern;
     long max_limit, min_limit;
     long rate;
     off_t bytes_since_avg;
     int num_sending;
+    int senders;	/* list of sending connections, see throttle_link() */
+    tokenbucket bucket;	/* refilled at max_limit, shared by the senders */
+    long level;		/* each sender's share, see throttle_level() */
     } throttletab;
 static throttletab* throttles;
 static int numthrottles, maxthrottles;
@@ -109,22 +132,44 @@ static int numthrottles, maxthrottles;
 #define THROTTLE_NOLIMIT -1
 
 
+/* Connection state is split in two.  A connecttab holds just what the
+** event loop and the update_throttles() sweep look at, so
+** they walk a dense array of small records.  The rest lives in the
+** matching connectcold, in a parallel array.
+*/
 typedef struct {
     int conn_state;
-    int next_free_connect;
-    httpd_conn* hc;
-    int tnums[MAXTHROTTLENUMS];         /* throttle indexes */
     int numtnums;
-    long max_limit, min_limit;
-    time_t started_at, active_at;
-    Timer* wakeup_timer;
-    Timer* linger_timer;
-    long wouldblock_delay;
+    int state_prev, state_next;	/* list for this conn_state */
+    httpd_conn* hc;
+    time_t active_at;
+    long max_limit;
     off_t bytes;
     off_t end_byte_index;
     off_t next_byte_index;
     } connecttab;
+typedef struct {
+    int next_free_connect;
+    int tnums[MAXTHROTTLENUMS];         /* throttle indexes */
+    int tprev[MAXTHROTTLENUMS], tnext[MAXTHROTTLENUMS]; /* their lists */
+    long min_limit;
+    tokenbucket bucket;	/* refilled at max_limit, this connection's share */
+    off_t bytes_since_avg;	/* what it sent since the last update */
+    time_t window_start;	/* see rate_ok() */
+    off_t window_bytes;
+    Timer* wakeup_timer;
+    Timer* linger_timer;
+    Timer* deadline_timer;	/* see arm_deadline() */
+#ifdef MIN_WOULDBLOCK_DELAY
+    long wouldblock_delay;
+#endif /* MIN_WOULDBLOCK_DELAY */
+    int cgi_watch_rw, cgi_watch_wfd, cgi_watch_rfd;	/* see cgi_watch() */
+    struct timeval queued_at;
+    int next_queued;
+    } connectcold;
 static connecttab* connects;
+static connectcold* colds;
+#define COLD(c) (&colds[(c) - connects])
 static int num_connects, max_connects, first_free_connect;
 static int httpd_conn_count;
 
@@ -134,6 +179,41 @@ static int httpd_conn_count;
 #define CNST_SENDING 2
 #define CNST_PAUSING 3
 #define CNST_LINGERING 4
+#define CNST_CGI 5
+#define CNST_CGIWAIT 6
+#define CNST_CACHEWAIT 7
+#define NUM_CNST 8
+
+/* Every connection that isn't free is on the list for its state, linked
+** through state_prev and state_next, so the periodic sweeps only visit
+** the connections they care about.  Change states with set_conn_state().
+*/
+static int state_head[NUM_CNST];
+
+/* Connections waiting for a CGI slot, in arrival order, linked through
+** next_queued.
+*/
+static int cgi_queue_head = -1, cgi_queue_tail = -1, cgi_queue_len = 0;
+static long stats_cgi_queued, stats_cgi_rejected, stats_cgi_expired;
+static long stats_cgi_waited, stats_cgi_wait, stats_cgi_wait_max;
+static int stats_cgi_queue_max;
+
+/* Connections waiting for another request to fill the CGI cache, in no
+** particular order, also linked through next_queued.
+*/
+static int cgi_waiters = -1, waiters_generation = 0;
+
+/* Overload control.  loop_lag is a running average, in usecs, of how far
+** behind the main loop is running; see measure_lag().
+*/
+#define OV_NONE 0
+#define OV_SHED 1
+#define OV_STOP 2
+static int overload = OV_NONE, listening = 0;
+static long loop_lag = 0, woke_overdue;
+static struct timeval woke_at;
+static long stats_lag_total, stats_lag_rounds, stats_lag_max;
+static long stats_shed, stats_stopped, stats_too_slow;
 
 
 static httpd_server* hs = (httpd_server*) 0;
@@ -159,20 +239,54 @@ static char* e_strdup( char* oldstr );
 static void lookup_hostname( httpd_sockaddr* sa4P, size_t sa4_len, int* gotv4P, httpd_sockaddr* sa6P, size_t sa6_len, int* gotv6P );
 static void read_throttlefile( char* tf );
 static void shut_down( void );
+static void watch_listeners( int on );
+static void measure_lag( struct timeval* nowP );
+static void set_overload( int level, struct timeval* nowP );
+static int overload_cut( int t );
 static int handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp );
 static void handle_read( connecttab* c, struct timeval* tvP );
+static void start_send( connecttab* c, struct timeval* tvP );
 static void handle_send( connecttab* c, struct timeval* tvP );
 static void handle_linger( connecttab* c, struct timeval* tvP );
-static int check_throttles( connecttab* c );
+static void handle_cgi( connecttab* c, struct timeval* tvP );
+static void cgi_watch( connecttab* c, int rw, int wfd, int rfd );
+static void cgi_unwatch( connecttab* c );
+static void cgi_begin( connecttab* c, struct timeval* tvP );
+static void cgi_enqueue( connecttab* c, struct timeval* tvP );
+static connecttab* cgi_dequeue( struct timeval* tvP );
+static void cgi_dispatch( struct timeval* tvP );
+static void cgi_park( connecttab* c, struct timeval* tvP );
+static void cgi_unpark( connecttab* c );
+static void cgi_wake( struct timeval* tvP );
+static void set_conn_state( connecttab* c, int state );
+static int check_throttles( connecttab* c, struct timeval* tvP );
 static void clear_throttles( connecttab* c, struct timeval* tvP );
+static void throttle_link( connecttab* c, int tind );
+static void throttle_unlink( connecttab* c, int tind );
+static long throttle_level( throttletab* t );
+static void bucket_fill( tokenbucket* b, long rate, struct timeval* tvP );
+static long bucket_wait( tokenbucket* b, long rate, long want );
+static long throttle_allowance( connecttab* c, struct timeval* tvP );
+static long throttle_delay( connecttab* c, struct timeval* tvP, long want );
+static void throttle_debit( connecttab* c, long bytes );
+static void throttle_pause( connecttab* c, struct timeval* tvP, long msecs );
 static void update_throttles( ClientData client_data, struct timeval* nowP );
 static void finish_connection( connecttab* c, struct timeval* tvP );
 static void clear_connection( connecttab* c, struct timeval* tvP );
 static void really_clear_connection( connecttab* c, struct timeval* tvP );
-static void idle( ClientData client_data, struct timeval* nowP );
+static int conn_timelimit( connecttab* c );
+static void arm_deadline( connecttab* c );
+static int rate_ok( connecttab* c, struct timeval* tvP );
+static void too_slow( connecttab* c, struct timeval* tvP );
+static void deadline_connection( ClientData client_data, struct timeval* nowP );
+static void expire_cgi_queue( struct timeval* nowP );
 static void wakeup_connection( ClientData client_data, struct timeval* nowP );
 static void linger_clear_connection( ClientData client_data, struct timeval* nowP );
 static void occasional( ClientData client_data, struct timeval* nowP );
+static void expire_clients( ClientData client_data, struct timeval* nowP );
+#ifdef FCGI_IDLE_TIME
+static void retire_fcgi( ClientData client_data, struct timeval* nowP );
+#endif /* FCGI_IDLE_TIME */
 #ifdef STATS_TIME
 static void show_stats( ClientData client_data, struct timeval* nowP );
 #endif /* STATS_TIME */
@@ -227,12 +341,11 @@ handle_chld( int sig )
 		syslog( LOG_ERR, "child wait - %m" );
 	    break;
 	    }
-	/* Decrement the CGI count.  Note that this is not accurate, since
-	** each CGI can involve two or even three child processes.
-	** Decrementing for each child means that when there is heavy CGI
-	** activity, the count will be lower than it should be, and therefore
-	** more CGIs will be allowed than should be.
+	/* Decrement the CGI count, which FastCGI workers are counted in
+	** too.  Queued CGIs get started from the main loop, since this is
+	** a signal handler.
 	*/
+	(void) fcgi_reaped( pid );
 	if ( hs != (httpd_server*) 0 )
 	    {
 	    --hs->cgi_count;
@@ -370,6 +483,7 @@ main( int argc, char** argv )
     char cwd[MAXPATHLEN+1];
     FILE* logfp;
     int num_ready;
+    long timeout;
     int cnum;
     connecttab* c;
     httpd_conn* hc;
@@ -393,6 +507,12 @@ main( int argc, char** argv )
     /* Read zone info now, in case we chroot(). */
     tzset();
 
+    /* Same for the password cache's random key. */
+    authcache_init();
+
+    /* And the per-client limits' hash key. */
+    clientlimit_init( client_conns, client_rate, client_burst );
+
     /* Look up hostname now, in case we chroot(). */
     lookup_hostname( &sa4, sizeof(sa4), &gotv4, &sa6, sizeof(sa6), &gotv6 );
     if ( ! ( gotv4 || gotv6 ) )
@@ -409,6 +529,14 @@ main( int argc, char** argv )
     if ( throttlefile != (char*) 0 )
 	read_throttlefile( throttlefile );
 
+    /* Read the site's MIME types, if any. */
+    if ( mimetypesfile != (char*) 0 )
+	if ( httpd_load_mime_types( mimetypesfile ) < 0 )
+	    {
+	    perror( mimetypesfile );
+	    exit( 1 );
+	    }
+
     /* If we're root and we're going to become another user, get the uid/gid
     ** now.
     */
@@ -649,7 +777,8 @@ main( int argc, char** argv )
     hs = httpd_initialize(
 	hostname,
 	gotv4 ? &sa4 : (httpd_sockaddr*) 0, gotv6 ? &sa6 : (httpd_sockaddr*) 0,
-	port, cgi_pattern, cgi_limit, charset, p3p, max_age, cwd, no_log, logfp,
+	port, cgi_pattern, cgi_limit, fcgi_pattern, charset, p3p, max_age, cwd,
+	no_log, logfp,
 #ifdef TCP_FASTOPEN
 	fastopen,
 #endif
@@ -667,12 +796,6 @@ main( int argc, char** argv )
 	syslog( LOG_CRIT, "tmr_create(occasional) failed" );
 	exit( 1 );
 	}
-    /* Set up the idle timer. */
-    if ( tmr_create( (struct timeval*) 0, idle, JunkClientData, 5 * 1000L, 1 ) == (Timer*) 0 )
-	{
-	syslog( LOG_CRIT, "tmr_create(idle) failed" );
-	exit( 1 );
-	}
     if ( numthrottles > 0 )
 	{
 	/* Set up the throttles timer. */
@@ -682,6 +805,26 @@ main( int argc, char** argv )
 	    exit( 1 );
 	    }
 	}
+    if ( client_conns > 0 || client_rate > 0 )
+	{
+	/* Set up the timer for forgetting quiet clients. */
+	if ( tmr_create( (struct timeval*) 0, expire_clients, JunkClientData, CLIENT_EXPIRE_TIME * 1000L, 1 ) == (Timer*) 0 )
+	    {
+	    syslog( LOG_CRIT, "tmr_create(expire_clients) failed" );
+	    exit( 1 );
+	    }
+	}
+#ifdef FCGI_IDLE_TIME
+    if ( fcgi_pattern != (char*) 0 )
+	{
+	/* Set up the timer for stopping idle FastCGI workers. */
+	if ( tmr_create( (struct timeval*) 0, retire_fcgi, JunkClientData, FCGI_IDLE_TIME * 1000L, 1 ) == (Timer*) 0 )
+	    {
+	    syslog( LOG_CRIT, "tmr_create(retire_fcgi) failed" );
+	    exit( 1 );
+	    }
+	}
+#endif /* FCGI_IDLE_TIME */
 #ifdef STATS_TIME
     /* Set up the stats timer. */
     if ( tmr_create( (struct timeval*) 0, show_stats, JunkClientData, STATS_TIME * 1000L, 1 ) == (Timer*) 0 )
@@ -735,7 +878,8 @@ main( int argc, char** argv )
 
     /* Initialize our connections table. */
     connects = NEW( connecttab, max_connects );
-    if ( connects == (connecttab*) 0 )
+    colds = NEW( connectcold, max_connects );
+    if ( connects == (connecttab*) 0 || colds == (connectcold*) 0 )
 	{
 	syslog( LOG_CRIT, "out of memory allocating a connecttab" );
 	exit( 1 );
@@ -743,39 +887,59 @@ main( int argc, char** argv )
     for ( cnum = 0; cnum < max_connects; ++cnum )
 	{
 	connects[cnum].conn_state = CNST_FREE;
-	connects[cnum].next_free_connect = cnum + 1;
+	colds[cnum].next_free_connect = cnum + 1;
 	connects[cnum].hc = (httpd_conn*) 0;
 	}
-    connects[max_connects - 1].next_free_connect = -1;	/* end of link list */
+    colds[max_connects - 1].next_free_connect = -1;	/* end of link list */
     first_free_connect = 0;
+    for ( cnum = 0; cnum < NUM_CNST; ++cnum )
+	state_head[cnum] = -1;
     num_connects = 0;
     httpd_conn_count = 0;
 
-    if ( hs != (httpd_server*) 0 )
-	{
-	if ( hs->listen4_fd != -1 )
-	    fdwatch_add_fd( hs->listen4_fd, (void*) 0, FDW_READ );
-	if ( hs->listen6_fd != -1 )
-	    fdwatch_add_fd( hs->listen6_fd, (void*) 0, FDW_READ );
-#ifdef USE_SCTP
-	if ( hs->listensctp_fd != -1 )
-	    fdwatch_add_fd( hs->listensctp_fd, (void*) 0, FDW_READ );
-#endif
-	}
+    watch_listeners( 1 );
 
     /* Main loop. */
     (void) gettimeofday( &tv, (struct timezone*) 0 );
     while ( ( ! terminate ) || num_connects > 0 )
 	{
-	/* Do we need to re-open the log file? */
+	/* Do we need to re-open the log file and rescan the vhosts? */
 	if ( got_hup )
 	    {
 	    re_open_logfile();
+	    httpd_vhost_reload( hs );
 	    got_hup = 0;
 	    }
 
-	/* Do the fd watch. */
-	num_ready = fdwatch( tmr_mstimeout( &tv ) );
+	/* Start queued CGIs if any running ones have been reaped. */
+	if ( cgi_queue_head != -1 )
+	    {
+	    (void) gettimeofday( &tv, (struct timezone*) 0 );
+	    cgi_dispatch( &tv );
+	    }
+
+	/* Retry requests waiting on the CGI cache if anything changed. */
+	if ( cgi_waiters != -1 && cgicache_generation() != waiters_generation )
+	    {
+	    (void) gettimeofday( &tv, (struct timezone*) 0 );
+	    cgi_wake( &tv );
+	    }
+
+	/* How long did the last round take? */
+	if ( woke_at.tv_sec != 0 )
+	    {
+	    (void) gettimeofday( &tv, (struct timezone*) 0 );
+	    measure_lag( &tv );
+	    }
+
+	/* Do the fd watch.  While overloaded, come back at least every
+	** tenth of a second, so the lag gets measured again even if
+	** nothing is happening.
+	*/
+	timeout = tmr_mstimeout( &tv );
+	if ( overload != OV_NONE && ( timeout == INFTIM || timeout > 100 ) )
+	    timeout = 100;
+	num_ready = fdwatch( timeout );
 	if ( num_ready < 0 )
 	    {
 	    if ( errno == EINTR || errno == EAGAIN )
@@ -784,6 +948,8 @@ main( int argc, char** argv )
 	    exit( 1 );
 	    }
 	(void) gettimeofday( &tv, (struct timezone*) 0 );
+	woke_at = tv;
+	woke_overdue = tmr_overdue( &tv );
 
 	if ( num_ready == 0 )
 	    {
@@ -832,7 +998,12 @@ main( int argc, char** argv )
 	    if ( c == (connecttab*) 0 )
 		continue;
 	    hc = c->hc;
-	    if ( ! fdwatch_check_fd( hc->conn_fd ) )
+	    if ( c->conn_state == CNST_CGI )
+		/* Might be waiting on the CGI rather than the client; errors
+		** show up in the relay.
+		*/
+		handle_cgi( c, &tv );
+	    else if ( ! fdwatch_check_fd( hc->conn_fd ) )
 		/* Something went wrong. */
 		clear_connection( c, &tv );
 	    else
@@ -848,18 +1019,9 @@ main( int argc, char** argv )
 	if ( got_usr1 && ! terminate )
 	    {
 	    terminate = 1;
+	    watch_listeners( 0 );
 	    if ( hs != (httpd_server*) 0 )
-		{
-		if ( hs->listen4_fd != -1 )
-		    fdwatch_del_fd( hs->listen4_fd );
-		if ( hs->listen6_fd != -1 )
-		    fdwatch_del_fd( hs->listen6_fd );
-#ifdef USE_SCTP
-		if ( hs->listensctp_fd != -1 )
-		    fdwatch_del_fd( hs->listensctp_fd );
-#endif
 		httpd_unlisten( hs );
-		}
 	    }
 	}
 
@@ -907,10 +1069,12 @@ parse_args( int argc, char** argv )
 #else /* CGI_LIMIT */
     cgi_limit = 0;
 #endif /* CGI_LIMIT */
+    fcgi_pattern = (char*) 0;
     url_pattern = (char*) 0;
     no_empty_referrers = 0;
     local_pattern = (char*) 0;
     throttlefile = (char*) 0;
+    mimetypesfile = (char*) 0;
     hostname = (char*) 0;
     logfile = (char*) 0;
     pidfile = (char*) 0;
@@ -918,6 +1082,37 @@ parse_args( int argc, char** argv )
     charset = DEFAULT_CHARSET;
     p3p = "";
     max_age = -1;
+    read_timeout = IDLE_READ_TIMELIMIT;
+    send_timeout = IDLE_SEND_TIMELIMIT;
+    linger_time = LINGER_TIME;
+#ifdef CLIENT_CONN_LIMIT
+    client_conns = CLIENT_CONN_LIMIT;
+#else /* CLIENT_CONN_LIMIT */
+    client_conns = 0;
+#endif /* CLIENT_CONN_LIMIT */
+#ifdef CLIENT_RATE_LIMIT
+    client_rate = CLIENT_RATE_LIMIT;
+#else /* CLIENT_RATE_LIMIT */
+    client_rate = 0;
+#endif /* CLIENT_RATE_LIMIT */
+    client_burst = 0;
+#ifdef OVERLOAD_SHED_LAG
+    shed_lag = OVERLOAD_SHED_LAG;
+#else /* OVERLOAD_SHED_LAG */
+    shed_lag = 0;
+#endif /* OVERLOAD_SHED_LAG */
+#ifdef OVERLOAD_STOP_LAG
+    stop_lag = OVERLOAD_STOP_LAG;
+#else /* OVERLOAD_STOP_LAG */
+    stop_lag = 0;
+#endif /* OVERLOAD_STOP_LAG */
+#ifdef RATE_WINDOW
+    rate_window = RATE_WINDOW;
+    min_read_bytes = MIN_READ_BYTES;
+    min_send_bytes = MIN_SEND_BYTES;
+#else /* RATE_WINDOW */
+    rate_window = min_read_bytes = min_send_bytes = 0;
+#endif /* RATE_WINDOW */
 #ifdef TCP_FASTOPEN
     fastopen = 0;
 #endif
@@ -981,11 +1176,21 @@ parse_args( int argc, char** argv )
 	    ++argn;
 	    cgi_pattern = argv[argn];
 	    }
+	else if ( strcmp( argv[argn], "-fc" ) == 0 && argn + 1 < argc )
+	    {
+	    ++argn;
+	    fcgi_pattern = argv[argn];
+	    }
 	else if ( strcmp( argv[argn], "-t" ) == 0 && argn + 1 < argc )
 	    {
 	    ++argn;
 	    throttlefile = argv[argn];
 	    }
+	else if ( strcmp( argv[argn], "-mt" ) == 0 && argn + 1 < argc )
+	    {
+	    ++argn;
+	    mimetypesfile = argv[argn];
+	    }
 	else if ( strcmp( argv[argn], "-h" ) == 0 && argn + 1 < argc )
 	    {
 	    ++argn;
@@ -1052,7 +1257,7 @@ static void
 usage( void )
     {
     (void) fprintf( stderr,
-"usage:  %s [-C configfile] [-p port] [-d dir] [-r|-nor] [-dd data_dir] [-s|-nos] [-v|-nov] [-g|-nog] [-u user] [-c cgipat] [-t throttles] [-h host] [-l logfile] [-i pidfile] [-T charset] [-P P3P] [-M maxage] [-V] [-D]"
+"usage:  %s [-C configfile] [-p port] [-d dir] [-r|-nor] [-dd data_dir] [-s|-nos] [-v|-nov] [-g|-nog] [-u user] [-c cgipat] [-fc fcgipat] [-t throttles] [-mt mimetypes] [-h host] [-l logfile] [-i pidfile] [-T charset] [-P P3P] [-M maxage] [-V] [-D]"
 #ifdef TCP_FASTOPEN
 " [-F]"
 #endif
@@ -1170,6 +1375,11 @@ read_config( char* filename )
 		value_required( name, value );
 		cgi_limit = atoi( value );
 		}
+	    else if ( strcasecmp( name, "fcgipat" ) == 0 )
+		{
+		value_required( name, value );
+		fcgi_pattern = e_strdup( value );
+		}
 	    else if ( strcasecmp( name, "urlpat" ) == 0 )
 		{
 		value_required( name, value );
@@ -1191,6 +1401,11 @@ read_config( char* filename )
 		value_required( name, value );
 		throttlefile = e_strdup( value );
 		}
+	    else if ( strcasecmp( name, "mimetypes" ) == 0 )
+		{
+		value_required( name, value );
+		mimetypesfile = e_strdup( value );
+		}
 	    else if ( strcasecmp( name, "host" ) == 0 )
 		{
 		value_required( name, value );
@@ -1241,6 +1456,61 @@ read_config( char* filename )
 		value_required( name, value );
 		max_age = atoi( value );
 		}
+	    else if ( strcasecmp( name, "readtimeout" ) == 0 )
+		{
+		value_required( name, value );
+		read_timeout = atoi( value );
+		}
+	    else if ( strcasecmp( name, "sendtimeout" ) == 0 )
+		{
+		value_required( name, value );
+		send_timeout = atoi( value );
+		}
+	    else if ( strcasecmp( name, "lingertime" ) == 0 )
+		{
+		value_required( name, value );
+		linger_time = atoi( value );
+		}
+	    else if ( strcasecmp( name, "clientconns" ) == 0 )
+		{
+		value_required( name, value );
+		client_conns = atoi( value );
+		}
+	    else if ( strcasecmp( name, "clientrate" ) == 0 )
+		{
+		value_required( name, value );
+		client_rate = atoi( value );
+		}
+	    else if ( strcasecmp( name, "clientburst" ) == 0 )
+		{
+		value_required( name, value );
+		client_burst = atoi( value );
+		}
+	    else if ( strcasecmp( name, "shedlag" ) == 0 )
+		{
+		value_required( name, value );
+		shed_lag = atoi( value );
+		}
+	    else if ( strcasecmp( name, "stoplag" ) == 0 )
+		{
+		value_required( name, value );
+		stop_lag = atoi( value );
+		}
+	    else if ( strcasecmp( name, "ratewindow" ) == 0 )
+		{
+		value_required( name, value );
+		rate_window = atoi( value );
+		}
+	    else if ( strcasecmp( name, "minreadbytes" ) == 0 )
+		{
+		value_required( name, value );
+		min_read_bytes = atoi( value );
+		}
+	    else if ( strcasecmp( name, "minsendbytes" ) == 0 )
+		{
+		value_required( name, value );
+		min_send_bytes = atoi( value );
+		}
 #ifdef USE_SCTP
 	    else if ( strcasecmp( name, "sctp_send_at_once_limit" ) == 0 )
 		{
@@ -1453,7 +1723,7 @@ read_throttlefile( char* tf )
     char* cp;
     int len;
     char pattern[5000];
-    long max_limit, min_limit;
+    long max_limit, min_limit, burst;
     struct timeval tv;
 
     fp = fopen( tf, "r" );
@@ -1485,8 +1755,13 @@ read_throttlefile( char* tf )
 	    continue;
 
 	/* Parse line. */
-	if ( sscanf( buf, " %4900[^ \t] %ld-%ld", pattern, &min_limit, &max_limit ) == 3 )
+	burst = -1;
+	if ( sscanf( buf, " %4900[^ \t] %ld-%ld/%ld", pattern, &min_limit, &max_limit, &burst ) == 4 )
+	    {}
+	else if ( sscanf( buf, " %4900[^ \t] %ld-%ld", pattern, &min_limit, &max_limit ) == 3 )
 	    {}
+	else if ( sscanf( buf, " %4900[^ \t] %ld/%ld", pattern, &max_limit, &burst ) == 3 )
+	    min_limit = 0;
 	else if ( sscanf( buf, " %4900[^ \t] %ld", pattern, &max_limit ) == 2 )
 	    min_limit = 0;
 	else
@@ -1499,6 +1774,12 @@ read_throttlefile( char* tf )
 	    continue;
 	    }
 
+	/* The default burst is a quarter second's worth. */
+	if ( burst < 0 )
+	    burst = max_limit / 4;
+	if ( burst < 1 )
+	    burst = 1;
+
 	/* Nuke any leading slashes in pattern. */
 	if ( pattern[0] == '/' )
 	    (void) ol_strcpy( pattern, &pattern[1] );
@@ -1535,6 +1816,10 @@ read_throttlefile( char* tf )
 	throttles[numthrottles].rate = 0;
 	throttles[numthrottles].bytes_since_avg = 0;
 	throttles[numthrottles].num_sending = 0;
+	throttles[numthrottles].senders = -1;
+	throttles[numthrottles].bucket.burst = burst;
+	throttles[numthrottles].bucket.tokens = burst;
+	throttles[numthrottles].bucket.filled_at = tv;
 
 	++numthrottles;
 	}
@@ -1562,40 +1847,184 @@ shut_down( void )
 	    connects[cnum].hc = (httpd_conn*) 0;
 	    }
 	}
+    watch_listeners( 0 );
     if ( hs != (httpd_server*) 0 )
 	{
 	httpd_server* ths = hs;
 	hs = (httpd_server*) 0;
-	if ( ths->listen4_fd != -1 )
-	    fdwatch_del_fd( ths->listen4_fd );
-	if ( ths->listen6_fd != -1 )
-	    fdwatch_del_fd( ths->listen6_fd );
-#ifdef USE_SCTP
-	if ( ths->listensctp_fd != -1 )
-	    fdwatch_del_fd( ths->listensctp_fd );
-#endif
 	httpd_terminate( ths );
 	}
     mmc_term();
+    fcgi_term();
+    cgicache_term();
+    authcache_term();
+    clientlimit_term();
     tmr_term();
     free( (void*) connects );
+    free( (void*) colds );
     if ( throttles != (throttletab*) 0 )
 	free( (void*) throttles );
     }
 
 
+/* Start or stop watching the listen sockets for new connections. */
+static void
+watch_listeners( int on )
+    {
+    if ( hs == (httpd_server*) 0 || on == listening )
+	return;
+    if ( hs->listen4_fd != -1 )
+	{
+	if ( on )
+	    fdwatch_add_fd( hs->listen4_fd, (void*) 0, FDW_READ );
+	else
+	    fdwatch_del_fd( hs->listen4_fd );
+	}
+    if ( hs->listen6_fd != -1 )
+	{
+	if ( on )
+	    fdwatch_add_fd( hs->listen6_fd, (void*) 0, FDW_READ );
+	else
+	    fdwatch_del_fd( hs->listen6_fd );
+	}
+#ifdef USE_SCTP
+    if ( hs->listensctp_fd != -1 )
+	{
+	if ( on )
+	    fdwatch_add_fd( hs->listensctp_fd, (void*) 0, FDW_READ );
+	else
+	    fdwatch_del_fd( hs->listensctp_fd );
+	}
+#endif
+    listening = on;
+    }
+
+
+/* Called once per round of the main loop, just before the fdwatch(),
+** with the time the round took since the last fdwatch() returned.  The
+** lag for the round is that plus how overdue the timers were when it
+** started, which catches rounds that couldn't even get to the timers on
+** time.  The running average moves an eighth of the way towards each
+** round's lag, and decides the overload level.  Levels go up as soon as
+** a threshold is passed, but only come back down once the lag is under
+** half of it, so the server doesn't flap at the edge.
+*/
+static void
+measure_lag( struct timeval* nowP )
+    {
+    long lag, msecs;
+    int level;
+
+    lag = ( nowP->tv_sec - woke_at.tv_sec ) * 1000000L +
+	( nowP->tv_usec - woke_at.tv_usec ) + woke_overdue * 1000L;
+    woke_at.tv_sec = 0;
+    if ( lag < 0 )
+	lag = 0;	/* the clock went backwards */
+    loop_lag += ( lag - loop_lag ) / 8;
+    stats_lag_total += lag;
+    ++stats_lag_rounds;
+    if ( lag > stats_lag_max )
+	stats_lag_max = lag;
+
+    msecs = loop_lag / 1000L;
+    level = overload;
+    if ( level == OV_STOP && ( stop_lag <= 0 || msecs < stop_lag / 2 ) )
+	level = OV_SHED;
+    if ( level == OV_SHED && ( shed_lag <= 0 || msecs < shed_lag / 2 ) )
+	level = OV_NONE;
+    if ( shed_lag > 0 && msecs >= shed_lag && level < OV_SHED )
+	level = OV_SHED;
+    if ( stop_lag > 0 && msecs >= stop_lag )
+	level = OV_STOP;
+    if ( level != overload )
+	set_overload( level, nowP );
+    }
+
+
+static void
+set_overload( int level, struct timeval* nowP )
+    {
+    int old = overload;
+    int cnum;
+
+    overload = level;
+    if ( level == OV_STOP )
+	{
+	syslog( LOG_WARNING,
+	    "overloaded, %ld msec loop lag - not accepting connections",
+	    loop_lag / 1000L );
+	watch_listeners( 0 );
+	++stats_stopped;
+	}
+    else
+	{
+	if ( old == OV_STOP && ! terminate )
+	    watch_listeners( 1 );
+	if ( level == OV_SHED )
+	    syslog( LOG_WARNING,
+		"overloaded, %ld msec loop lag - shedding new connections",
+		loop_lag / 1000L );
+	else
+	    syslog( LOG_NOTICE,
+		"no longer overloaded, %ld msec loop lag", loop_lag / 1000L );
+	}
+
+    /* Bring in the deadlines of the idle connections we already have. */
+    if ( old == OV_NONE )
+	{
+	for ( cnum = state_head[CNST_READING]; cnum != -1;
+	      cnum = connects[cnum].state_next )
+	    arm_deadline( &connects[cnum] );
+	for ( cnum = state_head[CNST_SENDING]; cnum != -1;
+	      cnum = connects[cnum].state_next )
+	    arm_deadline( &connects[cnum] );
+	}
+    }
+
+
+/* While overloaded, idle and linger times are cut to a quarter. */
+static int
+overload_cut( int t )
+    {
+    if ( overload == OV_NONE || t < 4 )
+	return t;
+    return t / 4;
+    }
+
+
 static int
 handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp )
     {
     connecttab* c;
+    connectcold* cc;
     ClientData client_data;
+    int n;
 
     /* This loops until the accept() fails, trying to start new
     ** connections as fast as possible so we don't overrun the
-    ** listen queue.
+    ** listen queue.  But only so many at a time, so a flood of new
+    ** connections can't starve the ones we already have.
     */
-    for (;;)
+    for ( n = 0; n < ACCEPT_BATCH; ++n )
 	{
+	/* If we're overloaded, or out of connection slots and shedding
+	** is on, turn the connection away with a quick 503.
+	*/
+	if ( overload != OV_NONE ||
+	     ( num_connects >= max_connects && shed_lag > 0 ) )
+	    {
+	    switch ( httpd_shed_conn( listen_fd, OVERLOAD_RETRY_AFTER ) )
+		{
+		case GC_FAIL:
+		tmr_run( tvP );
+		return 0;
+
+		case GC_NO_MORE:
+		return 1;
+		}
+	    ++stats_shed;
+	    continue;
+	    }
 	/* Is there room in the connection table? */
 	if ( num_connects >= max_connects )
 	    {
@@ -1614,6 +2043,7 @@ handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp )
 	    exit( 1 );
 	    }
 	c = &connects[first_free_connect];
+	cc = COLD( c );
 	/* Make the httpd_conn if necessary. */
 	if ( c->hc == (httpd_conn*) 0 )
 	    {
@@ -1628,7 +2058,7 @@ handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp )
 	    }
 
 	/* Get the connection. */
-	switch ( httpd_get_conn( hs, listen_fd, c->hc, is_sctp ) )
+	switch ( httpd_get_conn( hs, listen_fd, c->hc, is_sctp, tvP ) )
 	    {
 	    /* Some error happened.  Run the timers, then the
 	    ** existing connections.  Maybe the error will clear.
@@ -1640,22 +2070,25 @@ handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp )
 	    /* No more connections to accept for now. */
 	    case GC_NO_MORE:
 	    return 1;
+
+	    /* Turned away by the per-client limits.  Try the next one. */
+	    case GC_REFUSED:
+	    continue;
 	    }
-	c->conn_state = CNST_READING;
 	/* Pop it off the free list. */
-	first_free_connect = c->next_free_connect;
-	c->next_free_connect = -1;
+	first_free_connect = cc->next_free_connect;
+	cc->next_free_connect = -1;
 	++num_connects;
 	client_data.p = c;
 	c->active_at = tvP->tv_sec;
-	c->wakeup_timer = (Timer*) 0;
-	c->linger_timer = (Timer*) 0;
+	cc->window_start = tvP->tv_sec;
+	cc->window_bytes = 0;
+	cc->wakeup_timer = (Timer*) 0;
+	cc->linger_timer = (Timer*) 0;
+	cc->deadline_timer = (Timer*) 0;
 	c->next_byte_index = 0;
 	c->numtnums = 0;
-
-	/* Set the connection file descriptor to no-delay mode. */
-	httpd_set_ndelay( c->hc->conn_fd );
-
+	set_conn_state( c, CNST_READING );
 	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
 
 #ifdef USE_SCTP
@@ -1668,7 +2101,14 @@ handle_newconnect( struct timeval* tvP, int listen_fd, int is_sctp )
 #endif
 	if ( num_connects > stats_simultaneous )
 	    stats_simultaneous = num_connects;
+
+	/* The request has often arrived along with the connection,
+	** especially with deferred accepts, so try reading it right
+	** away instead of waiting for the next fdwatch() round.
+	*/
+	handle_read( c, tvP );
 	}
+    return 0;
     }
 
 
@@ -1676,7 +2116,6 @@ static void
 handle_read( connecttab* c, struct timeval* tvP )
     {
     int sz;
-    ClientData client_data;
     httpd_conn* hc = c->hc;
 
     /* Is there room in our buffer to read more bytes? */
@@ -1718,11 +2157,14 @@ handle_read( connecttab* c, struct timeval* tvP )
 	}
     hc->read_idx += sz;
     c->active_at = tvP->tv_sec;
+    COLD( c )->window_bytes += sz;
 
     /* Do we have a complete request yet? */
     switch ( httpd_got_request( hc ) )
 	{
 	case GR_NO_REQUEST:
+	if ( ! rate_ok( c, tvP ) )
+	    too_slow( c, tvP );
 	return;
 	case GR_BAD_REQUEST:
 	httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
@@ -1738,7 +2180,7 @@ handle_read( connecttab* c, struct timeval* tvP )
 	}
 
     /* Check the throttle table */
-    if ( ! check_throttles( c ) )
+    if ( ! check_throttles( c, tvP ) )
 	{
 	httpd_send_err(
 	    hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
@@ -1754,6 +2196,29 @@ handle_read( connecttab* c, struct timeval* tvP )
 	return;
 	}
 
+    /* A relayed CGI gets serviced from the main loop from here on. */
+    if ( hc->cgi_state != CGIS_NONE )
+	{
+	cgi_begin( c, tvP );
+	return;
+	}
+
+    start_send( c, tvP );
+    }
+
+
+/* Starts sending a response that httpd_start_request() left in memory
+** or mapped in hc->file_address.
+*/
+static void
+start_send( connecttab* c, struct timeval* tvP )
+    {
+#ifdef MIN_WOULDBLOCK_DELAY
+    connectcold* cc = COLD( c );
+#endif /* MIN_WOULDBLOCK_DELAY */
+    ClientData client_data;
+    httpd_conn* hc = c->hc;
+
     /* Fill in end_byte_index. */
     if ( hc->got_range )
 	{
@@ -1769,9 +2234,7 @@ handle_read( connecttab* c, struct timeval* tvP )
     if ( hc->file_address == (char*) 0 )
 	{
 	/* No file address means someone else is handling it. */
-	int tind;
-	for ( tind = 0; tind < c->numtnums; ++tind )
-	    throttles[c->tnums[tind]].bytes_since_avg += hc->bytes_sent;
+	throttle_debit( c, hc->bytes_sent );
 	c->next_byte_index = hc->bytes_sent;
 	finish_connection( c, tvP );
 	return;
@@ -1784,13 +2247,24 @@ handle_read( connecttab* c, struct timeval* tvP )
 	}
 
     /* Cool, we have a valid connection and a file to send to it. */
-    c->conn_state = CNST_SENDING;
-    c->started_at = tvP->tv_sec;
-    c->wouldblock_delay = 0;
+    COLD( c )->window_start = tvP->tv_sec;
+    COLD( c )->window_bytes = 0;
+    set_conn_state( c, CNST_SENDING );
+#ifdef MIN_WOULDBLOCK_DELAY
+    cc->wouldblock_delay = 0;
+#endif /* MIN_WOULDBLOCK_DELAY */
     client_data.p = c;
 
-    fdwatch_del_fd( hc->conn_fd );
-    fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE );
+    /* Small responses usually fit in the socket buffer, so try sending
+    ** right away.  Only if something is left over do we wait for the
+    ** socket to become writable.
+    */
+    handle_send( c, tvP );
+    if ( c->conn_state == CNST_SENDING )
+	{
+	fdwatch_del_fd( hc->conn_fd );
+	fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE );
+	}
     }
 
 
@@ -1798,11 +2272,13 @@ static void
 handle_send( connecttab* c, struct timeval* tvP )
     {
     size_t max_bytes;
-    int sz, coast;
+    int sz;
+    long allowed, delay;
+#ifdef MIN_WOULDBLOCK_DELAY
+    connectcold* cc = COLD( c );
     ClientData client_data;
-    time_t elapsed;
+#endif /* MIN_WOULDBLOCK_DELAY */
     httpd_conn* hc = c->hc;
-    int tind;
     struct msghdr msg;
     struct cmsghdr *cmsg;
     struct iovec iv[2];
@@ -1819,7 +2295,18 @@ handle_send( connecttab* c, struct timeval* tvP )
     if ( c->max_limit == THROTTLE_NOLIMIT )
 	max_bytes = 1000000000L;
     else
-	max_bytes = c->max_limit / 4;	/* send at most 1/4 seconds worth */
+	{
+	/* Send only as much as the token buckets allow. */
+	allowed = throttle_allowance( c, tvP );
+	if ( allowed <= 0 )
+	    {
+	    throttle_pause(
+		c, tvP, throttle_delay(
+		    c, tvP, c->end_byte_index - c->next_byte_index ) );
+	    return;
+	    }
+	max_bytes = allowed;
+	}
 #ifdef USE_SCTP
     if ( hc->is_sctp )
 	{
@@ -1905,29 +2392,33 @@ handle_send( connecttab* c, struct timeval* tvP )
     if ( sz == 0 ||
 	 ( sz < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) ) )
 	{
-	/* This shouldn't happen, but some kernels, e.g.
-	** SunOS 4.1.x, are broken and select() says that
-	** O_NDELAY sockets are always writable even when
+	/* The socket buffer is full.  The connection is still watched
+	** for writing, so we'll be back here once it drains.
+	*/
+#ifdef MIN_WOULDBLOCK_DELAY
+	/* Some kernels, e.g. SunOS 4.1.x, are broken and select()
+	** says that O_NDELAY sockets are always writable even when
 	** they're actually not.
 	**
-	** Current workaround is to block sending on this
+	** The workaround is to block sending on this
 	** socket for a brief adaptively-tuned period.
 	** Fortunately we already have all the necessary
 	** blocking code, for use with throttling.
 	*/
-	c->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
-	c->conn_state = CNST_PAUSING;
+	cc->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
+	set_conn_state( c, CNST_PAUSING );
 	fdwatch_del_fd( hc->conn_fd );
 	client_data.p = c;
-	if ( c->wakeup_timer != (Timer*) 0 )
+	if ( cc->wakeup_timer != (Timer*) 0 )
 	    syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
-	c->wakeup_timer = tmr_create(
-	    tvP, wakeup_connection, client_data, c->wouldblock_delay, 0 );
-	if ( c->wakeup_timer == (Timer*) 0 )
+	cc->wakeup_timer = tmr_create(
+	    tvP, wakeup_connection, client_data, cc->wouldblock_delay, 0 );
+	if ( cc->wakeup_timer == (Timer*) 0 )
 	    {
 	    syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
 	    exit( 1 );
 	    }
+#endif /* MIN_WOULDBLOCK_DELAY */
 	return;
 	}
 
@@ -1952,6 +2443,7 @@ handle_send( connecttab* c, struct timeval* tvP )
 
     /* Ok, we wrote something. */
     c->active_at = tvP->tv_sec;
+    COLD( c )->window_bytes += sz;
     /* Was this a headers + file writev()? */
     if ( hc->responselen > 0 )
 	{
@@ -1974,8 +2466,7 @@ handle_send( connecttab* c, struct timeval* tvP )
     /* And update how much of the file we wrote. */
     c->next_byte_index += sz;
     c->hc->bytes_sent += sz;
-    for ( tind = 0; tind < c->numtnums; ++tind )
-	throttles[c->tnums[tind]].bytes_since_avg += sz;
+    throttle_debit( c, sz );
 
     /* Are we done? */
     if ( c->next_byte_index >= c->end_byte_index )
@@ -1985,36 +2476,28 @@ handle_send( connecttab* c, struct timeval* tvP )
 	return;
 	}
 
+    /* Is the client keeping up? */
+    if ( ! rate_ok( c, tvP ) )
+	{
+	too_slow( c, tvP );
+	return;
+	}
+
+#ifdef MIN_WOULDBLOCK_DELAY
     /* Tune the (blockheaded) wouldblock delay. */
-    if ( c->wouldblock_delay > MIN_WOULDBLOCK_DELAY )
-	c->wouldblock_delay -= MIN_WOULDBLOCK_DELAY;
+    if ( cc->wouldblock_delay > MIN_WOULDBLOCK_DELAY )
+	cc->wouldblock_delay -= MIN_WOULDBLOCK_DELAY;
+#endif /* MIN_WOULDBLOCK_DELAY */
 
-    /* If we're throttling, check if we're sending too fast. */
+    /* If we're throttling and the buckets are short of what the next
+    ** write wants, pause until they've built back up.
+    */
     if ( c->max_limit != THROTTLE_NOLIMIT )
 	{
-	elapsed = tvP->tv_sec - c->started_at;
-	if ( elapsed == 0 )
-	    elapsed = 1;	/* count at least one second */
-	if ( c->hc->bytes_sent / elapsed > c->max_limit )
-	    {
-	    c->conn_state = CNST_PAUSING;
-	    fdwatch_del_fd( hc->conn_fd );
-	    /* How long should we wait to get back on schedule?  If less
-	    ** than a second (integer math rounding), use 1/2 second.
-	    */
-	    coast = c->hc->bytes_sent / c->max_limit - elapsed;
-	    client_data.p = c;
-	    if ( c->wakeup_timer != (Timer*) 0 )
-		syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
-	    c->wakeup_timer = tmr_create(
-		tvP, wakeup_connection, client_data,
-		coast > 0 ? ( coast * 1000L ) : 500L, 0 );
-	    if ( c->wakeup_timer == (Timer*) 0 )
-		{
-		syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
-		exit( 1 );
-		}
-	    }
+	delay = throttle_delay(
+	    c, tvP, c->end_byte_index - c->next_byte_index );
+	if ( delay > 0 )
+	    throttle_pause( c, tvP, delay );
 	}
     /* (No check on min_limit here, that only controls connection startups.) */
     }
@@ -2037,14 +2520,44 @@ handle_linger( connecttab* c, struct timeval* tvP )
     }
 
 
+static void
+set_conn_state( connecttab* c, int state )
+    {
+    int cnum = c - connects;	/* division by sizeof is implied */
+
+    if ( state == c->conn_state )
+	return;
+    if ( c->conn_state != CNST_FREE )
+	{
+	if ( c->state_prev != -1 )
+	    connects[c->state_prev].state_next = c->state_next;
+	else
+	    state_head[c->conn_state] = c->state_next;
+	if ( c->state_next != -1 )
+	    connects[c->state_next].state_prev = c->state_prev;
+	}
+    c->conn_state = state;
+    if ( state != CNST_FREE )
+	{
+	c->state_prev = -1;
+	c->state_next = state_head[state];
+	if ( c->state_next != -1 )
+	    connects[c->state_next].state_prev = cnum;
+	state_head[state] = cnum;
+	arm_deadline( c );
+	}
+    }
+
+
 static int
-check_throttles( connecttab* c )
+check_throttles( connecttab* c, struct timeval* tvP )
     {
+    connectcold* cc = COLD( c );
     int tnum;
     long l;
 
     c->numtnums = 0;
-    c->max_limit = c->min_limit = THROTTLE_NOLIMIT;
+    c->max_limit = cc->min_limit = cc->bucket.burst = THROTTLE_NOLIMIT;
     for ( tnum = 0; tnum < numthrottles && c->numtnums < MAXTHROTTLENUMS;
 	  ++tnum )
 	if ( match( throttles[tnum].pattern, c->hc->expnfilename ) )
@@ -2060,19 +2573,29 @@ check_throttles( connecttab* c )
 		syslog( LOG_ERR, "throttle sending count was negative - shouldn't happen!" );
 		throttles[tnum].num_sending = 0;
 		}
-	    c->tnums[c->numtnums++] = tnum;
+	    cc->tnums[c->numtnums] = tnum;
+	    throttle_link( c, c->numtnums++ );
 	    ++throttles[tnum].num_sending;
 	    l = throttles[tnum].max_limit / throttles[tnum].num_sending;
 	    if ( c->max_limit == THROTTLE_NOLIMIT )
 		c->max_limit = l;
 	    else
 		c->max_limit = MIN( c->max_limit, l );
+	    l = MAX( throttles[tnum].bucket.burst / throttles[tnum].num_sending, 1 );
+	    if ( cc->bucket.burst == THROTTLE_NOLIMIT )
+		cc->bucket.burst = l;
+	    else
+		cc->bucket.burst = MIN( cc->bucket.burst, l );
 	    l = throttles[tnum].min_limit;
-	    if ( c->min_limit == THROTTLE_NOLIMIT )
-		c->min_limit = l;
+	    if ( cc->min_limit == THROTTLE_NOLIMIT )
+		cc->min_limit = l;
 	    else
-		c->min_limit = MAX( c->min_limit, l );
+		cc->min_limit = MAX( cc->min_limit, l );
 	    }
+    /* A new connection starts with a full bucket. */
+    cc->bucket.tokens = cc->bucket.burst;
+    cc->bucket.filled_at = *tvP;
+    cc->bytes_since_avg = 0;
     return 1;
     }
 
@@ -2080,20 +2603,67 @@ check_throttles( connecttab* c )
 static void
 clear_throttles( connecttab* c, struct timeval* tvP )
     {
+    connectcold* cc = COLD( c );
     int tind;
 
     for ( tind = 0; tind < c->numtnums; ++tind )
-	--throttles[c->tnums[tind]].num_sending;
+	{
+	--throttles[cc->tnums[tind]].num_sending;
+	throttle_unlink( c, tind );
+	}
+    c->numtnums = 0;
+    }
+
+
+/* A connection is on the sender list of each throttle it counts against,
+** so update_throttles() can go straight to them.  It may be on several,
+** so the list nodes are numbered cnum * MAXTHROTTLENUMS + tind, and the
+** links for each are in tprev[tind] and tnext[tind].
+*/
+#define NODE_CONN(n) ( (n) / MAXTHROTTLENUMS )
+#define NODE_TIND(n) ( (n) % MAXTHROTTLENUMS )
+#define IS_SENDING(c) ( (c)->conn_state == CNST_SENDING || \
+    (c)->conn_state == CNST_PAUSING || (c)->conn_state == CNST_CGI )
+
+static void
+throttle_link( connecttab* c, int tind )
+    {
+    connectcold* cc = COLD( c );
+    throttletab* t = &throttles[cc->tnums[tind]];
+    int node = ( c - connects ) * MAXTHROTTLENUMS + tind;
+
+    cc->tprev[tind] = -1;
+    cc->tnext[tind] = t->senders;
+    if ( t->senders != -1 )
+	colds[NODE_CONN( t->senders )].tprev[NODE_TIND( t->senders )] = node;
+    t->senders = node;
+    }
+
+
+static void
+throttle_unlink( connecttab* c, int tind )
+    {
+    connectcold* cc = COLD( c );
+    throttletab* t = &throttles[cc->tnums[tind]];
+    int prev = cc->tprev[tind];
+    int next = cc->tnext[tind];
+
+    if ( prev != -1 )
+	colds[NODE_CONN( prev )].tnext[NODE_TIND( prev )] = next;
+    else
+	t->senders = next;
+    if ( next != -1 )
+	colds[NODE_CONN( next )].tprev[NODE_TIND( next )] = prev;
     }
 
 
 static void
 update_throttles( ClientData client_data, struct timeval* nowP )
     {
-    int tnum, tind;
-    int cnum;
+    int tnum, node;
     connecttab* c;
-    long l;
+    connectcold* cc;
+    long l, b;
 
     /* Update the average sending rate for each throttle.  This is only used
     ** when new connections start up.
@@ -2116,29 +2686,559 @@ update_throttles( ClientData client_data, struct timeval* nowP )
 	    }
 	}
 
-    /* Now update the sending rate on all the currently-sending connections,
-    ** redistributing it evenly.
+    /* Now update the sending rate and burst on all the currently-sending
+    ** connections, sharing them out fairly.  Each one gets the smallest
+    ** of its shares, so first work out the shares and clear them all,
+    ** then walk each throttle's senders.  Connections without throttles
+    ** have no limit and needn't be visited.
     */
-    for ( cnum = 0; cnum < max_connects; ++cnum )
-	{
-	c = &connects[cnum];
-	if ( c->conn_state == CNST_SENDING || c->conn_state == CNST_PAUSING )
+    for ( tnum = 0; tnum < numthrottles; ++tnum )
+	if ( throttles[tnum].senders != -1 )
+	    throttles[tnum].level = throttle_level( &throttles[tnum] );
+    for ( tnum = 0; tnum < numthrottles; ++tnum )
+	for ( node = throttles[tnum].senders; node != -1;
+	      node = colds[NODE_CONN( node )].tnext[NODE_TIND( node )] )
 	    {
-	    c->max_limit = THROTTLE_NOLIMIT;
-	    for ( tind = 0; tind < c->numtnums; ++tind )
+	    c = &connects[NODE_CONN( node )];
+	    if ( IS_SENDING( c ) )
 		{
-		tnum = c->tnums[tind];
-		l = throttles[tnum].max_limit / throttles[tnum].num_sending;
-		if ( c->max_limit == THROTTLE_NOLIMIT )
-		    c->max_limit = l;
-		else
-		    c->max_limit = MIN( c->max_limit, l );
+		c->max_limit = COLD( c )->bucket.burst = THROTTLE_NOLIMIT;
+		COLD( c )->bytes_since_avg = 0;
 		}
 	    }
+    for ( tnum = 0; tnum < numthrottles; ++tnum )
+	{
+	if ( throttles[tnum].senders == -1 )
+	    continue;
+	l = throttles[tnum].level;
+	b = MAX( throttles[tnum].bucket.burst / throttles[tnum].num_sending, 1 );
+	for ( node = throttles[tnum].senders; node != -1;
+	      node = colds[NODE_CONN( node )].tnext[NODE_TIND( node )] )
+	    {
+	    c = &connects[NODE_CONN( node )];
+	    if ( ! IS_SENDING( c ) )
+		continue;
+	    cc = COLD( c );
+	    if ( c->max_limit == THROTTLE_NOLIMIT )
+		c->max_limit = l;
+	    else
+		c->max_limit = MIN( c->max_limit, l );
+	    if ( cc->bucket.burst == THROTTLE_NOLIMIT )
+		cc->bucket.burst = b;
+	    else
+		cc->bucket.burst = MIN( cc->bucket.burst, b );
+	    if ( cc->bucket.tokens > cc->bucket.burst )
+		cc->bucket.tokens = cc->bucket.burst;
+	    }
+	}
+    }
+
+
+/* Works out a max-min fair share of a throttle's rate.  An even split
+** would waste the share of any connection that can't keep up, for network
+** reasons or whatever, while capping the ones that could use more.  So
+** connections that sent well under the share last time are taken to be
+** limited elsewhere; what they actually used is set aside, and the rest
+** is split among the others.  That raises the share, which may show up
+** more slow ones, so repeat until it settles.  Everybody gets the final
+** share as their limit, and the throttle's own bucket keeps the total
+** within max_limit.
+*/
+static long
+throttle_level( throttletab* t )
+    {
+    int node, n, m;
+    long level, prev, used, demand;
+    connecttab* c;
+
+    n = 0;
+    for ( node = t->senders; node != -1;
+	  node = colds[NODE_CONN( node )].tnext[NODE_TIND( node )] )
+	if ( IS_SENDING( &connects[NODE_CONN( node )] ) )
+	    ++n;
+    if ( n == 0 )
+	return t->max_limit;
+    level = t->max_limit / n;
+    do
+	{
+	prev = level;
+	used = 0;
+	m = 0;
+	for ( node = t->senders; node != -1;
+	      node = colds[NODE_CONN( node )].tnext[NODE_TIND( node )] )
+	    {
+	    c = &connects[NODE_CONN( node )];
+	    if ( ! IS_SENDING( c ) )
+		continue;
+	    demand = COLD( c )->bytes_since_avg / THROTTLE_TIME;
+	    if ( demand < prev / 4 * 3 )
+		{
+		used += demand;
+		++m;
+		}
+	    }
+	/* If nobody can use their share, anybody may use it all. */
+	if ( m == n )
+	    return t->max_limit;
+	level = ( t->max_limit - used ) / ( n - m );
+	}
+    while ( level > prev );
+    return level;
+    }
+
+
+/* Adds the tokens that have built up since the bucket was last filled.
+** The fill time only moves on by whole milliseconds, and not at all until
+** there's at least a byte to add, so slow rates still add up.
+*/
+static void
+bucket_fill( tokenbucket* b, long rate, struct timeval* tvP )
+    {
+    long msecs, add;
+
+    msecs = ( tvP->tv_sec - b->filled_at.tv_sec ) * 1000L +
+	( tvP->tv_usec - b->filled_at.tv_usec ) / 1000L;
+    if ( msecs <= 0 )
+	return;
+    if ( rate <= 0 || msecs >= ( b->burst / rate + 1 ) * 1000L )
+	{
+	/* Long enough to fill it, or nothing to fill it with. */
+	if ( rate > 0 )
+	    b->tokens = b->burst;
+	b->filled_at = *tvP;
+	return;
+	}
+    add = rate / 1000L * msecs + rate % 1000L * msecs / 1000L;
+    if ( add <= 0 )
+	return;
+    b->tokens = MIN( b->tokens + add, b->burst );
+    b->filled_at.tv_sec += msecs / 1000L;
+    b->filled_at.tv_usec += ( msecs % 1000L ) * 1000L;
+    if ( b->filled_at.tv_usec >= 1000000L )
+	{
+	b->filled_at.tv_sec += b->filled_at.tv_usec / 1000000L;
+	b->filled_at.tv_usec %= 1000000L;
+	}
+    }
+
+
+/* How many milliseconds until the bucket holds want bytes, or as many as
+** it can hold.
+*/
+static long
+bucket_wait( tokenbucket* b, long rate, long want )
+    {
+    long need;
+
+    need = MIN( want, b->burst ) - b->tokens;
+    if ( need <= 0 )
+	return 0;
+    if ( rate <= 0 )
+	return 1000L;
+    return need / rate * 1000L + need % rate * 1000L / rate + 1;
+    }
+
+
+/* A throttled connection may send as many bytes as there are tokens in
+** both its own bucket and those of all its throttles.
+*/
+static long
+throttle_allowance( connecttab* c, struct timeval* tvP )
+    {
+    connectcold* cc = COLD( c );
+    throttletab* t;
+    int tind;
+    long allowed;
+
+    bucket_fill( &cc->bucket, c->max_limit, tvP );
+    allowed = cc->bucket.tokens;
+    for ( tind = 0; tind < c->numtnums; ++tind )
+	{
+	t = &throttles[cc->tnums[tind]];
+	bucket_fill( &t->bucket, t->max_limit, tvP );
+	allowed = MIN( allowed, t->bucket.tokens );
+	}
+    return allowed;
+    }
+
+
+/* How many milliseconds until a throttled connection can send want
+** bytes, or a full bucket's worth, or 0 if it can go ahead now.
+*/
+static long
+throttle_delay( connecttab* c, struct timeval* tvP, long want )
+    {
+    connectcold* cc = COLD( c );
+    throttletab* t;
+    int tind;
+    long msecs;
+
+    bucket_fill( &cc->bucket, c->max_limit, tvP );
+    msecs = bucket_wait( &cc->bucket, c->max_limit, want );
+    for ( tind = 0; tind < c->numtnums; ++tind )
+	{
+	t = &throttles[cc->tnums[tind]];
+	bucket_fill( &t->bucket, t->max_limit, tvP );
+	msecs = MAX( msecs, bucket_wait( &t->bucket, t->max_limit, want ) );
+	}
+    return msecs;
+    }
+
+
+/* Takes bytes that were just sent out of all the connection's buckets,
+** and counts them towards its throttles' rolling averages.
+*/
+static void
+throttle_debit( connecttab* c, long bytes )
+    {
+    connectcold* cc = COLD( c );
+    throttletab* t;
+    int tind;
+
+    cc->bucket.tokens -= bytes;
+    cc->bytes_since_avg += bytes;
+    for ( tind = 0; tind < c->numtnums; ++tind )
+	{
+	t = &throttles[cc->tnums[tind]];
+	t->bucket.tokens -= bytes;
+	t->bytes_since_avg += bytes;
+	}
+    }
+
+
+/* Stops watching a throttled connection, and sets a timer to get it
+** going again after msecs.
+*/
+static void
+throttle_pause( connecttab* c, struct timeval* tvP, long msecs )
+    {
+    connectcold* cc = COLD( c );
+    ClientData client_data;
+
+    if ( c->conn_state == CNST_CGI )
+	cgi_watch( c, -1, -1, -1 );
+    else
+	{
+	set_conn_state( c, CNST_PAUSING );
+	fdwatch_del_fd( c->hc->conn_fd );
+	}
+    client_data.p = c;
+    if ( cc->wakeup_timer != (Timer*) 0 )
+	syslog( LOG_ERR, "replacing non-null wakeup_timer!" );
+    cc->wakeup_timer = tmr_create(
+	tvP, wakeup_connection, client_data, msecs, 0 );
+    if ( cc->wakeup_timer == (Timer*) 0 )
+	{
+	syslog( LOG_CRIT, "tmr_create(wakeup_connection) failed" );
+	exit( 1 );
+	}
+    }
+
+
+/* Gets a relayed CGI going, or puts it in the queue if there are already
+** too many running, or parks it if another request is about to fill the
+** cache with the same response.  A response that came out of the cache
+** gets sent like a file.
+*/
+static void
+cgi_begin( connecttab* c, struct timeval* tvP )
+    {
+    httpd_conn* hc = c->hc;
+    connectcold* cc = COLD( c );
+
+    switch ( hc->cgi_state )
+	{
+	case CGIS_NONE:
+	start_send( c, tvP );
+	return;
+	case CGIS_WAIT:
+	cgi_enqueue( c, tvP );
+	return;
+	case CGIS_CACHEWAIT:
+	cgi_park( c, tvP );
+	return;
+	}
+    set_conn_state( c, CNST_CGI );
+    c->next_byte_index = 0;
+    cc->cgi_watch_rw = FDW_READ;
+    cc->cgi_watch_wfd = cc->cgi_watch_rfd = -1;
+    handle_cgi( c, tvP );
+    }
+
+
+/* Adds a connection to the end of the CGI queue, or sends a 503 if the
+** queue is full.  A queued connection isn't watched at all; any request
+** body just waits in the socket.
+*/
+static void
+cgi_enqueue( connecttab* c, struct timeval* tvP )
+    {
+    httpd_conn* hc = c->hc;
+    connectcold* cc = COLD( c );
+    int cnum = c - connects;	/* division by sizeof is implied */
+
+#ifdef CGI_QUEUE_SIZE
+    if ( cgi_queue_len >= CGI_QUEUE_SIZE )
+#endif /* CGI_QUEUE_SIZE */
+	{
+	++stats_cgi_rejected;
+	hc->cgi_state = CGIS_NONE;
+	httpd_send_err(
+	    hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
+	finish_connection( c, tvP );
+	return;
+	}
+    fdwatch_del_fd( hc->conn_fd );
+    c->active_at = tvP->tv_sec;
+    set_conn_state( c, CNST_CGIWAIT );
+    cc->queued_at = *tvP;
+    cc->next_queued = -1;
+    if ( cgi_queue_tail == -1 )
+	cgi_queue_head = cnum;
+    else
+	colds[cgi_queue_tail].next_queued = cnum;
+    cgi_queue_tail = cnum;
+    ++cgi_queue_len;
+    ++stats_cgi_queued;
+    if ( cgi_queue_len > stats_cgi_queue_max )
+	stats_cgi_queue_max = cgi_queue_len;
+    }
+
+
+/* Takes the connection at the head of the CGI queue, and puts it back in
+** the reading state, watched, for whatever happens to it next.
+*/
+static connecttab*
+cgi_dequeue( struct timeval* tvP )
+    {
+    connecttab* c;
+    long wait;
+
+    c = &connects[cgi_queue_head];
+    cgi_queue_head = COLD( c )->next_queued;
+    if ( cgi_queue_head == -1 )
+	cgi_queue_tail = -1;
+    --cgi_queue_len;
+
+    wait = ( tvP->tv_sec - COLD( c )->queued_at.tv_sec ) * 1000L +
+	( tvP->tv_usec - COLD( c )->queued_at.tv_usec ) / 1000L;
+    ++stats_cgi_waited;
+    stats_cgi_wait += wait;
+    if ( wait > stats_cgi_wait_max )
+	stats_cgi_wait_max = wait;
+
+    set_conn_state( c, CNST_READING );
+    fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+    return c;
+    }
+
+
+/* Starts queued CGIs, oldest first, as long as there's room. */
+static void
+cgi_dispatch( struct timeval* tvP )
+    {
+    connecttab* c;
+
+    while ( cgi_queue_head != -1 &&
+	    ( hs->cgi_limit == 0 || hs->cgi_count < hs->cgi_limit ) )
+	{
+	c = cgi_dequeue( tvP );
+	if ( httpd_start_cgi( c->hc ) < 0 )
+	    {
+	    finish_connection( c, tvP );
+	    continue;
+	    }
+	c->active_at = tvP->tv_sec;
+	cgi_begin( c, tvP );
+	}
+    }
+
+
+/* Parks a connection until the CGI cache entry it wants has been filled
+** by another request.
+*/
+static void
+cgi_park( connecttab* c, struct timeval* tvP )
+    {
+    connectcold* cc = COLD( c );
+
+    fdwatch_del_fd( c->hc->conn_fd );
+    set_conn_state( c, CNST_CACHEWAIT );
+    cc->next_queued = cgi_waiters;
+    cgi_waiters = c - connects;	/* division by sizeof is implied */
+    }
+
+
+/* Takes a connection off the list of those waiting for the CGI cache,
+** and puts it back in the reading state, watched.
+*/
+static void
+cgi_unpark( connecttab* c )
+    {
+    connectcold* cc = COLD( c );
+    int* np;
+
+    for ( np = &cgi_waiters; *np != -1; np = &colds[*np].next_queued )
+	if ( &connects[*np] == c )
+	    {
+	    *np = cc->next_queued;
+	    break;
+	    }
+    set_conn_state( c, CNST_READING );
+    fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+    }
+
+
+/* Something in the CGI cache got filled or given up on, so everyone
+** waiting on it tries again.  Most will get a hit; the ones waiting on
+** some other entry just get parked again.
+*/
+static void
+cgi_wake( struct timeval* tvP )
+    {
+    int cnum;
+    connecttab* c;
+
+    waiters_generation = cgicache_generation();
+    cnum = cgi_waiters;
+    cgi_waiters = -1;
+    while ( cnum != -1 )
+	{
+	c = &connects[cnum];
+	cnum = COLD( c )->next_queued;
+	set_conn_state( c, CNST_READING );
+	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
+	if ( httpd_start_cgi( c->hc ) < 0 )
+	    {
+	    finish_connection( c, tvP );
+	    continue;
+	    }
+	cgi_begin( c, tvP );
+	}
+    }
+
+
+static void
+handle_cgi( connecttab* c, struct timeval* tvP )
+    {
+    connectcold* cc = COLD( c );
+    size_t max_bytes;
+    int wfd, rfd, rw, r;
+    off_t sz;
+    long allowed, delay;
+    httpd_conn* hc = c->hc;
+
+    /* Throttled the same way as files. */
+    if ( c->max_limit == THROTTLE_NOLIMIT )
+	max_bytes = 1000000000L;
+    else
+	{
+	allowed = throttle_allowance( c, tvP );
+	if ( allowed <= 0 )
+	    {
+	    throttle_pause(
+		c, tvP, throttle_delay( c, tvP, cc->bucket.burst ) );
+	    return;
+	    }
+	max_bytes = allowed;
+	}
+    r = httpd_cgi_relay( hc, max_bytes, &wfd, &rfd );
+
+    /* Count what got sent; next_byte_index tracks how much of it the
+    ** throttles have already seen.
+    */
+    sz = hc->bytes_sent - c->next_byte_index;
+    if ( sz > 0 )
+	{
+	c->next_byte_index = hc->bytes_sent;
+	throttle_debit( c, sz );
+	}
+
+    switch ( r )
+	{
+	case CR_WANT_READ:
+	rw = FDW_READ;
+	break;
+	case CR_WANT_WRITE:
+	rw = FDW_WRITE;
+	break;
+	case CR_WANT_NONE:
+	rw = -1;
+	break;
+	default:
+	/* All done. */
+	cgi_unwatch( c );
+	finish_connection( c, tvP );
+	return;
+	}
+    c->active_at = tvP->tv_sec;
+
+    /* If we're throttling and the buckets have run low, pause.  While
+    ** paused the connection isn't watched at all.
+    */
+    if ( c->max_limit != THROTTLE_NOLIMIT )
+	{
+	delay = throttle_delay( c, tvP, cc->bucket.burst );
+	if ( delay > 0 )
+	    {
+	    throttle_pause( c, tvP, delay );
+	    return;
+	    }
+	}
+
+    cgi_watch( c, rw, wfd, rfd );
+    }
+
+
+/* Changes what a relayed CGI connection is watching: the client for rw,
+** which is FDW_READ, FDW_WRITE or -1 for neither, and the CGI's
+** descriptors for writing and reading, or -1.  They all get the same
+** client data, so any of them being ready runs handle_cgi().
+*/
+static void
+cgi_watch( connecttab* c, int rw, int wfd, int rfd )
+    {
+    connectcold* cc = COLD( c );
+
+    if ( rw != cc->cgi_watch_rw )
+	{
+	if ( cc->cgi_watch_rw != -1 )
+	    fdwatch_del_fd( c->hc->conn_fd );
+	if ( rw != -1 )
+	    fdwatch_add_fd( c->hc->conn_fd, c, rw );
+	cc->cgi_watch_rw = rw;
+	}
+    if ( wfd != cc->cgi_watch_wfd )
+	{
+	if ( cc->cgi_watch_wfd >= 0 )
+	    fdwatch_del_fd( cc->cgi_watch_wfd );
+	if ( wfd >= 0 )
+	    fdwatch_add_fd( wfd, c, FDW_WRITE );
+	cc->cgi_watch_wfd = wfd;
+	}
+    if ( rfd != cc->cgi_watch_rfd )
+	{
+	if ( cc->cgi_watch_rfd >= 0 )
+	    fdwatch_del_fd( cc->cgi_watch_rfd );
+	if ( rfd >= 0 )
+	    fdwatch_add_fd( rfd, c, FDW_READ );
+	cc->cgi_watch_rfd = rfd;
 	}
     }
 
 
+/* Go back to watching the client, so the relayed CGI connection can be
+** cleared like any other.
+*/
+static void
+cgi_unwatch( connecttab* c )
+    {
+    cgi_watch( c, FDW_READ, -1, -1 );
+    httpd_cgi_close( c->hc );
+    set_conn_state( c, CNST_SENDING );
+    }
+
+
 static void
 finish_connection( connecttab* c, struct timeval* tvP )
     {
@@ -2153,12 +3253,13 @@ finish_connection( connecttab* c, struct timeval* tvP )
 static void
 clear_connection( connecttab* c, struct timeval* tvP )
     {
+    connectcold* cc = COLD( c );
     ClientData client_data;
 
-    if ( c->wakeup_timer != (Timer*) 0 )
+    if ( cc->wakeup_timer != (Timer*) 0 )
 	{
-	tmr_cancel( c->wakeup_timer );
-	c->wakeup_timer = 0;
+	tmr_cancel( cc->wakeup_timer );
+	cc->wakeup_timer = 0;
 	}
 
     /* This is our version of Apache's lingering_close() routine, which is
@@ -2175,23 +3276,24 @@ clear_connection( connecttab* c, struct timeval* tvP )
     if ( c->conn_state == CNST_LINGERING )
 	{
 	/* If we were already lingering, shut down for real. */
-	tmr_cancel( c->linger_timer );
-	c->linger_timer = (Timer*) 0;
+	tmr_cancel( cc->linger_timer );
+	cc->linger_timer = (Timer*) 0;
 	c->hc->should_linger = 0;
 	}
     if ( c->hc->should_linger )
 	{
 	if ( c->conn_state != CNST_PAUSING )
 	    fdwatch_del_fd( c->hc->conn_fd );
-	c->conn_state = CNST_LINGERING;
+	set_conn_state( c, CNST_LINGERING );
 	shutdown( c->hc->conn_fd, SHUT_WR );
 	fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
 	client_data.p = c;
-	if ( c->linger_timer != (Timer*) 0 )
+	if ( cc->linger_timer != (Timer*) 0 )
 	    syslog( LOG_ERR, "replacing non-null linger_timer!" );
-	c->linger_timer = tmr_create(
-	    tvP, linger_clear_connection, client_data, LINGER_TIME, 0 );
-	if ( c->linger_timer == (Timer*) 0 )
+	cc->linger_timer = tmr_create(
+	    tvP, linger_clear_connection, client_data,
+	    overload_cut( linger_time ), 0 );
+	if ( cc->linger_timer == (Timer*) 0 )
 	    {
 	    syslog( LOG_CRIT, "tmr_create(linger_clear_connection) failed" );
 	    exit( 1 );
@@ -2205,56 +3307,264 @@ clear_connection( connecttab* c, struct timeval* tvP )
 static void
 really_clear_connection( connecttab* c, struct timeval* tvP )
     {
+    connectcold* cc = COLD( c );
+
     stats_bytes += c->hc->bytes_sent;
     if ( c->conn_state != CNST_PAUSING )
 	fdwatch_del_fd( c->hc->conn_fd );
     httpd_close_conn( c->hc, tvP );
     clear_throttles( c, tvP );
-    if ( c->linger_timer != (Timer*) 0 )
+    if ( cc->linger_timer != (Timer*) 0 )
 	{
-	tmr_cancel( c->linger_timer );
-	c->linger_timer = 0;
+	tmr_cancel( cc->linger_timer );
+	cc->linger_timer = 0;
 	}
-    c->conn_state = CNST_FREE;
-    c->next_free_connect = first_free_connect;
+    if ( cc->deadline_timer != (Timer*) 0 )
+	{
+	tmr_cancel( cc->deadline_timer );
+	cc->deadline_timer = (Timer*) 0;
+	}
+    set_conn_state( c, CNST_FREE );
+    cc->next_free_connect = first_free_connect;
     first_free_connect = c - connects;	/* division by sizeof is implied */
     --num_connects;
     }
 
 
+/* How many seconds a connection may sit in its current state with
+** nothing happening, or 0 if the state doesn't time out.  Lingering
+** connections have their own timer, and connections waiting to run a
+** CGI are timed from when they joined the queue.  With minimum rates on,
+** reading and sending connections get checked at least once a window.
+*/
+static int
+conn_timelimit( connecttab* c )
+    {
+    int limit;
+
+    switch ( c->conn_state )
+	{
+	case CNST_READING:
+	limit = overload_cut( read_timeout );
+	if ( rate_window > 0 && min_read_bytes > 0 && rate_window < limit )
+	    limit = rate_window;
+	return limit;
+	case CNST_SENDING:
+	limit = overload_cut( send_timeout );
+	if ( rate_window > 0 && min_send_bytes > 0 && rate_window < limit )
+	    limit = rate_window;
+	return limit;
+	case CNST_PAUSING:
+	return send_timeout;
+	case CNST_CACHEWAIT:
+	case CNST_CGIWAIT:
+#ifdef CGI_QUEUE_TIMELIMIT
+	return CGI_QUEUE_TIMELIMIT;
+#else /* CGI_QUEUE_TIMELIMIT */
+	return send_timeout;
+#endif /* CGI_QUEUE_TIMELIMIT */
+	case CNST_CGI:
+#ifdef CGI_TIMELIMIT
+	return CGI_TIMELIMIT;
+#else /* CGI_TIMELIMIT */
+	return send_timeout;
+#endif /* CGI_TIMELIMIT */
+	default:
+	return 0;
+	}
+    }
+
+
+/* Each connection has at most one deadline timer, for when its current
+** state would time out if nothing more happened.  Reads and writes just
+** bump active_at and leave the timer where it is; when it goes off,
+** deadline_connection() moves it forward if there was activity in the
+** meantime.  So it only needs moving here, when a change of state
+** brings the deadline in.
+*/
 static void
-idle( ClientData client_data, struct timeval* nowP )
+arm_deadline( connecttab* c )
+    {
+    connectcold* cc = COLD( c );
+    int limit;
+    struct timeval base;
+    ClientData client_data;
+
+    limit = conn_timelimit( c );
+    if ( limit <= 0 )
+	return;
+    base.tv_sec = c->active_at;
+    base.tv_usec = 0;
+    if ( cc->deadline_timer != (Timer*) 0 )
+	{
+	if ( cc->deadline_timer->time.tv_sec <= c->active_at + limit )
+	    return;
+	cc->deadline_timer->msecs = limit * 1000L;
+	tmr_reset( &base, cc->deadline_timer );
+	return;
+	}
+    client_data.p = c;
+    cc->deadline_timer = tmr_create(
+	&base, deadline_connection, client_data, limit * 1000L, 0 );
+    if ( cc->deadline_timer == (Timer*) 0 )
+	{
+	syslog( LOG_CRIT, "tmr_create(deadline_connection) failed" );
+	exit( 1 );
+	}
+    }
+
+
+static void
+deadline_connection( ClientData client_data, struct timeval* nowP )
     {
-    int cnum;
     connecttab* c;
+    int limit;
 
-    for ( cnum = 0; cnum < max_connects; ++cnum )
+    c = (connecttab*) client_data.p;
+    COLD( c )->deadline_timer = (Timer*) 0;
+    limit = conn_timelimit( c );
+    if ( limit <= 0 )
+	return;
+    if ( ! rate_ok( c, nowP ) )
 	{
-	c = &connects[cnum];
-	switch ( c->conn_state )
-	    {
-	    case CNST_READING:
-	    if ( nowP->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT )
-		{
-		syslog( LOG_INFO,
-		    "%.80s connection timed out reading",
-		    httpd_ntoa( &c->hc->client_addr ) );
-		httpd_send_err(
-		    c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
-		finish_connection( c, nowP );
-		}
-	    break;
-	    case CNST_SENDING:
-	    case CNST_PAUSING:
-	    if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
-		{
-		syslog( LOG_INFO,
-		    "%.80s connection timed out sending",
-		    httpd_ntoa( &c->hc->client_addr ) );
-		clear_connection( c, nowP );
-		}
-	    break;
-	    }
+	too_slow( c, nowP );
+	return;
+	}
+    if ( nowP->tv_sec - c->active_at < limit )
+	{
+	/* Something happened since the timer was set, try again later. */
+	arm_deadline( c );
+	return;
+	}
+    switch ( c->conn_state )
+	{
+	case CNST_READING:
+	syslog( LOG_INFO,
+	    "%.80s connection timed out reading",
+	    httpd_ntoa( &c->hc->client_addr ) );
+	httpd_send_err(
+	    c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
+	finish_connection( c, nowP );
+	break;
+	case CNST_SENDING:
+	case CNST_PAUSING:
+	syslog( LOG_INFO,
+	    "%.80s connection timed out sending",
+	    httpd_ntoa( &c->hc->client_addr ) );
+	clear_connection( c, nowP );
+	break;
+	case CNST_CACHEWAIT:
+	syslog( LOG_INFO,
+	    "%.80s connection timed out waiting for cached CGI %.80s",
+	    httpd_ntoa( &c->hc->client_addr ), c->hc->expnfilename );
+	cgi_unpark( c );
+	c->hc->cgi_state = CGIS_NONE;
+	httpd_send_err(
+	    c->hc, 503, httpd_err503title, "", httpd_err503form,
+	    c->hc->encodedurl );
+	finish_connection( c, nowP );
+	break;
+	case CNST_CGIWAIT:
+	expire_cgi_queue( nowP );
+	break;
+	case CNST_CGI:
+	syslog( LOG_INFO,
+	    "%.80s connection timed out relaying CGI %.80s",
+	    httpd_ntoa( &c->hc->client_addr ), c->hc->expnfilename );
+	cgi_unwatch( c );
+	clear_connection( c, nowP );
+	break;
+	}
+    }
+
+
+/* Checks a reading or sending connection against the minimum data rate.
+** It's cheap, so it gets called on every read or write as well as from
+** the deadline timer.  Once a window has gone by, the bytes moved in it
+** have to add up to the minimum, scaled for however long it actually
+** ran; if they do, a new window starts.  Returns 0 if the client is
+** too slow.
+*/
+static int
+rate_ok( connecttab* c, struct timeval* tvP )
+    {
+    connectcold* cc = COLD( c );
+    long elapsed, min;
+
+    if ( rate_window <= 0 )
+	return 1;
+    elapsed = tvP->tv_sec - cc->window_start;
+    if ( elapsed < rate_window )
+	return 1;
+    switch ( c->conn_state )
+	{
+	case CNST_READING:
+	min = min_read_bytes;
+	break;
+	case CNST_SENDING:
+	min = min_send_bytes;
+	/* Don't expect more than the throttles will let us send. */
+	if ( c->max_limit != THROTTLE_NOLIMIT &&
+	     min > c->max_limit * rate_window / 2 )
+	    min = c->max_limit * rate_window / 2;
+	break;
+	default:
+	return 1;
+	}
+    if ( cc->window_bytes * rate_window < (off_t) min * elapsed )
+	return 0;
+    cc->window_start = tvP->tv_sec;
+    cc->window_bytes = 0;
+    return 1;
+    }
+
+
+static void
+too_slow( connecttab* c, struct timeval* tvP )
+    {
+    ++stats_too_slow;
+    if ( c->conn_state == CNST_READING )
+	{
+	syslog( LOG_INFO,
+	    "%.80s connection too slow reading",
+	    httpd_ntoa( &c->hc->client_addr ) );
+	httpd_send_err(
+	    c->hc, 408, httpd_err408title, "", httpd_err408form, "" );
+	finish_connection( c, tvP );
+	}
+    else
+	{
+	syslog( LOG_INFO,
+	    "%.80s connection too slow sending %.80s",
+	    httpd_ntoa( &c->hc->client_addr ), c->hc->encodedurl );
+	clear_connection( c, tvP );
+	}
+    }
+
+
+/* Queued CGI requests that have waited too long get turned away.  They
+** all wait the same length of time, so the ones that are due are the
+** oldest, at the head.
+*/
+static void
+expire_cgi_queue( struct timeval* nowP )
+    {
+    connecttab* c;
+
+    while ( cgi_queue_head != -1 &&
+	    nowP->tv_sec - colds[cgi_queue_head].queued_at.tv_sec >=
+	    conn_timelimit( &connects[cgi_queue_head] ) )
+	{
+	c = cgi_dequeue( nowP );
+	++stats_cgi_expired;
+	syslog( LOG_INFO,
+	    "%.80s connection timed out waiting to run CGI %.80s",
+	    httpd_ntoa( &c->hc->client_addr ), c->hc->expnfilename );
+	c->hc->cgi_state = CGIS_NONE;
+	httpd_send_err(
+	    c->hc, 503, httpd_err503title, "", httpd_err503form,
+	    c->hc->encodedurl );
+	finish_connection( c, nowP );
 	}
     }
 
@@ -2265,12 +3575,14 @@ wakeup_connection( ClientData client_data, struct timeval* nowP )
     connecttab* c;
 
     c = (connecttab*) client_data.p;
-    c->wakeup_timer = (Timer*) 0;
+    COLD( c )->wakeup_timer = (Timer*) 0;
     if ( c->conn_state == CNST_PAUSING )
 	{
-	c->conn_state = CNST_SENDING;
+	set_conn_state( c, CNST_SENDING );
 	fdwatch_add_fd( c->hc->conn_fd, c, FDW_WRITE );
 	}
+    else if ( c->conn_state == CNST_CGI )
+	handle_cgi( c, nowP );
     }
 
 static void
@@ -2279,7 +3591,7 @@ linger_clear_connection( ClientData client_data, struct timeval* nowP )
     connecttab* c;
 
     c = (connecttab*) client_data.p;
-    c->linger_timer = (Timer*) 0;
+    COLD( c )->linger_timer = (Timer*) 0;
     really_clear_connection( c, nowP );
     }
 
@@ -2288,11 +3600,30 @@ static void
 occasional( ClientData client_data, struct timeval* nowP )
     {
     mmc_cleanup( nowP );
+    cgicache_cleanup( nowP );
+    authcache_cleanup( nowP );
+    httpd_tilde_cleanup( nowP );
     tmr_cleanup();
     watchdog_flag = 1;		/* let the watchdog know that we are alive */
     }
 
 
+static void
+expire_clients( ClientData client_data, struct timeval* nowP )
+    {
+    clientlimit_cleanup( nowP );
+    }
+
+
+#ifdef FCGI_IDLE_TIME
+static void
+retire_fcgi( ClientData client_data, struct timeval* nowP )
+    {
+    fcgi_cleanup();
+    }
+#endif /* FCGI_IDLE_TIME */
+
+
 #ifdef STATS_TIME
 static void
 show_stats( ClientData client_data, struct timeval* nowP )
@@ -2327,6 +3658,11 @@ logstats( struct timeval* nowP )
     thttpd_logstats( stats_secs );
     httpd_logstats( stats_secs );
     mmc_logstats( stats_secs );
+    arena_logstats( stats_secs );
+    fcgi_logstats( stats_secs );
+    cgicache_logstats( stats_secs );
+    authcache_logstats( stats_secs );
+    clientlimit_logstats( stats_secs );
     fdwatch_logstats( stats_secs );
     tmr_logstats( stats_secs );
     }
@@ -2355,4 +3691,38 @@ thttpd_logstats( long secs )
 #endif
     stats_bytes = 0;
     stats_simultaneous = 0;
+
+    if ( stats_cgi_queued > 0 || stats_cgi_rejected > 0 || cgi_queue_len > 0 )
+	syslog( LOG_NOTICE,
+	    "  thttpd - %d CGIs queued now, %d max, %ld queued, %ld rejected, %ld timed out, %g msec avg wait, %ld msec max wait",
+	    cgi_queue_len, stats_cgi_queue_max, stats_cgi_queued,
+	    stats_cgi_rejected, stats_cgi_expired,
+	    stats_cgi_waited > 0 ?
+		(float) stats_cgi_wait / stats_cgi_waited : 0.0,
+	    stats_cgi_wait_max );
+    stats_cgi_queued = 0;
+    stats_cgi_rejected = 0;
+    stats_cgi_expired = 0;
+    stats_cgi_waited = 0;
+    stats_cgi_wait = 0;
+    stats_cgi_wait_max = 0;
+    stats_cgi_queue_max = cgi_queue_len;
+
+    syslog( LOG_NOTICE,
+	"  thttpd - %g msec avg loop lag, %g msec max, %g msec now, %ld connections shed, %ld times stopped accepting",
+	stats_lag_rounds > 0 ?
+	    (float) stats_lag_total / stats_lag_rounds / 1000.0 : 0.0,
+	(float) stats_lag_max / 1000.0, (float) loop_lag / 1000.0,
+	stats_shed, stats_stopped );
+    stats_lag_total = 0;
+    stats_lag_rounds = 0;
+    stats_lag_max = 0;
+    stats_shed = 0;
+    stats_stopped = 0;
+
+    if ( stats_too_slow > 0 )
+	syslog( LOG_NOTICE,
+	    "  thttpd - %ld connections dropped for being too slow",
+	    stats_too_slow );
+    stats_too_slow = 0;
     }
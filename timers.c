@@ -245,17 +245,42 @@ tmr_mstimeout( struct timeval* nowP )
     }
 
 
+long
+tmr_overdue( struct timeval* nowP )
+    {
+    int h;
+    long late, l;
+    Timer* t;
+
+    late = 0;
+    for ( h = 0; h < HASH_SIZE; ++h )
+	{
+	t = timers[h];
+	if ( t != (Timer*) 0 )
+	    {
+	    l = ( nowP->tv_sec - t->time.tv_sec ) * 1000L +
+		( nowP->tv_usec - t->time.tv_usec ) / 1000L;
+	    if ( l > late )
+		late = l;
+	    }
+	}
+    return late;
+    }
+
+
 void
 tmr_run( struct timeval* nowP )
     {
     int h;
     Timer* t;
-    Timer* next;
 
+    /* A timer procedure may cancel or create other timers, so rather than
+    ** hold on to a next pointer we go back to the head of the list after
+    ** each one.  Whatever just ran is no longer there.
+    */
     for ( h = 0; h < HASH_SIZE; ++h )
-	for ( t = timers[h]; t != (Timer*) 0; t = next )
+	while ( ( t = timers[h] ) != (Timer*) 0 )
 	    {
-	    next = t->next;
 	    /* Since the lists are sorted, as soon as we find a timer
 	    ** that isn't ready yet, we can go on to the next list.
 	    */
@@ -274,7 +299,13 @@ tmr_run( struct timeval* nowP )
 		    t->time.tv_sec += t->time.tv_usec / 1000000L;
 		    t->time.tv_usec %= 1000000L;
 		    }
-		l_resort( t );
+		/* If we fell behind, skip the ticks we missed. */
+		if ( t->time.tv_sec < nowP->tv_sec ||
+		     ( t->time.tv_sec == nowP->tv_sec &&
+		       t->time.tv_usec <= nowP->tv_usec ) )
+		    tmr_reset( nowP, t );
+		else
+		    l_resort( t );
 		}
 	    else
 		tmr_cancel( t );
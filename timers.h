@@ -84,6 +84,11 @@ struct timeval* tmr_timeout( struct timeval* nowP );
 */
 long tmr_mstimeout( struct timeval* nowP );
 
+/* Returns how many milliseconds the earliest timer is overdue, or 0 if
+** none are.  A busy main loop shows up here as timers running late.
+*/
+long tmr_overdue( struct timeval* nowP );
+
 /* Run the list of timers. Your main program needs to call this every so often,
 ** or as indicated by tmr_timeout().
 */